@@ -6,10 +6,12 @@
 #pragma once
 
 #include <memory>
+#include <vector>
 #include <bullet/btBulletDynamicsCommon.h>
 #include <bullet/LinearMath/btAlignedAllocator.h>
 #include "../bulletShapes/bullet_cube.h"
 #include "../bulletShapes/bullet_cylinder.h"
+#include "../bulletShapes/bullet_heightfield.h"
 #include "../bulletShapes/bullet_heightmap.h"
 #include "../bulletShapes/bullet_sphere.h"
 #include "../bulletShapes/bullet_vehicle.h"
@@ -23,13 +25,18 @@ class Compound {
 public:
   Compound() { }
 
-  Compound(double* Shape_ids, double* Con_ids, Compounds type) {
-    shapeid_ = Shape_ids;
-    constraintid_ = Con_ids;
-    type_ = type;
+  // A vehicle is its body and four wheels, joined by four Hinge2s.
+  static const int kVehicleShapes = 5;
+  static const int kVehicleConstraints = 4;
+
+  // The ids are copied; the caller's arrays needn't outlive us.
+  Compound(const double* Shape_ids, int num_shapes, const double* Con_ids,
+           int num_constraints, Compounds type) :
+    shapeid_(Shape_ids, Shape_ids + num_shapes),
+    constraintid_(Con_ids, Con_ids + num_constraints), type_(type) {
   }
 
-  double* shapeid_;
-  double* constraintid_;
+  std::vector<double> shapeid_;
+  std::vector<double> constraintid_;
   Compounds type_;
 };
@@ -0,0 +1,99 @@
+#include "asyncSimulation.h"
+#include <chrono>
+
+AsyncSimulation::AsyncSimulation(BulletWorld* world) :
+  world_(world), commands_(1024), quit_(false), frame_(0)
+{
+}
+
+AsyncSimulation::~AsyncSimulation() {
+  Stop();
+}
+
+void AsyncSimulation::Start(double rate_hz) {
+  if (running()) {
+    return;
+  }
+  // The scene can't change while we run, so size the buffers once.
+  int size = 12 * world_->NumRecordedPoses(BulletWorld::RECORD_ALL);
+  scratch_.assign(size, 0);
+  poses_.assign(size, 0);
+  frame_ = 0;
+  world_->GetAllTransforms(poses_.data());
+  quit_ = false;
+  thread_ = std::thread(&AsyncSimulation::Loop, this, rate_hz);
+}
+
+void AsyncSimulation::Stop() {
+  if (!running()) {
+    return;
+  }
+  quit_ = true;
+  thread_.join();
+}
+
+bool AsyncSimulation::PushCommand(int vehicle_id, double steering,
+                                  double force) {
+  if (vehicle_id < 0 || vehicle_id >= world_->NumRaycastVehicles()) {
+    return false;
+  }
+  VehicleCommand command = {vehicle_id, steering, force};
+  return commands_.Push(command);
+}
+
+bool AsyncSimulation::PushCommands(int n, const double* ids,
+                                   const double* steering,
+                                   const double* force) {
+  if (n > (int)commands_.Free()) {
+    return false;
+  }
+  for (int i = 0; i < n; i++) {
+    if (ids[i] < 0 || ids[i] >= world_->NumRaycastVehicles()) {
+      return false;
+    }
+  }
+  for (int i = 0; i < n; i++) {
+    VehicleCommand command = {int(ids[i]), steering[i], force[i]};
+    commands_.Push(command);
+  }
+  return true;
+}
+
+long AsyncSimulation::ReadPoses(std::vector<double>* poses) {
+  std::lock_guard<std::mutex> lock(poses_mutex_);
+  *poses = poses_;
+  return frame_;
+}
+
+void AsyncSimulation::Loop(double rate_hz) {
+  std::chrono::steady_clock::duration period(0);
+  if (rate_hz > 0) {
+    period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(1.0 / rate_hz));
+  }
+  std::chrono::steady_clock::time_point next =
+      std::chrono::steady_clock::now();
+  while (!quit_) {
+    VehicleCommand command;
+    while (commands_.Pop(&command)) {
+      world_->CommandRaycastVehicle(command.vehicle_id, command.steering,
+                                    command.force);
+    }
+    world_->StepSimulation();
+    world_->GetAllTransforms(scratch_.data());
+    {
+      std::lock_guard<std::mutex> lock(poses_mutex_);
+      poses_.swap(scratch_);
+      frame_++;
+    }
+    // Keep to the schedule, but don't try to catch up after a stall.
+    next += period;
+    std::chrono::steady_clock::time_point now =
+        std::chrono::steady_clock::now();
+    if (next > now) {
+      std::this_thread::sleep_until(next);
+    } else {
+      next = now;
+    }
+  }
+}
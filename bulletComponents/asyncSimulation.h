@@ -0,0 +1,65 @@
+/**
+ * AsyncSimulation: steps a BulletWorld on a background thread at a fixed
+ * rate, so the caller can run its controller while physics runs.
+ *
+ * While it's running, the thread owns the world. The caller only talks to it
+ * through PushCommand, which queues raycast vehicle commands for the next
+ * step, and ReadPoses, which copies the most recent published poses.
+ * Only one thread may push commands.
+ * Anything that changes the scene has to wait until Stop().
+ */
+
+#pragma once
+
+#include "bulletWorld.h"
+#include "spscQueue.h"
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class AsyncSimulation {
+ public:
+  explicit AsyncSimulation(BulletWorld* world);
+  ~AsyncSimulation();
+
+  // Steps rate_hz times a second, or as fast as possible if rate_hz <= 0.
+  // Does nothing if we're already running.
+  void Start(double rate_hz);
+  void Stop();
+  bool running() {
+    return thread_.joinable();
+  }
+
+  // Applied to raycast vehicle vehicle_id right before the next step.
+  // Returns false if there's no such vehicle or the command queue is full.
+  bool PushCommand(int vehicle_id, double steering, double force);
+  // n PushCommand calls in one, command i going to ids[i]. Queues all of
+  // them or, if any id is bad or they don't all fit, none.
+  bool PushCommands(int n, const double* ids, const double* steering,
+                    const double* force);
+
+  // Copies the latest poses into *poses, 12 per body in GetAllTransforms
+  // order, and returns how many steps had run when they were taken.
+  long ReadPoses(std::vector<double>* poses);
+
+ private:
+  struct VehicleCommand {
+    int vehicle_id;
+    double steering;
+    double force;
+  };
+
+  void Loop(double rate_hz);
+
+  BulletWorld* world_;
+  SpscQueue<VehicleCommand> commands_;
+  std::thread thread_;
+  std::atomic<bool> quit_;
+  // The thread fills its own buffer after each step, then swaps it for
+  // poses_ under the lock, so readers only ever hold the lock for a copy.
+  std::vector<double> scratch_;
+  std::mutex poses_mutex_;
+  std::vector<double> poses_;
+  long frame_;
+};
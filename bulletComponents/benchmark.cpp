@@ -0,0 +1,384 @@
+/*********************************************************************
+ * File:   benchmark.cpp
+ * Headless performance suite for the physics core. Sweeps scene sizes
+ * and prints Google Benchmark style JSON, so runs from different
+ * releases can be diffed with the usual compare.py tooling.
+ *
+ * Usage: BulletBenchmark [--filter=<substring>] [--min_time=<seconds>]
+ **********************************************************************/
+
+#include <bulletWorld.h>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct BenchmarkResult {
+  std::string name;
+  long iterations;
+  double real_ns;   // per iteration
+  double cpu_ns;    // per iteration
+  double items_per_second;
+  double bytes_per_second;
+};
+
+static std::string g_filter;
+static double g_min_time = 0.5;
+static std::vector<BenchmarkResult> g_results;
+
+static bool Selected(const std::string& name) {
+  return g_filter.empty() || name.find(g_filter) != std::string::npos;
+}
+
+// Runs fn in growing batches until a batch takes at least g_min_time (or
+// reaches max_iterations), then records that batch. Each call to fn counts
+// as one iteration and processes items items / bytes bytes.
+static void Measure(const std::string& name, const std::function<void()>& fn,
+                    double items = 1, double bytes = 0,
+                    long max_iterations = 1L << 30) {
+  long iterations = 1;
+  while (true) {
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    std::clock_t cpu_start = std::clock();
+    for (long i = 0; i < iterations; i++) {
+      fn();
+    }
+    double cpu = double(std::clock() - cpu_start) / CLOCKS_PER_SEC;
+    double real = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    if (real >= g_min_time || iterations >= max_iterations) {
+      BenchmarkResult result;
+      result.name = name;
+      result.iterations = iterations;
+      result.real_ns = 1e9 * real / iterations;
+      result.cpu_ns = 1e9 * cpu / iterations;
+      result.items_per_second = items * iterations / real;
+      result.bytes_per_second = bytes * iterations / real;
+      g_results.push_back(result);
+      std::fprintf(stderr, "%-40s %12.0f ns %10ld iterations\n",
+                   name.c_str(), result.real_ns, iterations);
+      return;
+    }
+    // Aim a little past min_time so the next batch is usually the last.
+    double scale = real > 0 ? 1.4 * g_min_time / real : 10;
+    iterations = (long)(iterations * (scale < 10 ? (scale > 2 ? scale : 2)
+                                                 : 10));
+    if (iterations > max_iterations) {
+      iterations = max_iterations;
+    }
+  }
+}
+
+static void PrintJson() {
+  std::time_t now = std::time(NULL);
+  char date[64];
+  std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", std::localtime(&now));
+  std::printf("{\n  \"context\": {\n");
+  std::printf("    \"date\": \"%s\",\n", date);
+  std::printf("    \"executable\": \"BulletBenchmark\",\n");
+  std::printf("    \"num_cpus\": %u,\n", std::thread::hardware_concurrency());
+  std::printf("    \"min_time\": %g\n", g_min_time);
+  std::printf("  },\n  \"benchmarks\": [\n");
+  for (size_t i = 0; i < g_results.size(); i++) {
+    const BenchmarkResult& r = g_results[i];
+    std::printf("    {\n");
+    std::printf("      \"name\": \"%s\",\n", r.name.c_str());
+    std::printf("      \"run_type\": \"iteration\",\n");
+    std::printf("      \"iterations\": %ld,\n", r.iterations);
+    std::printf("      \"real_time\": %.3f,\n", r.real_ns);
+    std::printf("      \"cpu_time\": %.3f,\n", r.cpu_ns);
+    std::printf("      \"time_unit\": \"ns\",\n");
+    if (r.bytes_per_second > 0) {
+      std::printf("      \"bytes_per_second\": %.3f,\n", r.bytes_per_second);
+    }
+    std::printf("      \"items_per_second\": %.3f\n", r.items_per_second);
+    std::printf("    }%s\n", i + 1 < g_results.size() ? "," : "");
+  }
+  std::printf("  ]\n}\n");
+}
+
+/*********************************************************************
+ *SCENES
+ **********************************************************************/
+
+static double kIdentity[] = {1, 0, 0,
+                             0, 1, 0,
+                             0, 0, 1};
+
+// A flat ground plane (AddTerrain makes a plane when max_ht <= 1).
+static void AddGround(BulletWorld* world) {
+  double X[] = {0}, Y[] = {0}, Z[] = {0};
+  double normal[] = {0, 0, 1};
+  world->AddTerrain(1, 1, 1, 0, 0, X, Y, Z, normal);
+}
+
+// A rows x cols grid of rolling hills, one unit between samples.
+static void AddHills(BulletWorld* world, int rows, int cols) {
+  std::vector<double> X(rows * cols), Y(rows * cols), Z(rows * cols);
+  for (int j = 0; j < cols; j++) {
+    for (int i = 0; i < rows; i++) {
+      int k = i + j * rows;
+      X[k] = i - rows / 2.0;
+      Y[k] = j - cols / 2.0;
+      Z[k] = 2 * std::sin(0.3 * i) * std::cos(0.2 * j);
+    }
+  }
+  double normal[] = {0, 0, 1};
+  world->AddTerrain(rows, cols, 1, -2, 2, X.data(), Y.data(), Z.data(),
+                    normal);
+}
+
+// count spheres stacked in a square grid a little above the ground.
+static void AddSpheres(BulletWorld* world, int count) {
+  int side = (int)std::ceil(std::sqrt((double)count));
+  for (int i = 0; i < count; i++) {
+    double position[] = {2.5 * (i % side), 2.5 * (i / side), 2};
+    world->AddSphere(1, 1, 0.2, position, kIdentity);
+  }
+}
+
+// The defaults from LoadVehicleParams.m, in RaycastVehicle.GetParameters
+// order.
+static double kVehicleParameters[] = {
+  2.7, 2, 1, .247, 1.56, 0, 0, 5,           // body and friction
+  .5, .25, 1000,                            // wheels
+  -.8, 120, 5812.4, .045, .045, 10, 0, 0,   // suspension
+  -1.5, 20, 13, 0, 0,                       // steering
+  .13, 1.2685,                              // motor
+  5, 1.65, -5                               // magic formula
+};
+
+static void AddVehicles(BulletWorld* world, int count) {
+  int side = (int)std::ceil(std::sqrt((double)count));
+  for (int i = 0; i < count; i++) {
+    double position[] = {6.0 * (i % side), 6.0 * (i / side), 1};
+    world->AddRaycastVehicle(kVehicleParameters, position, kIdentity);
+  }
+}
+
+static std::string Name(const char* benchmark, const char* arg, int value) {
+  char name[128];
+  std::snprintf(name, sizeof(name), "%s/%s:%d", benchmark, arg, value);
+  return name;
+}
+
+/*********************************************************************
+ *BENCHMARKS
+ **********************************************************************/
+
+static void BenchmarkStepBodies(int bodies) {
+  std::string name = Name("StepSimulation", "bodies", bodies);
+  if (!Selected(name)) return;
+  BulletWorld world;
+  AddGround(&world);
+  AddSpheres(&world, bodies);
+  Measure(name, [&] { world.StepSimulation(); });
+}
+
+static void BenchmarkStepVehicles(int vehicles) {
+  std::string name = Name("StepSimulation", "vehicles", vehicles);
+  if (!Selected(name)) return;
+  BulletWorld world;
+  AddGround(&world);
+  AddVehicles(&world, vehicles);
+  for (int i = 0; i < vehicles; i++) {
+    world.CommandRaycastVehicle(i, 0.1, 20);
+  }
+  Measure(name, [&] { world.StepSimulation(); });
+}
+
+// The same scene as BenchmarkStepVehicles, stepped as one fleet.
+static void BenchmarkStepFleet(int vehicles) {
+  std::string name = Name("StepSimulation", "fleet", vehicles);
+  if (!Selected(name)) return;
+  BulletWorld world;
+  AddGround(&world);
+  int side = (int)std::ceil(std::sqrt((double)vehicles));
+  std::vector<double> positions, rotations;
+  for (int i = 0; i < vehicles; i++) {
+    positions.push_back(6.0 * (i % side));
+    positions.push_back(6.0 * (i / side));
+    positions.push_back(1);
+    rotations.insert(rotations.end(), kIdentity, kIdentity + 9);
+  }
+  world.AddFleet(vehicles, kVehicleParameters, positions.data(),
+                 rotations.data());
+  std::vector<double> steering(vehicles, 0.1), force(vehicles, 20);
+  world.CommandFleet(steering.data(), force.data());
+  Measure(name, [&] { world.StepSimulation(); });
+}
+
+static void BenchmarkStepTerrain(int size) {
+  std::string name = Name("StepSimulation", "terrain", size);
+  if (!Selected(name)) return;
+  BulletWorld world;
+  AddHills(&world, size, size);
+  AddVehicles(&world, 1);
+  world.CommandRaycastVehicle(0, 0.1, 20);
+  Measure(name, [&] { world.StepSimulation(); });
+}
+
+// Latency of adding one more body to a world that starts out holding
+// bodies. Every iteration grows the world, so cap them to keep the scene
+// close to its nominal size.
+static void BenchmarkAddBody(int bodies) {
+  std::string name = Name("AddBody", "bodies", bodies);
+  if (!Selected(name)) return;
+  BulletWorld world;
+  AddGround(&world);
+  AddSpheres(&world, bodies);
+  double position[] = {0, 0, 50};
+  Measure(name, [&] {
+      world.AddSphere(1, 1, 0.2, position, kIdentity);
+    }, 1, 0, 1000);
+}
+
+static void BenchmarkRaycastToGround(int size) {
+  std::string name = Name("RaycastToGround", "terrain", size);
+  if (!Selected(name)) return;
+  BulletWorld world;
+  AddHills(&world, size, size);
+  AddVehicles(&world, 1);
+  double position[3];
+  int probe = 0;
+  Measure(name, [&] {
+      // Walk the probe around so we don't keep hitting the same triangles.
+      double x = (probe % 7) - 3.0, y = (probe / 7 % 7) - 3.0;
+      probe++;
+      world.RaycastToGround(0, x, y, position);
+    });
+}
+
+// Planner-style batches of ground queries over a heightfield.
+static void BenchmarkQueryGroundHeights(int points) {
+  std::string name = Name("QueryGroundHeights", "points", points);
+  if (!Selected(name)) return;
+  BulletWorld world;
+  int size = 512;
+  std::vector<double> X(size * size), Y(size * size), Z(size * size);
+  for (int j = 0; j < size; j++) {
+    for (int i = 0; i < size; i++) {
+      int k = i + j * size;
+      X[k] = i - size / 2.0;
+      Y[k] = j - size / 2.0;
+      Z[k] = 2 * std::sin(0.3 * i) * std::cos(0.2 * j);
+    }
+  }
+  world.AddHeightfield(size, size, X.data(), Y.data(), Z.data(), false);
+  std::vector<double> xy(2 * points), z(points), normals(3 * points);
+  for (int i = 0; i < points; i++) {
+    xy[2 * i] = (i * 37 % 400) - 200.0;
+    xy[2 * i + 1] = (i * 91 % 400) - 200.0;
+  }
+  Measure(name, [&] {
+      world.QueryGroundHeights(points, xy.data(), z.data(), normals.data());
+    }, points);
+}
+
+// A lidar-like fan of rays from above the middle of a terrain mesh.
+static void BenchmarkRaycastBatch(int rays) {
+  std::string name = Name("RaycastBatch", "rays", rays);
+  if (!Selected(name)) return;
+  BulletWorld world;
+  AddHills(&world, 512, 512);
+  AddSpheres(&world, 100);
+  std::vector<double> origins(3 * rays), directions(3 * rays);
+  for (int i = 0; i < rays; i++) {
+    double angle = 2 * PI * i / rays;
+    origins[3 * i + 2] = 3;
+    directions[3 * i] = 100 * std::cos(angle);
+    directions[3 * i + 1] = 100 * std::sin(angle);
+    directions[3 * i + 2] = -3 - (i % 16);
+  }
+  std::vector<double> hits(3 * rays), fractions(rays);
+  Measure(name, [&] {
+      world.RaycastBatch(rays, origins.data(), directions.data(), hits.data(),
+                         NULL, fractions.data(), NULL);
+    }, rays);
+}
+
+// One vehicle on hills carrying a channels x 1800 lidar at 10 Hz, so each
+// step casts channels * 60 rays.
+static void BenchmarkStepLidar(int channels) {
+  std::string name = Name("StepSimulation", "lidar_channels", channels);
+  if (!Selected(name)) return;
+  BulletWorld world;
+  AddHills(&world, 512, 512);
+  AddVehicles(&world, 1);
+  world.CommandRaycastVehicle(0, 0.1, 20);
+  double mount[] = {0, 0, 1};
+  double parameters[] = {(double)channels, -0.4, 0.2, 1800, 10, 100, 1 << 20};
+  world.AddLidar(0, mount, kIdentity, parameters);
+  Measure(name, [&] { world.StepSimulation(); }, channels * 60);
+}
+
+static void BenchmarkPoseExport(int bodies) {
+  std::string name = Name("GetAllTransforms", "bodies", bodies);
+  if (!Selected(name)) return;
+  BulletWorld world;
+  AddGround(&world);
+  AddSpheres(&world, bodies);
+  int poses = world.NumRecordedPoses(BulletWorld::RECORD_ALL);
+  std::vector<double> out(12 * poses);
+  Measure(name, [&] { world.GetAllTransforms(out.data()); },
+          poses, sizeof(double) * out.size());
+}
+
+// Vehicles commanded and stepped on flat ground with every step going to a
+// trace, to set against StepSimulation/vehicles.
+static void BenchmarkStepTrace(int vehicles) {
+  std::string name = Name("StepSimulation", "traced_vehicles", vehicles);
+  if (!Selected(name)) return;
+  BulletWorld world;
+  AddGround(&world);
+  AddVehicles(&world, vehicles);
+  const char* path = "buckshot_benchmark.trace";
+  world.StartTrace(path, 100);
+  Measure(name, [&] {
+      for (int i = 0; i < vehicles; i++) {
+        world.CommandRaycastVehicle(i, 0.1, 20);
+      }
+      world.StepSimulation();
+    });
+  world.StopTrace();
+  std::remove(path);
+}
+
+int main(int argc, char* argv[]) {
+  for (int i = 1; i < argc; i++) {
+    if (!std::strncmp(argv[i], "--filter=", 9)) {
+      g_filter = argv[i] + 9;
+    } else if (!std::strncmp(argv[i], "--min_time=", 11)) {
+      g_min_time = std::atof(argv[i] + 11);
+    } else {
+      std::fprintf(stderr, "Usage: %s [--filter=<substring>] "
+                   "[--min_time=<seconds>]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  const int bodies[] = {1, 10, 100, 1000, 10000};
+  const int terrains[] = {10, 128, 512, 2048};
+  const int vehicles[] = {1, 4, 16, 64, 256};
+  for (int n : bodies) BenchmarkStepBodies(n);
+  for (int n : vehicles) BenchmarkStepVehicles(n);
+  for (int n : vehicles) BenchmarkStepFleet(n);
+  for (int n : vehicles) BenchmarkStepTrace(n);
+  for (int n : terrains) BenchmarkStepTerrain(n);
+  for (int n : bodies) BenchmarkAddBody(n);
+  for (int n : terrains) BenchmarkRaycastToGround(n);
+  for (int n : bodies) BenchmarkPoseExport(n);
+  for (int n : bodies) BenchmarkQueryGroundHeights(n);
+  for (int n : bodies) BenchmarkRaycastBatch(10 * n);
+  for (int n : {16, 32, 64, 128}) BenchmarkStepLidar(n);
+
+  PrintJson();
+  return 0;
+}
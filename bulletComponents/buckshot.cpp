@@ -2,11 +2,62 @@
  * File:   buckshot.cpp
  * Author: bminortx
  * The MEX interface that connects Bullet functions with MATLAB calls
+ *
+ * Every command is a handler in the kCommands table below. MATLAB can
+ * call a command by name, which costs one hash lookup, or by the integer
+ * opcode buckshot('opcodes') reports for it, which is a plain array
+ * index. Commands that used to take a type string (AddShape,
+ * AddConstraint, CommandCompound, GetTransform) have one entry per type,
+ * named "Command:Type". Called by name, the type is still read from the
+ * third argument. Called by opcode, the type argument is still passed,
+ * so the other arguments keep their places, but it is never read.
  **********************************************************************/
 
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <exception>
+#include <string>
+#include <unordered_map>
+#include <vector>
 #include "class_handle.hpp"
 #include "iostream"
 #include "bulletWorld.h"
+#include "rolloutEngine.h"
+#include "asyncSimulation.h"
+#include "lidarSensor.h"
+#include "traceFile.h"
+
+// Every handler gets mexFunction's arguments and the world instance.
+#define BUCKSHOT_COMMAND(name)                                          \
+  static void name(BulletWorld* bullet_sim_, int nlhs, mxArray *plhs[], \
+                   int nrhs, const mxArray *prhs[])
+
+typedef void (*Command)(BulletWorld* bullet_sim_, int nlhs, mxArray *plhs[],
+                        int nrhs, const mxArray *prhs[]);
+
+// Hands an object's index back to MATLAB.
+static void ReturnIndex(int index, mxArray *plhs[]) {
+  plhs[0] = mxCreateDoubleMatrix(1, 1, mxREAL);
+  double* Index = mxGetPr(plhs[0]);
+  *Index = (double)index;
+}
+
+// Checks that prhs[first], prhs[first + 1] and prhs[first + 2] (ids,
+// steering, force) are vectors of one length, and returns it.
+static int CheckCommandVectors(const char* name, int nrhs,
+                               const mxArray* prhs[], int first) {
+  if (nrhs < first + 3 ||
+      mxGetNumberOfElements(prhs[first + 1]) !=
+          mxGetNumberOfElements(prhs[first]) ||
+      mxGetNumberOfElements(prhs[first + 2]) !=
+          mxGetNumberOfElements(prhs[first])) {
+    std::string message = std::string(name) +
+        ": Expected ids, steering and force vectors of the same length.";
+    mexErrMsgTxt(message.c_str());
+  }
+  return mxGetNumberOfElements(prhs[first]);
+}
 
 /*********************************************************************
  *
@@ -14,487 +65,1060 @@
  *
  **********************************************************************/
 
-void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
-{
-  // Get the command string
-  char cmd[64];
-  if (nrhs < 1 || mxGetString(prhs[0], cmd, sizeof(cmd)))
-    mexErrMsgTxt("First input should be a command string less than 64 characters long.");
+BUCKSHOT_COMMAND(Reset) {
+  bullet_sim_->Reset();
+}
 
-  // New
-  if (!strcmp("new", cmd)) {
-    // Check parameters
-    if (nlhs != 1)
-      mexErrMsgTxt("New: One output expected.");
-    // Return a handle to a new C++ instance
-    plhs[0] = convertPtr2Mat<BulletWorld>(new BulletWorld);
-    void mexUnlock(void);
-    return;
-  }
+BUCKSHOT_COMMAND(UseOpenGL) {
+  bullet_sim_->UseOpenGL();
+}
 
-  // Check there is a second input, which should be the class instance handle
-  if (nrhs < 2)
-    mexErrMsgTxt("Second input should be a class instance handle.");
+// SaveState: snapshots the whole world and returns a handle to it
+BUCKSHOT_COMMAND(SaveState) {
+  plhs[0] = mxCreateDoubleMatrix(1, 1, mxREAL);
+  double* handle = mxGetPr(plhs[0]);
+  *handle = (double)bullet_sim_->SaveState();
+}
 
-  // Delete
-  if (!strcmp("delete", cmd)) {
-    // Destroy the C++ object
-    destroyObject<BulletWorld>(prhs[1]);
-    // Warn if other commands were ignored
-    if (nlhs != 0 || nrhs != 2)
-      mexWarnMsgTxt("Delete: Unexpected arguments ignored.");
-    return;
-  }
+// RestoreState: rewinds to a snapshot. The handle can be restored again.
+BUCKSHOT_COMMAND(RestoreState) {
+  double* handle = mxGetPr(prhs[2]);
+  if (!bullet_sim_->RestoreState((int)*handle))
+    mexErrMsgTxt("RestoreState: Invalid state handle.");
+}
 
-  // Get the class instance pointer from the second input
-  BulletWorld *bullet_sim_ = convertMat2Ptr<BulletWorld>(prhs[1]);
+BUCKSHOT_COMMAND(ReleaseState) {
+  double* handle = mxGetPr(prhs[2]);
+  bullet_sim_->ReleaseState((int)*handle);
+}
 
-  if (!strcmp("reset", cmd)) {
-    bullet_sim_->Reset();
-    return;
-  }
+// SetDeterministic: turns deterministic mode on or off, with an optional
+// solver seed (0 by default). See BulletWorld::SetDeterministic.
+BUCKSHOT_COMMAND(SetDeterministic) {
+  if (nrhs < 3)
+    mexErrMsgTxt("SetDeterministic: Expected true or false.");
+  unsigned long seed = nrhs > 3 ? (unsigned long)mxGetScalar(prhs[3]) : 0;
+  bullet_sim_->SetDeterministic(mxGetScalar(prhs[2]) != 0, seed);
+}
 
-  if (!strcmp("useOpenGL", cmd)) {
-    bullet_sim_->UseOpenGL();
-    return;
-  }
+// StateHash: a uint64 hash of the whole world's state
+BUCKSHOT_COMMAND(StateHash) {
+  plhs[0] = mxCreateNumericMatrix(1, 1, mxUINT64_CLASS, mxREAL);
+  *(uint64_t*)mxGetData(plhs[0]) = bullet_sim_->StateHash();
+}
 
-  /*********************************************************************
-   *
-   *ADDING OBJECTS
-   *
-   **********************************************************************/
-
-  // AddTerrain
-  if (!strcmp("AddTerrain", cmd)) {
-
-    /// TODO: DEBUG. THESE ARE NOT POPULATING...
-    double* row_count = mxGetPr(prhs[2]);
-    double* col_count = mxGetPr(prhs[3]);
-    double* grad = mxGetPr(prhs[4]);
-    double* min_ht = mxGetPr(prhs[5]);
-    double* max_ht = mxGetPr(prhs[6]);
-    double* X = mxGetPr(prhs[7]);
-    double* Y = mxGetPr(prhs[8]);
-    double* Z = mxGetPr(prhs[9]);
-    double* normal = mxGetPr(prhs[10]);
-    int id = bullet_sim_->AddTerrain(int(*row_count), int(*col_count),
-                                     *grad, *min_ht, *max_ht, X, Y, Z, normal);
-    double d_id = (double)id;
-    //Return the index, so that we can look up the position later.
-    plhs[0] = mxCreateDoubleMatrix(1, 1, mxREAL);
-    double* index = mxGetPr(plhs[0]);
-    index = &d_id;
-    return;
-  }
+/*********************************************************************
+ *
+ *ADDING OBJECTS
+ *
+ **********************************************************************/
 
-  ////////////////////////////
-
-  // AddShape
-  if (!strcmp("AddShape", cmd)) {
-    //Get the type of the shape
-    char shape[64];
-    int index;
-    mxGetString(prhs[2], shape, sizeof(shape));
-
-    ///Cube
-    if(!strcmp(shape, "Cube")){
-      double* width = mxGetPr(prhs[3]);
-      double* length = mxGetPr(prhs[4]);
-      double* height = mxGetPr(prhs[5]);
-      double* mass = mxGetPr(prhs[6]);
-      double* restitution = mxGetPr(prhs[7]);
-      double* position = mxGetPr(prhs[8]);
-      double* rotation = mxGetPr(prhs[9]);
-      plhs[0] = mxCreateDoubleMatrix(1, 1, mxREAL);
-      double* ShapeIndex = mxGetPr(plhs[0]);
-      int index = bullet_sim_->AddCube(*width, *length, *height, *mass,
-                                       *restitution, position,
-                                       rotation);
-      *ShapeIndex = (double)index;
-    }
+BUCKSHOT_COMMAND(AddTerrain) {
 
-    ///Sphere
-    if (!strcmp(shape, "Sphere")) {
-      double* radius = mxGetPr(prhs[3]);
-      double* mass = mxGetPr(prhs[4]);
-      double* restitution = mxGetPr(prhs[5]);
-      double* position = mxGetPr(prhs[6]);
-      double* rotation = mxGetPr(prhs[7]);
-      plhs[0] = mxCreateDoubleMatrix(1, 1, mxREAL);
-      double* ShapeIndex = mxGetPr(plhs[0]);
-      int index = bullet_sim_->AddSphere(*radius, *mass, *restitution,
-                                         position, rotation);
-      *ShapeIndex = (double)index;
-    }
+  /// TODO: DEBUG. THESE ARE NOT POPULATING...
+  double* row_count = mxGetPr(prhs[2]);
+  double* col_count = mxGetPr(prhs[3]);
+  double* grad = mxGetPr(prhs[4]);
+  double* min_ht = mxGetPr(prhs[5]);
+  double* max_ht = mxGetPr(prhs[6]);
+  double* X = mxGetPr(prhs[7]);
+  double* Y = mxGetPr(prhs[8]);
+  double* Z = mxGetPr(prhs[9]);
+  double* normal = mxGetPr(prhs[10]);
+  int id = bullet_sim_->AddTerrain(int(*row_count), int(*col_count),
+                                   *grad, *min_ht, *max_ht, X, Y, Z, normal);
+  //Return the index, so that we can look up the position later.
+  ReturnIndex(id, plhs);
+}
 
-    ///Cylinder
-    if (!strcmp(shape, "Cylinder")) {
-      double* radius = mxGetPr(prhs[3]);
-      double* height = mxGetPr(prhs[4]);
-      double* mass = mxGetPr(prhs[5]);
-      double* restitution = mxGetPr(prhs[6]);
-      double* position = mxGetPr(prhs[7]);
-      double* rotation = mxGetPr(prhs[8]);
-      plhs[0] = mxCreateDoubleMatrix(1, 1, mxREAL);
-      double* ShapeIndex = mxGetPr(plhs[0]);
-      int index = bullet_sim_->AddCylinder(*radius, *height, *mass,
-                                           *restitution,
-                                           position, rotation);
-      *ShapeIndex = (double)index;
-    }
-    return;
+// AddHeightfield: the AddTerrain grid as a btHeightfieldTerrainShape.
+// The last argument picks float (0) or int16 (1) heights.
+BUCKSHOT_COMMAND(AddHeightfield) {
+  double* row_count = mxGetPr(prhs[2]);
+  double* col_count = mxGetPr(prhs[3]);
+  double* X = mxGetPr(prhs[4]);
+  double* Y = mxGetPr(prhs[5]);
+  double* Z = mxGetPr(prhs[6]);
+  double* quantize = mxGetPr(prhs[7]);
+  int index = bullet_sim_->AddHeightfield(int(*row_count), int(*col_count),
+                                          X, Y, Z, *quantize != 0);
+  ReturnIndex(index, plhs);
+}
+
+// AddTiledTerrain: path to a WriteTerrainTiles file, then how many tiles
+// around each vehicle to keep loaded.
+BUCKSHOT_COMMAND(AddTiledTerrain) {
+  char path[4096];
+  if (nrhs < 4 || mxGetString(prhs[2], path, sizeof(path)))
+    mexErrMsgTxt("AddTiledTerrain: Expected a file path and a radius.");
+  double* radius = mxGetPr(prhs[3]);
+  if (!bullet_sim_->AddTiledTerrain(path, int(*radius)))
+    mexErrMsgTxt("AddTiledTerrain: Could not map the tile file.");
+}
+
+// AddTerrainFromFile: path to a WriteTerrainFile file. Returns the id.
+BUCKSHOT_COMMAND(AddTerrainFromFile) {
+  char path[4096];
+  if (nrhs < 3 || mxGetString(prhs[2], path, sizeof(path)))
+    mexErrMsgTxt("AddTerrainFromFile: Expected a file path.");
+  int index = bullet_sim_->AddTerrainFromFile(path);
+  if (index < 0)
+    mexErrMsgTxt("AddTerrainFromFile: Could not map the terrain file.");
+  ReturnIndex(index, plhs);
+}
+
+// UpdateTerrainRegion: terrain id, then the (1-based) row and column of
+// the terrain's Z grid where the new block of heights starts, then the
+// block.
+BUCKSHOT_COMMAND(UpdateTerrainRegion) {
+  double* id = mxGetPr(prhs[2]);
+  double* row = mxGetPr(prhs[3]);
+  double* col = mxGetPr(prhs[4]);
+  double* heights = mxGetPr(prhs[5]);
+  if (!bullet_sim_->UpdateTerrainRegion(*id, int(*row) - 1, int(*col) - 1,
+                                        mxGetM(prhs[5]), mxGetN(prhs[5]),
+                                        heights))
+    mexErrMsgTxt("UpdateTerrainRegion: Not a mesh terrain, or the block "
+                 "doesn't fit.");
+}
+
+// QueryGroundHeights: a 2 x N matrix of (x, y) points. Returns their
+// ground heights (1 x N) and, if asked, normals (3 x N).
+BUCKSHOT_COMMAND(QueryGroundHeights) {
+  if (nrhs < 3 || mxGetM(prhs[2]) != 2)
+    mexErrMsgTxt("QueryGroundHeights: Expected a 2 x N matrix of points.");
+  int n = mxGetN(prhs[2]);
+  plhs[0] = mxCreateDoubleMatrix(1, n, mxREAL);
+  double* normals = NULL;
+  if (nlhs > 1) {
+    plhs[1] = mxCreateDoubleMatrix(3, n, mxREAL);
+    normals = mxGetPr(plhs[1]);
   }
+  bullet_sim_->QueryGroundHeights(n, mxGetPr(prhs[2]), mxGetPr(plhs[0]),
+                                  normals);
+}
 
-  // AddRaycastVehicle
-  if (!strcmp("AddRaycastVehicle", cmd)) {
-    double* parameters = mxGetPr(prhs[2]);
-    double* position = mxGetPr(prhs[3]);
-    double* rotation = mxGetPr(prhs[4]);
-    int index = bullet_sim_->AddRaycastVehicle(parameters,
-                                               position, rotation);
-    plhs[0] = mxCreateDoubleMatrix(1, 1, mxREAL);
-    double* CompoundIndex = mxGetPr(plhs[0]);
-    *CompoundIndex = (double)index;
-    return;
+// RaycastBatch: 3 x N ray origins and 3 x N directions (each ray ends at
+// origin + direction). Returns hit points and normals (3 x N), hit
+// fractions (1 x N) and the index of the body each ray hit (1 x N, in
+// GetAllTransforms order, or -1), as many of them as are asked for.
+BUCKSHOT_COMMAND(RaycastBatch) {
+  if (nrhs < 4 || mxGetM(prhs[2]) != 3 || mxGetM(prhs[3]) != 3 ||
+      mxGetN(prhs[2]) != mxGetN(prhs[3]))
+    mexErrMsgTxt("RaycastBatch: Expected 3 x N origins and directions.");
+  int n = mxGetN(prhs[2]);
+  double* outputs[4] = {NULL, NULL, NULL, NULL};
+  const int rows[4] = {3, 3, 1, 1};
+  for (int i = 0; i < nlhs && i < 4; i++) {
+    plhs[i] = mxCreateDoubleMatrix(rows[i], n, mxREAL);
+    outputs[i] = mxGetPr(plhs[i]);
   }
+  bullet_sim_->RaycastBatch(n, mxGetPr(prhs[2]), mxGetPr(prhs[3]),
+                            outputs[0], outputs[1], outputs[2], outputs[3]);
+}
 
-  /*********************************************************************
-   *
-   *RUNNING THE SIMULATION
-   *
-   **********************************************************************/
+// SetBvhCache: directory to cache terrain mesh BVHs in ('' turns it off).
+BUCKSHOT_COMMAND(SetBvhCache) {
+  char dir[4096];
+  if (nrhs < 3 || mxGetString(prhs[2], dir, sizeof(dir)))
+    mexErrMsgTxt("SetBvhCache: Expected a directory.");
+  bullet_sim_->SetBvhCacheDir(dir);
+}
 
-  // StepSimulation
-  if (!strcmp("StepSimulation", cmd)) {
-    bullet_sim_->StepSimulation();
-    return;
-  }
+BUCKSHOT_COMMAND(AddShape_Cube) {
+  double* width = mxGetPr(prhs[3]);
+  double* length = mxGetPr(prhs[4]);
+  double* height = mxGetPr(prhs[5]);
+  double* mass = mxGetPr(prhs[6]);
+  double* restitution = mxGetPr(prhs[7]);
+  double* position = mxGetPr(prhs[8]);
+  double* rotation = mxGetPr(prhs[9]);
+  plhs[0] = mxCreateDoubleMatrix(1, 1, mxREAL);
+  double* ShapeIndex = mxGetPr(plhs[0]);
+  int index = bullet_sim_->AddCube(*width, *length, *height, *mass,
+                                   *restitution, position,
+                                   rotation);
+  *ShapeIndex = (double)index;
+}
 
-  if (!strcmp("StepGUI", cmd)) {
-    bullet_sim_->StepGUI();
-    return;
+BUCKSHOT_COMMAND(AddShape_Sphere) {
+  double* radius = mxGetPr(prhs[3]);
+  double* mass = mxGetPr(prhs[4]);
+  double* restitution = mxGetPr(prhs[5]);
+  double* position = mxGetPr(prhs[6]);
+  double* rotation = mxGetPr(prhs[7]);
+  plhs[0] = mxCreateDoubleMatrix(1, 1, mxREAL);
+  double* ShapeIndex = mxGetPr(plhs[0]);
+  int index = bullet_sim_->AddSphere(*radius, *mass, *restitution,
+                                     position, rotation);
+  *ShapeIndex = (double)index;
+}
+
+BUCKSHOT_COMMAND(AddShape_Cylinder) {
+  double* radius = mxGetPr(prhs[3]);
+  double* height = mxGetPr(prhs[4]);
+  double* mass = mxGetPr(prhs[5]);
+  double* restitution = mxGetPr(prhs[6]);
+  double* position = mxGetPr(prhs[7]);
+  double* rotation = mxGetPr(prhs[8]);
+  plhs[0] = mxCreateDoubleMatrix(1, 1, mxREAL);
+  double* ShapeIndex = mxGetPr(plhs[0]);
+  int index = bullet_sim_->AddCylinder(*radius, *height, *mass,
+                                       *restitution,
+                                       position, rotation);
+  *ShapeIndex = (double)index;
+}
+
+BUCKSHOT_COMMAND(AddRaycastVehicle) {
+  double* parameters = mxGetPr(prhs[2]);
+  double* position = mxGetPr(prhs[3]);
+  double* rotation = mxGetPr(prhs[4]);
+  int index = bullet_sim_->AddRaycastVehicle(parameters,
+                                             position, rotation);
+  plhs[0] = mxCreateDoubleMatrix(1, 1, mxREAL);
+  double* CompoundIndex = mxGetPr(plhs[0]);
+  *CompoundIndex = (double)index;
+}
+
+// AddFleet: shared vehicle parameters, then 3 x N positions and 9 x N
+// rotations. Returns the first of the N consecutive vehicle ids.
+BUCKSHOT_COMMAND(AddFleet) {
+  if (nrhs < 5 || mxGetM(prhs[3]) != 3 || mxGetM(prhs[4]) != 9 ||
+      mxGetN(prhs[3]) != mxGetN(prhs[4]))
+    mexErrMsgTxt("AddFleet: Expected parameters, 3 x N positions and "
+                 "9 x N rotations.");
+  double* parameters = mxGetPr(prhs[2]);
+  double* positions = mxGetPr(prhs[3]);
+  double* rotations = mxGetPr(prhs[4]);
+  int index = bullet_sim_->AddFleet(mxGetN(prhs[3]), parameters, positions,
+                                    rotations);
+  ReturnIndex(index, plhs);
+}
+
+/*********************************************************************
+ *
+ *RUNNING THE SIMULATION
+ *
+ **********************************************************************/
+
+BUCKSHOT_COMMAND(StepSimulation) {
+  bullet_sim_->StepSimulation();
+}
+
+// StepSimulationN: steps n times in one call, optionally returning an
+// N x bodies x 12 array of poses (see BulletWorld::RecordMask), and
+// optionally the N x 1 uint64 StateHash after each step.
+BUCKSHOT_COMMAND(StepSimulationN) {
+  if (nrhs < 3)
+    mexErrMsgTxt("StepSimulationN: Expected a number of steps.");
+  double steps = mxGetScalar(prhs[2]);
+  if (!(steps >= 0 && steps <= INT_MAX) || steps != std::floor(steps))
+    mexErrMsgTxt("StepSimulationN: The number of steps must be a "
+                 "non-negative integer.");
+  int n = (int)steps;
+  int record_mask = BulletWorld::RECORD_ALL;
+  if (nrhs > 3) {
+    record_mask = (int)mxGetScalar(prhs[3]);
   }
-  
-  if (!strcmp("RunSimulation", cmd)) {
-    bullet_sim_->RunSimulation();
+  if (nlhs < 1) {
+    bullet_sim_->StepSimulationN(n, BulletWorld::RECORD_NONE, NULL);
     return;
   }
+  mwSize dims[3] = {(mwSize)n,
+                    (mwSize)bullet_sim_->NumRecordedPoses(record_mask),
+                    12};
+  plhs[0] = mxCreateNumericArray(3, dims, mxDOUBLE_CLASS, mxREAL);
+  uint64_t* hashes = NULL;
+  if (nlhs > 1) {
+    plhs[1] = mxCreateNumericMatrix(n, 1, mxUINT64_CLASS, mxREAL);
+    hashes = (uint64_t*)mxGetData(plhs[1]);
+  }
+  bullet_sim_->StepSimulationN(n, record_mask, mxGetPr(plhs[0]), hashes);
+}
 
+BUCKSHOT_COMMAND(StepGUI) {
+  bullet_sim_->StepGUI();
+}
 
-  /*********************************************************************
-   *
-   *COMPOUND METHODS
-   *
-   **********************************************************************/
-
-  if (!strcmp("CommandCompound", cmd)) {
-    //Get the compound type
-    char compound_type[64];
-    mxGetString(prhs[2], compound_type, sizeof(compound_type));
-    if (!strcmp("Vehicle", compound_type)){
-      double* id = mxGetPr(prhs[3]);
-      double* phi = mxGetPr(prhs[4]);
-      double* force = mxGetPr(prhs[5]);
-      bullet_sim_->CommandVehicle(*id, *phi, *force);
-    }
-    return;
-  }
+BUCKSHOT_COMMAND(RunSimulation) {
+  bullet_sim_->RunSimulation();
+}
 
-  /*********************************************************************
-   *
-   *RAYCAST VEHICLE METHODS
-   *
-   **********************************************************************/
-
-  if (!strcmp("CommandRaycastVehicle", cmd)){
-    double* id = mxGetPr(prhs[2]);
-    double* phi = mxGetPr(prhs[3]);
-    double* force = mxGetPr(prhs[4]);
-    bullet_sim_->CommandRaycastVehicle(*id, *phi, *force);
-    return;
+// GetSimTime: the simulated seconds the world has stepped through
+BUCKSHOT_COMMAND(GetSimTime) {
+  plhs[0] = mxCreateDoubleScalar(bullet_sim_->SimTime());
+}
+
+// GetProfile: one struct per StepSimulation phase (see stepProfiler.h)
+// with its name, the steps timed, the total, mean and max seconds per
+// step, and the histogram: element i counts the steps where the phase
+// took [2^(i-1), 2^i) nanoseconds.
+BUCKSHOT_COMMAND(GetProfile) {
+  const char* fields[] = {"phase", "count", "total", "mean", "max",
+                          "histogram"};
+  plhs[0] = mxCreateStructMatrix(1, StepProfiler::NUM_PHASES, 6, fields);
+  StepProfiler& profiler = bullet_sim_->profiler();
+  for (int phase = 0; phase < StepProfiler::NUM_PHASES; phase++) {
+    const StepProfiler::Histogram& histogram = profiler.histogram(phase);
+    mxSetField(plhs[0], phase, "phase",
+               mxCreateString(StepProfiler::PhaseName(phase)));
+    mxSetField(plhs[0], phase, "count",
+               mxCreateDoubleScalar(histogram.count));
+    mxSetField(plhs[0], phase, "total",
+               mxCreateDoubleScalar(histogram.total_seconds));
+    mxSetField(plhs[0], phase, "mean", mxCreateDoubleScalar(
+        histogram.count ? histogram.total_seconds / histogram.count : 0));
+    mxSetField(plhs[0], phase, "max",
+               mxCreateDoubleScalar(histogram.max_seconds));
+    mxArray* buckets =
+        mxCreateDoubleMatrix(1, StepProfiler::kNumBuckets, mxREAL);
+    std::copy(histogram.buckets,
+              histogram.buckets + StepProfiler::kNumBuckets,
+              mxGetPr(buckets));
+    mxSetField(plhs[0], phase, "histogram", buckets);
   }
+}
 
-  ///////
-
-  if (!strcmp("GetMotionState", cmd)){
-    double* id = mxGetPr(prhs[2]);
-    double* state = bullet_sim_->GetRaycastMotionState(*id);
-    plhs[0] = mxCreateDoubleMatrix(1, 1, mxREAL);
-    plhs[1] = mxCreateDoubleMatrix(1, 1, mxREAL);
-    plhs[2] = mxCreateDoubleMatrix(1, 3, mxREAL);
-    plhs[3] = mxCreateDoubleMatrix(1, 3, mxREAL);
-    plhs[4] = mxCreateDoubleMatrix(1, 1, mxREAL);
-    double* steering_angle = mxGetPr(plhs[0]);
-    double* force = mxGetPr(plhs[1]);
-    double* lin_velocity = mxGetPr(plhs[2]);
-    double* ang_velocity = mxGetPr(plhs[3]);
-    double* grounded = mxGetPr(plhs[4]);
-    *steering_angle = state[0];
-    *force = state[1];
-    lin_velocity[0] = state[2];
-    lin_velocity[1] = state[3];
-    lin_velocity[2] = state[4];
-    ang_velocity[0] = state[5];
-    ang_velocity[1] = state[6];
-    ang_velocity[2] = state[7];
-    grounded[0] = state[8];
-    return;
+BUCKSHOT_COMMAND(ResetProfile) {
+  bullet_sim_->profiler().Reset();
+}
+
+/*********************************************************************
+ *
+ *COMPOUND METHODS
+ *
+ **********************************************************************/
+
+BUCKSHOT_COMMAND(CommandCompound_Vehicle) {
+  double* id = mxGetPr(prhs[3]);
+  double* phi = mxGetPr(prhs[4]);
+  double* force = mxGetPr(prhs[5]);
+  bullet_sim_->CommandVehicle(*id, *phi, *force);
+}
+
+// CommandCompounds: vectors of compound ids, steering angles and forces.
+BUCKSHOT_COMMAND(CommandCompounds_Vehicle) {
+  int n = CheckCommandVectors("CommandCompounds", nrhs, prhs, 3);
+  if (!bullet_sim_->CommandVehicles(n, mxGetPr(prhs[3]), mxGetPr(prhs[4]),
+                                    mxGetPr(prhs[5])))
+    mexErrMsgTxt("CommandCompounds: Invalid compound id.");
+}
+
+/*********************************************************************
+ *
+ *RAYCAST VEHICLE METHODS
+ *
+ **********************************************************************/
+
+BUCKSHOT_COMMAND(CommandRaycastVehicle) {
+  double* id = mxGetPr(prhs[2]);
+  double* phi = mxGetPr(prhs[3]);
+  double* force = mxGetPr(prhs[4]);
+  bullet_sim_->CommandRaycastVehicle(*id, *phi, *force);
+}
+
+// CommandRaycastVehicles: vectors of vehicle ids, steering angles and
+// forces, all applied before the next step.
+BUCKSHOT_COMMAND(CommandRaycastVehicles) {
+  int n = CheckCommandVectors("CommandRaycastVehicles", nrhs, prhs, 2);
+  if (!bullet_sim_->CommandRaycastVehicles(n, mxGetPr(prhs[2]),
+                                           mxGetPr(prhs[3]),
+                                           mxGetPr(prhs[4])))
+    mexErrMsgTxt("CommandRaycastVehicles: Invalid vehicle id.");
+}
+
+// SetControlDelay: raycast vehicle id and how many simulated seconds its
+// commands take to act. See BulletWorld::SetControlDelay.
+BUCKSHOT_COMMAND(SetControlDelay) {
+  if (nrhs < 4)
+    mexErrMsgTxt("SetControlDelay: Expected a vehicle id and a delay.");
+  if (!bullet_sim_->SetControlDelay(mxGetScalar(prhs[2]),
+                                    mxGetScalar(prhs[3])))
+    mexErrMsgTxt("SetControlDelay: No such raycast vehicle, or the delay is "
+                 "negative or too long.");
+}
+
+// CommandFleet: one steering angle and one force per fleet vehicle.
+BUCKSHOT_COMMAND(CommandFleet) {
+  size_t n = bullet_sim_->FleetSize();
+  if (nrhs < 4 || mxGetNumberOfElements(prhs[2]) != n ||
+      mxGetNumberOfElements(prhs[3]) != n)
+    mexErrMsgTxt("CommandFleet: Expected a steering angle and a force for "
+                 "every fleet vehicle.");
+  bullet_sim_->CommandFleet(mxGetPr(prhs[2]), mxGetPr(prhs[3]));
+}
+
+// RunRollouts: plays each column of the steering and force matrices as
+// one rollout of the given vehicle, all in parallel. Returns the final
+// chassis poses (rollouts x 12) and, if a goal is given, each rollout's
+// squared distance to it (1 x rollouts).
+BUCKSHOT_COMMAND(RunRollouts) {
+  if (nrhs < 5)
+    mexErrMsgTxt("RunRollouts: Expected a vehicle id, steering and force.");
+  double* id = mxGetPr(prhs[2]);
+  double* steering = mxGetPr(prhs[3]);
+  double* force = mxGetPr(prhs[4]);
+  double* goal = NULL;
+  if (nrhs > 5) {
+    if (mxGetNumberOfElements(prhs[5]) < 3)
+      mexErrMsgTxt("RunRollouts: The goal must be an x, y, z position.");
+    goal = mxGetPr(prhs[5]);
+  }
+  if (*id < 0 || *id >= bullet_sim_->NumRaycastVehicles())
+    mexErrMsgTxt("RunRollouts: No such raycast vehicle.");
+  mwSize num_steps = mxGetM(prhs[3]);
+  mwSize num_rollouts = mxGetN(prhs[3]);
+  if (mxGetM(prhs[4]) != num_steps || mxGetN(prhs[4]) != num_rollouts)
+    mexErrMsgTxt("RunRollouts: steering and force must be the same size.");
+  plhs[0] = mxCreateDoubleMatrix(num_rollouts, 12, mxREAL);
+  double* costs = NULL;
+  if (nlhs > 1) {
+    plhs[1] = mxCreateDoubleMatrix(1, num_rollouts, mxREAL);
+    costs = mxGetPr(plhs[1]);
   }
+  try {
+    bullet_sim_->Rollouts()->Run(*id, num_rollouts, num_steps,
+                                 steering, force, goal,
+                                 mxGetPr(plhs[0]), costs);
+  } catch (const std::exception& e) {
+    std::string message = std::string("RunRollouts: ") + e.what();
+    mexErrMsgTxt(message.c_str());
+  }
+}
 
-  ///////
-
-  if (!strcmp("SetToGround", cmd)){
-    double* id = mxGetPr(prhs[2]);
-    double* x = mxGetPr(prhs[3]);
-    double* y = mxGetPr(prhs[4]);
-    plhs[0] = mxCreateDoubleMatrix(1, 3, mxREAL);
-    double* position = mxGetPr(plhs[0]);
-    double* pos = bullet_sim_->RaycastToGround(*id, *x, *y);
-    position[0] = pos[0];
-    position[1] = pos[1];
-    position[2] = pos[2];
-    return;
+BUCKSHOT_COMMAND(GetMotionState) {
+  double* id = mxGetPr(prhs[2]);
+  double state[9];
+  bullet_sim_->GetRaycastMotionState(*id, state);
+  plhs[0] = mxCreateDoubleMatrix(1, 1, mxREAL);
+  plhs[1] = mxCreateDoubleMatrix(1, 1, mxREAL);
+  plhs[2] = mxCreateDoubleMatrix(1, 3, mxREAL);
+  plhs[3] = mxCreateDoubleMatrix(1, 3, mxREAL);
+  plhs[4] = mxCreateDoubleMatrix(1, 1, mxREAL);
+  double* steering_angle = mxGetPr(plhs[0]);
+  double* force = mxGetPr(plhs[1]);
+  double* lin_velocity = mxGetPr(plhs[2]);
+  double* ang_velocity = mxGetPr(plhs[3]);
+  double* grounded = mxGetPr(plhs[4]);
+  *steering_angle = state[0];
+  *force = state[1];
+  lin_velocity[0] = state[2];
+  lin_velocity[1] = state[3];
+  lin_velocity[2] = state[4];
+  ang_velocity[0] = state[5];
+  ang_velocity[1] = state[6];
+  ang_velocity[2] = state[7];
+  grounded[0] = state[8];
+}
+
+BUCKSHOT_COMMAND(SetToGround) {
+  double* id = mxGetPr(prhs[2]);
+  double* x = mxGetPr(prhs[3]);
+  double* y = mxGetPr(prhs[4]);
+  plhs[0] = mxCreateDoubleMatrix(1, 3, mxREAL);
+  double* position = mxGetPr(plhs[0]);
+  bullet_sim_->RaycastToGround(*id, *x, *y, position);
+}
+
+BUCKSHOT_COMMAND(ResetVehicle) {
+  double* id = mxGetPr(prhs[2]);
+  double* start_pose = mxGetPr(prhs[3]);
+  double* start_rot = mxGetPr(prhs[4]);
+  bullet_sim_->ResetVehicle(*id, start_pose, start_rot);
+}
+
+/*********************************************************************
+ *
+ *SENSORS
+ *
+ **********************************************************************/
+
+// AddLidar: vehicle id, mount position and rotation in the chassis frame,
+// then the LidarSensor parameters. Returns the lidar's id.
+BUCKSHOT_COMMAND(AddLidar) {
+  if (nrhs < 6 ||
+      mxGetNumberOfElements(prhs[5]) < LidarSensor::kNumParameters)
+    mexErrMsgTxt("AddLidar: Expected id, position, rotation and parameters.");
+  double* id = mxGetPr(prhs[2]);
+  double* position = mxGetPr(prhs[3]);
+  double* rotation = mxGetPr(prhs[4]);
+  double* parameters = mxGetPr(prhs[5]);
+  int index = bullet_sim_->AddLidar(*id, position, rotation, parameters);
+  if (index < 0)
+    mexErrMsgTxt("AddLidar: No such raycast vehicle.");
+  ReturnIndex(index, plhs);
+}
+
+// ReadLidar: lidar id and the cursor from the last read (0 the first
+// time). Returns the new points as a 5 x N matrix of x, y, z, range and
+// time, and the cursor for next time.
+BUCKSHOT_COMMAND(ReadLidar) {
+  if (nrhs < 4)
+    mexErrMsgTxt("ReadLidar: Expected a lidar id and cursor.");
+  double* id = mxGetPr(prhs[2]);
+  double* since = mxGetPr(prhs[3]);
+  std::vector<double> points;
+  long cursor = bullet_sim_->ReadLidar(*id, long(*since), &points);
+  if (cursor < 0)
+    mexErrMsgTxt("ReadLidar: No such lidar.");
+  plhs[0] = mxCreateDoubleMatrix(LidarSensor::kPointSize,
+                                 points.size() / LidarSensor::kPointSize,
+                                 mxREAL);
+  std::copy(points.begin(), points.end(), mxGetPr(plhs[0]));
+  if (nlhs > 1) {
+    plhs[1] = mxCreateDoubleScalar(cursor);
   }
+}
 
-  if (!strcmp("ResetVehicle", cmd)){
-    double* id = mxGetPr(prhs[2]);
-    double* start_pose = mxGetPr(prhs[3]);
-    double* start_rot = mxGetPr(prhs[4]);
-    bullet_sim_->ResetVehicle(*id, start_pose, start_rot);
-    return;
+/*********************************************************************
+ *
+ *TRACES
+ *
+ **********************************************************************/
+
+// StartTrace: path and, optionally, how many steps apart keyframes are
+// (100 by default). See traceFile.h.
+BUCKSHOT_COMMAND(StartTrace) {
+  char path[4096];
+  if (nrhs < 3 || mxGetString(prhs[2], path, sizeof(path)))
+    mexErrMsgTxt("StartTrace: Expected a file path.");
+  int keyframe_interval = nrhs > 3 ? (int)mxGetScalar(prhs[3]) : 100;
+  if (!bullet_sim_->StartTrace(path, keyframe_interval))
+    mexErrMsgTxt("StartTrace: Could not open the trace file.");
+}
+
+BUCKSHOT_COMMAND(StopTrace) {
+  bullet_sim_->StopTrace();
+}
+
+// OpenTrace: path. Returns a handle for ReadTrace and, optionally, the
+// number of steps in the trace.
+BUCKSHOT_COMMAND(OpenTrace) {
+  char path[4096];
+  if (nrhs < 3 || mxGetString(prhs[2], path, sizeof(path)))
+    mexErrMsgTxt("OpenTrace: Expected a file path.");
+  int handle = bullet_sim_->OpenTrace(path);
+  if (handle < 0)
+    mexErrMsgTxt("OpenTrace: Could not read the trace file.");
+  plhs[0] = mxCreateDoubleScalar(handle);
+  if (nlhs > 1) {
+    plhs[1] = mxCreateDoubleScalar(bullet_sim_->TraceLength(handle));
   }
+}
 
-  /*********************************************************************
-   *
-   *CONSTRAINT METHODS
-   *There are too many constructors for our purposes, so we're going to
-   *have to put them all here
-   * 1. Point-to-point constraints: One and Two-shape constraint
-   * 2. Hinge: One and Two-shape constraint, both with options for a
-   *    transformation on the shape, or just a pivot and axis selection.
-   * 3. Hinge2 - Used for vehicle axes
-   * 4. Six degrees of freedom - customizable constraint
-   *
-   **********************************************************************/
-
-  //AddConstraint
-  if (!strcmp("AddConstraint", cmd)) {
-    //Get the type of the constraint
-    char constraint[64];
-    int index;
-    mxGetString(prhs[2], constraint, sizeof(constraint));
-
-    ///////
-    //Point To Point
-    ///////
-    if (!strcmp("PointToPoint_one", constraint)){
-      double* id = mxGetPr(prhs[3]);
-      double* pivot_in_A = mxGetPr(prhs[4]);
-      index = bullet_sim_->PointToPoint_one(*id, pivot_in_A);
+// ReadTrace: handle and step (0 is where the trace started). Returns the
+// 12 x bodies poses, the 4 x N commands sent just before the step (kind,
+// id, steering, force; see TraceCommand) and the simulated time.
+BUCKSHOT_COMMAND(ReadTrace) {
+  if (nrhs < 4)
+    mexErrMsgTxt("ReadTrace: Expected a trace handle and a step.");
+  double time;
+  std::vector<double> poses;
+  std::vector<TraceCommand> commands;
+  if (!bullet_sim_->ReadTrace((int)mxGetScalar(prhs[2]),
+                              (int)mxGetScalar(prhs[3]), &time, &poses,
+                              &commands))
+    mexErrMsgTxt("ReadTrace: Invalid trace handle or step.");
+  plhs[0] = mxCreateDoubleMatrix(12, poses.size() / 12, mxREAL);
+  std::copy(poses.begin(), poses.end(), mxGetPr(plhs[0]));
+  if (nlhs > 1) {
+    plhs[1] = mxCreateDoubleMatrix(4, commands.size(), mxREAL);
+    double* out = mxGetPr(plhs[1]);
+    for (const TraceCommand& command : commands) {
+      *out++ = command.kind;
+      *out++ = command.id;
+      *out++ = command.steering;
+      *out++ = command.force;
     }
+  }
+  if (nlhs > 2) {
+    plhs[2] = mxCreateDoubleScalar(time);
+  }
+}
+
+BUCKSHOT_COMMAND(CloseTrace) {
+  bullet_sim_->CloseTrace((int)mxGetScalar(prhs[2]));
+}
 
-    if (!strcmp("PointToPoint_two", constraint)){
-      double* id_A = mxGetPr(prhs[3]);
-      double* id_B = mxGetPr(prhs[4]);
-      double* pivot_in_A = mxGetPr(prhs[5]);
-      double* pivot_in_B = mxGetPr(prhs[6]);
-      index = bullet_sim_->PointToPoint_two(*id_A, *id_B,
+/*********************************************************************
+ *
+ *CONSTRAINT METHODS
+ *There are too many constructors for our purposes, so we're going to
+ *have to put them all here
+ * 1. Point-to-point constraints: One and Two-shape constraint
+ * 2. Hinge: One and Two-shape constraint, both with options for a
+ *    transformation on the shape, or just a pivot and axis selection.
+ * 3. Hinge2 - Used for vehicle axes
+ * 4. Six degrees of freedom - customizable constraint
+ *
+ **********************************************************************/
+
+BUCKSHOT_COMMAND(AddConstraint_PointToPoint_one) {
+  double* id = mxGetPr(prhs[3]);
+  double* pivot_in_A = mxGetPr(prhs[4]);
+  int index = bullet_sim_->PointToPoint_one(*id, pivot_in_A);
+  ReturnIndex(index, plhs);
+}
+
+BUCKSHOT_COMMAND(AddConstraint_PointToPoint_two) {
+  double* id_A = mxGetPr(prhs[3]);
+  double* id_B = mxGetPr(prhs[4]);
+  double* pivot_in_A = mxGetPr(prhs[5]);
+  double* pivot_in_B = mxGetPr(prhs[6]);
+  int index = bullet_sim_->PointToPoint_two(*id_A, *id_B,
                                             pivot_in_A, pivot_in_B);
-    }
+  ReturnIndex(index, plhs);
+}
 
-    ///////
-    //Hinge
-    ///////
-    if (!strcmp("Hinge_one_transform", constraint)) {
-      double* id = mxGetPr(prhs[3]);
-      double* transform_A = mxGetPr(prhs[4]);
-      double* limits = mxGetPr(prhs[5]);
-      index = bullet_sim_->Hinge_one_transform(*id, transform_A, limits);
-    }
+BUCKSHOT_COMMAND(AddConstraint_Hinge_one_transform) {
+  double* id = mxGetPr(prhs[3]);
+  double* transform_A = mxGetPr(prhs[4]);
+  double* limits = mxGetPr(prhs[5]);
+  int index = bullet_sim_->Hinge_one_transform(*id, transform_A, limits);
+  ReturnIndex(index, plhs);
+}
 
-    if (!strcmp("Hinge_two_transform", constraint)) {
-      double* id_A = mxGetPr(prhs[3]);
-      double* id_B = mxGetPr(prhs[4]);
-      double* transform_A = mxGetPr(prhs[5]);
-      double* transform_B = mxGetPr(prhs[6]);
-      double* limits = mxGetPr(prhs[7]);
-      index = bullet_sim_->Hinge_two_transform(*id_A, *id_B,
+BUCKSHOT_COMMAND(AddConstraint_Hinge_two_transform) {
+  double* id_A = mxGetPr(prhs[3]);
+  double* id_B = mxGetPr(prhs[4]);
+  double* transform_A = mxGetPr(prhs[5]);
+  double* transform_B = mxGetPr(prhs[6]);
+  double* limits = mxGetPr(prhs[7]);
+  int index = bullet_sim_->Hinge_two_transform(*id_A, *id_B,
                                                transform_A, transform_B, limits);
-    }
+  ReturnIndex(index, plhs);
+}
 
-    if (!strcmp("Hinge_one_pivot", constraint)) {
-      double* id_A = mxGetPr(prhs[3]);
-      double* pivot_in_A = mxGetPr(prhs[4]);
-      double* axis_in_A = mxGetPr(prhs[5]);
-      double* limits = mxGetPr(prhs[6]);
-      index = bullet_sim_->Hinge_one_pivot(*id_A, pivot_in_A,
+BUCKSHOT_COMMAND(AddConstraint_Hinge_one_pivot) {
+  double* id_A = mxGetPr(prhs[3]);
+  double* pivot_in_A = mxGetPr(prhs[4]);
+  double* axis_in_A = mxGetPr(prhs[5]);
+  double* limits = mxGetPr(prhs[6]);
+  int index = bullet_sim_->Hinge_one_pivot(*id_A, pivot_in_A,
                                            axis_in_A, limits);
-    }
+  ReturnIndex(index, plhs);
+}
 
-    if (!strcmp("Hinge_two_pivot", constraint)) {
-      double* id_A = mxGetPr(prhs[3]);
-      double* id_B = mxGetPr(prhs[4]);
-      double* pivot_in_A = mxGetPr(prhs[5]);
-      double* pivot_in_B = mxGetPr(prhs[6]);
-      double* axis_in_A = mxGetPr(prhs[7]);
-      double* axis_in_B = mxGetPr(prhs[8]);
-      double* limits = mxGetPr(prhs[9]);
-      index = bullet_sim_->Hinge_two_pivot(*id_A, *id_B,
+BUCKSHOT_COMMAND(AddConstraint_Hinge_two_pivot) {
+  double* id_A = mxGetPr(prhs[3]);
+  double* id_B = mxGetPr(prhs[4]);
+  double* pivot_in_A = mxGetPr(prhs[5]);
+  double* pivot_in_B = mxGetPr(prhs[6]);
+  double* axis_in_A = mxGetPr(prhs[7]);
+  double* axis_in_B = mxGetPr(prhs[8]);
+  double* limits = mxGetPr(prhs[9]);
+  int index = bullet_sim_->Hinge_two_pivot(*id_A, *id_B,
                                            pivot_in_A, pivot_in_B,
                                            axis_in_A, axis_in_B, limits);
-    }
+  ReturnIndex(index, plhs);
+}
 
-    ///////
-    //Hinge2 (for cars)
-    ///////
-    if (!strcmp("Hinge2", constraint)){
-      double* id_A = mxGetPr(prhs[3]);
-      double* id_B = mxGetPr(prhs[4]);
-      double* Anchor = mxGetPr(prhs[5]);
-      double* Axis_1 = mxGetPr(prhs[6]);
-      double* Axis_2 = mxGetPr(prhs[7]);
-      double* damping = mxGetPr(prhs[8]);
-      double* stiffness = mxGetPr(prhs[9]);
-      double* steering_angle = mxGetPr(prhs[10]);
-      index = bullet_sim_->Hinge2(*id_A, *id_B, Anchor, Axis_1, Axis_2, *damping,
+BUCKSHOT_COMMAND(AddConstraint_Hinge2) {
+  double* id_A = mxGetPr(prhs[3]);
+  double* id_B = mxGetPr(prhs[4]);
+  double* Anchor = mxGetPr(prhs[5]);
+  double* Axis_1 = mxGetPr(prhs[6]);
+  double* Axis_2 = mxGetPr(prhs[7]);
+  double* damping = mxGetPr(prhs[8]);
+  double* stiffness = mxGetPr(prhs[9]);
+  double* steering_angle = mxGetPr(prhs[10]);
+  int index = bullet_sim_->Hinge2(*id_A, *id_B, Anchor, Axis_1, Axis_2, *damping,
                                   *stiffness, *steering_angle);
-    }
+  ReturnIndex(index, plhs);
+}
 
-    ///////
-    //Six DOF
-    ///////
-    if (!strcmp("SixDOF_one", constraint)){
-      double* id = mxGetPr(prhs[3]);
-      double* transform_A = mxGetPr(prhs[4]);
-      double* limits = mxGetPr(prhs[5]);
-      index = bullet_sim_->SixDOF_one(*id, transform_A, limits);
+BUCKSHOT_COMMAND(AddConstraint_SixDOF_one) {
+  double* id = mxGetPr(prhs[3]);
+  double* transform_A = mxGetPr(prhs[4]);
+  double* limits = mxGetPr(prhs[5]);
+  int index = bullet_sim_->SixDOF_one(*id, transform_A, limits);
+  ReturnIndex(index, plhs);
+}
+
+/*********************************************************************
+ *
+ *GETTERS FOR OBJECT POSES
+ *
+ **********************************************************************/
+
+BUCKSHOT_COMMAND(GetTransform_Shape) {
+  double* id = mxGetPr(prhs[3]);
+  double pose[12];
+  bullet_sim_->GetShapeTransform(*id, pose);
+  plhs[0] = mxCreateDoubleMatrix(1, 3, mxREAL);
+  plhs[1] = mxCreateDoubleMatrix(3, 3, mxREAL);
+  double* position = mxGetPr(plhs[0]);
+  double* rotation = mxGetPr(plhs[1]);
+  memcpy( position, &pose[0], sizeof( double ) * 3 );
+  memcpy( rotation, &pose[3], sizeof( double ) * 9 );
+}
+
+BUCKSHOT_COMMAND(GetTransform_Constraint) {
+  double* id = mxGetPr(prhs[3]);
+  plhs[0] = mxCreateDoubleMatrix(1, 3, mxREAL);
+  double* position = mxGetPr(plhs[0]);
+  //Position
+  bullet_sim_->GetConstraintTransform(*id, position);
+}
+
+BUCKSHOT_COMMAND(GetTransform_RaycastVehicle) {
+  double* id = mxGetPr(prhs[3]);
+  plhs[0] = mxCreateDoubleMatrix(1, 3, mxREAL);
+  plhs[2] = mxCreateDoubleMatrix(1, 3, mxREAL);
+  plhs[4] = mxCreateDoubleMatrix(1, 3, mxREAL);
+  plhs[6] = mxCreateDoubleMatrix(1, 3, mxREAL);
+  plhs[8] = mxCreateDoubleMatrix(1, 3, mxREAL);
+  plhs[1] = mxCreateDoubleMatrix(3, 3, mxREAL);
+  plhs[3] = mxCreateDoubleMatrix(3, 3, mxREAL);
+  plhs[5] = mxCreateDoubleMatrix(3, 3, mxREAL);
+  plhs[7] = mxCreateDoubleMatrix(3, 3, mxREAL);
+  plhs[9] = mxCreateDoubleMatrix(3, 3, mxREAL);
+  double pose[12 * 5];
+  bullet_sim_->GetVehicleTransform(*id, pose);
+  double* body_pos = mxGetPr(plhs[0]);
+  double* wheel_fl_pos = mxGetPr(plhs[2]);
+  double* wheel_fr_pos = mxGetPr(plhs[4]);
+  double* wheel_bl_pos = mxGetPr(plhs[6]);
+  double* wheel_br_pos = mxGetPr(plhs[8]);
+  double* body_rot = mxGetPr(plhs[1]);
+  double* wheel_fl_rot = mxGetPr(plhs[3]);
+  double* wheel_fr_rot = mxGetPr(plhs[5]);
+  double* wheel_bl_rot = mxGetPr(plhs[7]);
+  double* wheel_br_rot = mxGetPr(plhs[9]);
+  body_pos[0] = pose[0*12+0];
+  body_pos[1] = pose[0*12+1];
+  body_pos[2] = pose[0*12+2];
+  body_rot[0] = pose[0*12+3];
+  body_rot[1] = pose[0*12+4];
+  body_rot[2] = pose[0*12+5];
+  body_rot[3] = pose[0*12+6];
+  body_rot[4] = pose[0*12+7];
+  body_rot[5] = pose[0*12+8];
+  body_rot[6] = pose[0*12+9];
+  body_rot[7] = pose[0*12+10];
+  body_rot[8] = pose[0*12+11];
+  wheel_fl_pos[0] = pose[1*12+0];
+  wheel_fl_pos[1] = pose[1*12+1];
+  wheel_fl_pos[2] = pose[1*12+2];
+  wheel_fl_rot[0] = pose[1*12+3];
+  wheel_fl_rot[1] = pose[1*12+4];
+  wheel_fl_rot[2] = pose[1*12+5];
+  wheel_fl_rot[3] = pose[1*12+6];
+  wheel_fl_rot[4] = pose[1*12+7];
+  wheel_fl_rot[5] = pose[1*12+8];
+  wheel_fl_rot[6] = pose[1*12+9];
+  wheel_fl_rot[7] = pose[1*12+10];
+  wheel_fl_rot[8] = pose[1*12+11];
+  wheel_fr_pos[0] = pose[2*12+0];
+  wheel_fr_pos[1] = pose[2*12+1];
+  wheel_fr_pos[2] = pose[2*12+2];
+  wheel_fr_rot[0] = pose[2*12+3];
+  wheel_fr_rot[1] = pose[2*12+4];
+  wheel_fr_rot[2] = pose[2*12+5];
+  wheel_fr_rot[3] = pose[2*12+6];
+  wheel_fr_rot[4] = pose[2*12+7];
+  wheel_fr_rot[5] = pose[2*12+8];
+  wheel_fr_rot[6] = pose[2*12+9];
+  wheel_fr_rot[7] = pose[2*12+10];
+  wheel_fr_rot[8] = pose[2*12+11];
+  wheel_bl_pos[0] = pose[3*12+0];
+  wheel_bl_pos[1] = pose[3*12+1];
+  wheel_bl_pos[2] = pose[3*12+2];
+  wheel_bl_rot[0] = pose[3*12+3];
+  wheel_bl_rot[1] = pose[3*12+4];
+  wheel_bl_rot[2] = pose[3*12+5];
+  wheel_bl_rot[3] = pose[3*12+6];
+  wheel_bl_rot[4] = pose[3*12+7];
+  wheel_bl_rot[5] = pose[3*12+8];
+  wheel_bl_rot[6] = pose[3*12+9];
+  wheel_bl_rot[7] = pose[3*12+10];
+  wheel_bl_rot[8] = pose[3*12+11];
+  wheel_br_pos[0] = pose[4*12+0];
+  wheel_br_pos[1] = pose[4*12+1];
+  wheel_br_pos[2] = pose[4*12+2];
+  wheel_br_rot[0] = pose[4*12+3];
+  wheel_br_rot[1] = pose[4*12+4];
+  wheel_br_rot[2] = pose[4*12+5];
+  wheel_br_rot[3] = pose[4*12+6];
+  wheel_br_rot[4] = pose[4*12+7];
+  wheel_br_rot[5] = pose[4*12+8];
+  wheel_br_rot[6] = pose[4*12+9];
+  wheel_br_rot[7] = pose[4*12+10];
+  wheel_br_rot[8] = pose[4*12+11];
+}
+
+// GetAllTransforms: a 12 x bodies array, one [position; rotation(:)]
+// column per body in StepSimulationN's order, filled in a single pass.
+BUCKSHOT_COMMAND(GetAllTransforms) {
+  plhs[0] = mxCreateDoubleMatrix(
+      12, bullet_sim_->NumRecordedPoses(BulletWorld::RECORD_ALL), mxREAL);
+  bullet_sim_->GetAllTransforms(mxGetPr(plhs[0]));
+}
+
+// MapPoses: publishes every pose to a memory-mapped file after each step,
+// for bullet_interface.ReadPoses to read without calling back in.
+BUCKSHOT_COMMAND(MapPoses) {
+  char path[4096];
+  if (nrhs < 3 || mxGetString(prhs[2], path, sizeof(path)))
+    mexErrMsgTxt("MapPoses: Expected a file path.");
+  if (!bullet_sim_->MapPoses(path))
+    mexErrMsgTxt("MapPoses: Could not map the pose file.");
+}
+
+BUCKSHOT_COMMAND(UnmapPoses) {
+  bullet_sim_->UnmapPoses();
+}
+
+/*********************************************************************
+ *
+ *ASYNCHRONOUS SIMULATION
+ *While it runs, the background thread owns the world, so these are the
+ *only commands allowed until StopAsync.
+ *
+ **********************************************************************/
+
+// StartAsync: steps in the background at the given rate (Hz), or as fast
+// as possible without one.
+BUCKSHOT_COMMAND(StartAsync) {
+  double rate_hz = 0;
+  if (nrhs > 2) {
+    rate_hz = mxGetScalar(prhs[2]);
+  }
+  // The thread runs in this MEX file, so it mustn't be unloaded under it.
+  if (!bullet_sim_->IsAsyncRunning()) {
+    bullet_sim_->Async()->Start(rate_hz);
+    mexLock();
+  }
+}
+
+BUCKSHOT_COMMAND(StopAsync) {
+  if (bullet_sim_->IsAsyncRunning()) {
+    bullet_sim_->Async()->Stop();
+    mexUnlock();
+  }
+}
+
+static void CheckAsyncVehicle(const char* name, BulletWorld* bullet_sim_,
+                              double id) {
+  if (id < 0 || id >= bullet_sim_->NumRaycastVehicles()) {
+    std::string message = std::string(name) + ": Invalid vehicle id.";
+    mexErrMsgTxt(message.c_str());
+  }
+}
+
+// PushCommand: queues a raycast vehicle command for the next async step.
+BUCKSHOT_COMMAND(PushCommand) {
+  if (nrhs < 5)
+    mexErrMsgTxt("PushCommand: Expected an id, steering angle and force.");
+  double* id = mxGetPr(prhs[2]);
+  double* phi = mxGetPr(prhs[3]);
+  double* force = mxGetPr(prhs[4]);
+  CheckAsyncVehicle("PushCommand", bullet_sim_, *id);
+  if (!bullet_sim_->Async()->PushCommand(*id, *phi, *force))
+    mexErrMsgTxt("PushCommand: Command queue is full.");
+}
+
+// PushCommands: PushCommand for vectors of ids, steering angles and forces.
+BUCKSHOT_COMMAND(PushCommands) {
+  int n = CheckCommandVectors("PushCommands", nrhs, prhs, 2);
+  double* ids = mxGetPr(prhs[2]);
+  double* phi = mxGetPr(prhs[3]);
+  double* force = mxGetPr(prhs[4]);
+  for (int i = 0; i < n; i++) {
+    CheckAsyncVehicle("PushCommands", bullet_sim_, ids[i]);
+  }
+  if (!bullet_sim_->Async()->PushCommands(n, ids, phi, force))
+    mexErrMsgTxt("PushCommands: Not enough room in the command queue; none "
+                 "were queued.");
+}
+
+// ReadAsyncPoses: the latest 12 x bodies poses and the step they're from.
+BUCKSHOT_COMMAND(ReadAsyncPoses) {
+  std::vector<double> poses;
+  long frame = bullet_sim_->Async()->ReadPoses(&poses);
+  plhs[0] = mxCreateDoubleMatrix(12, poses.size() / 12, mxREAL);
+  std::copy(poses.begin(), poses.end(), mxGetPr(plhs[0]));
+  if (nlhs > 1) {
+    plhs[1] = mxCreateDoubleScalar((double)frame);
+  }
+}
+
+/*********************************************************************
+ *
+ *DISPATCH
+ *
+ **********************************************************************/
+
+struct CommandEntry {
+  const char* name;
+  Command handler;
+  // Whether the command may run while the async thread owns the world
+  bool async_safe;
+};
+
+// A command's opcode is its index here, so only ever append to this list.
+static const CommandEntry kCommands[] = {
+  {"reset", Reset},
+  {"useOpenGL", UseOpenGL},
+  {"SaveState", SaveState},
+  {"RestoreState", RestoreState},
+  {"ReleaseState", ReleaseState},
+  {"AddTerrain", AddTerrain},
+  {"AddShape:Cube", AddShape_Cube},
+  {"AddShape:Sphere", AddShape_Sphere},
+  {"AddShape:Cylinder", AddShape_Cylinder},
+  {"AddRaycastVehicle", AddRaycastVehicle},
+  {"StepSimulation", StepSimulation},
+  {"StepSimulationN", StepSimulationN},
+  {"StepGUI", StepGUI},
+  {"RunSimulation", RunSimulation},
+  {"CommandCompound:Vehicle", CommandCompound_Vehicle},
+  {"CommandRaycastVehicle", CommandRaycastVehicle},
+  {"RunRollouts", RunRollouts},
+  {"GetMotionState", GetMotionState},
+  {"SetToGround", SetToGround},
+  {"ResetVehicle", ResetVehicle},
+  {"AddConstraint:PointToPoint_one", AddConstraint_PointToPoint_one},
+  {"AddConstraint:PointToPoint_two", AddConstraint_PointToPoint_two},
+  {"AddConstraint:Hinge_one_transform", AddConstraint_Hinge_one_transform},
+  {"AddConstraint:Hinge_two_transform", AddConstraint_Hinge_two_transform},
+  {"AddConstraint:Hinge_one_pivot", AddConstraint_Hinge_one_pivot},
+  {"AddConstraint:Hinge_two_pivot", AddConstraint_Hinge_two_pivot},
+  {"AddConstraint:Hinge2", AddConstraint_Hinge2},
+  {"AddConstraint:SixDOF_one", AddConstraint_SixDOF_one},
+  {"GetTransform:Shape", GetTransform_Shape},
+  {"GetTransform:Constraint", GetTransform_Constraint},
+  {"GetTransform:RaycastVehicle", GetTransform_RaycastVehicle},
+  {"GetAllTransforms", GetAllTransforms},
+  {"MapPoses", MapPoses},
+  {"UnmapPoses", UnmapPoses},
+  {"StartAsync", StartAsync, true},
+  {"StopAsync", StopAsync, true},
+  {"PushCommand", PushCommand, true},
+  {"ReadAsyncPoses", ReadAsyncPoses, true},
+  {"AddHeightfield", AddHeightfield},
+  {"AddTiledTerrain", AddTiledTerrain},
+  {"AddTerrainFromFile", AddTerrainFromFile},
+  {"SetBvhCache", SetBvhCache},
+  {"UpdateTerrainRegion", UpdateTerrainRegion},
+  {"QueryGroundHeights", QueryGroundHeights},
+  {"RaycastBatch", RaycastBatch},
+  {"AddLidar", AddLidar},
+  {"ReadLidar", ReadLidar},
+  {"AddFleet", AddFleet},
+  {"CommandFleet", CommandFleet},
+  {"CommandRaycastVehicles", CommandRaycastVehicles},
+  {"SetControlDelay", SetControlDelay},
+  {"CommandCompounds:Vehicle", CommandCompounds_Vehicle},
+  {"PushCommands", PushCommands, true},
+  {"GetSimTime", GetSimTime, true},
+  {"SetDeterministic", SetDeterministic},
+  {"StateHash", StateHash},
+  {"StartTrace", StartTrace},
+  {"StopTrace", StopTrace},
+  {"OpenTrace", OpenTrace},
+  {"ReadTrace", ReadTrace},
+  {"CloseTrace", CloseTrace},
+  {"GetProfile", GetProfile},
+  {"ResetProfile", ResetProfile},
+};
+
+static const int kNumCommands = sizeof(kCommands) / sizeof(kCommands[0]);
+
+// Returns the opcode for name, or -1 if there's no such command.
+static int LookupCommand(const std::string& name) {
+  static std::unordered_map<std::string, int> opcodes;
+  if (opcodes.empty()) {
+    for (int i = 0; i < kNumCommands; i++) {
+      opcodes[kCommands[i].name] = i;
     }
+  }
+  std::unordered_map<std::string, int>::const_iterator it =
+      opcodes.find(name);
+  return it == opcodes.end() ? -1 : it->second;
+}
 
-    plhs[0] = mxCreateDoubleMatrix(1, 1, mxREAL);
-    double* ConstIndex = mxGetPr(plhs[0]);
-    *ConstIndex = (double)index;
-    return;
+// A struct with one field per command, holding its opcode. Field names
+// replace the ':' in typed commands with '_', e.g. ops.GetTransform_Shape.
+static mxArray* CreateOpcodeStruct() {
+  std::vector<std::string> names(kNumCommands);
+  std::vector<const char*> fields(kNumCommands);
+  for (int i = 0; i < kNumCommands; i++) {
+    names[i] = kCommands[i].name;
+    std::replace(names[i].begin(), names[i].end(), ':', '_');
+    fields[i] = names[i].c_str();
   }
+  mxArray* ops = mxCreateStructMatrix(1, 1, kNumCommands, fields.data());
+  for (int i = 0; i < kNumCommands; i++) {
+    mxSetFieldByNumber(ops, 0, i, mxCreateDoubleScalar(i));
+  }
+  return ops;
+}
 
+void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
+{
+  // Commands come in as an opcode or as a name
+  int opcode = -1;
+  char cmd[64];
+  if (nrhs >= 1 && mxIsDouble(prhs[0]) && mxGetNumberOfElements(prhs[0]) == 1) {
+    opcode = (int)mxGetScalar(prhs[0]);
+    if (opcode < 0 || opcode >= kNumCommands)
+      mexErrMsgTxt("Opcode out of range.");
+  }
+  else if (nrhs < 1 || mxGetString(prhs[0], cmd, sizeof(cmd)))
+    mexErrMsgTxt("First input should be a command string less than 64 characters long.");
 
-  /*********************************************************************
-   *
-   *GETTERS FOR OBJECT POSES
-   *
-   **********************************************************************/
-
-
-  if (!strcmp("GetTransform", cmd)) {
-    //Get the type of the constraint
-    char type[64];
-    mxGetString(prhs[2], type, sizeof(type));
-    double* id = mxGetPr(prhs[3]);
-    if(!strcmp(type, "Shape")){
-      std::vector<double> pose = bullet_sim_->GetShapeTransform(*id);
-      plhs[0] = mxCreateDoubleMatrix(1, 3, mxREAL);
-      plhs[1] = mxCreateDoubleMatrix(3, 3, mxREAL);
-      double* position = mxGetPr(plhs[0]);
-      double* rotation = mxGetPr(plhs[1]);
-      memcpy( position, &pose[0], sizeof( double ) * 3 );
-      memcpy( rotation, &pose[3], sizeof( double ) * 9 );
+  if (opcode < 0) {
+    // New
+    if (!strcmp("new", cmd)) {
+      // Check parameters
+      if (nlhs != 1)
+        mexErrMsgTxt("New: One output expected.");
+      // Return a handle to a new C++ instance
+      plhs[0] = convertPtr2Mat<BulletWorld>(new BulletWorld);
+      void mexUnlock(void);
+      return;
     }
-    else if(!strcmp(type, "Constraint")){
-      plhs[0] = mxCreateDoubleMatrix(1, 3, mxREAL);
-      std::vector<double> pose = bullet_sim_->GetConstraintTransform(*id);
-      double* position = mxGetPr(plhs[0]);
-      //Position
-      memcpy( position, &pose[0], sizeof( double ) * 3 );
+
+    // Opcodes: the table MATLAB uses to skip the name lookup
+    if (!strcmp("opcodes", cmd)) {
+      plhs[0] = CreateOpcodeStruct();
+      return;
     }
-    else if(!strcmp(type, "RaycastVehicle")){
-      plhs[0] = mxCreateDoubleMatrix(1, 3, mxREAL);
-      plhs[2] = mxCreateDoubleMatrix(1, 3, mxREAL);
-      plhs[4] = mxCreateDoubleMatrix(1, 3, mxREAL);
-      plhs[6] = mxCreateDoubleMatrix(1, 3, mxREAL);
-      plhs[8] = mxCreateDoubleMatrix(1, 3, mxREAL);
-      plhs[1] = mxCreateDoubleMatrix(3, 3, mxREAL);
-      plhs[3] = mxCreateDoubleMatrix(3, 3, mxREAL);
-      plhs[5] = mxCreateDoubleMatrix(3, 3, mxREAL);
-      plhs[7] = mxCreateDoubleMatrix(3, 3, mxREAL);
-      plhs[9] = mxCreateDoubleMatrix(3, 3, mxREAL);
-      double* pose = bullet_sim_->GetVehicleTransform(*id);
-      double* body_pos = mxGetPr(plhs[0]);
-      double* wheel_fl_pos = mxGetPr(plhs[2]);
-      double* wheel_fr_pos = mxGetPr(plhs[4]);
-      double* wheel_bl_pos = mxGetPr(plhs[6]);
-      double* wheel_br_pos = mxGetPr(plhs[8]);
-      double* body_rot = mxGetPr(plhs[1]);
-      double* wheel_fl_rot = mxGetPr(plhs[3]);
-      double* wheel_fr_rot = mxGetPr(plhs[5]);
-      double* wheel_bl_rot = mxGetPr(plhs[7]);
-      double* wheel_br_rot = mxGetPr(plhs[9]);
-      body_pos[0] = pose[0*12+0];
-      body_pos[1] = pose[0*12+1];
-      body_pos[2] = pose[0*12+2];
-      body_rot[0] = pose[0*12+3];
-      body_rot[1] = pose[0*12+4];
-      body_rot[2] = pose[0*12+5];
-      body_rot[3] = pose[0*12+6];
-      body_rot[4] = pose[0*12+7];
-      body_rot[5] = pose[0*12+8];
-      body_rot[6] = pose[0*12+9];
-      body_rot[7] = pose[0*12+10];
-      body_rot[8] = pose[0*12+11];
-      wheel_fl_pos[0] = pose[1*12+0];
-      wheel_fl_pos[1] = pose[1*12+1];
-      wheel_fl_pos[2] = pose[1*12+2];
-      wheel_fl_rot[0] = pose[1*12+3];
-      wheel_fl_rot[1] = pose[1*12+4];
-      wheel_fl_rot[2] = pose[1*12+5];
-      wheel_fl_rot[3] = pose[1*12+6];
-      wheel_fl_rot[4] = pose[1*12+7];
-      wheel_fl_rot[5] = pose[1*12+8];
-      wheel_fl_rot[6] = pose[1*12+9];
-      wheel_fl_rot[7] = pose[1*12+10];
-      wheel_fl_rot[8] = pose[1*12+11];
-      wheel_fr_pos[0] = pose[2*12+0];
-      wheel_fr_pos[1] = pose[2*12+1];
-      wheel_fr_pos[2] = pose[2*12+2];
-      wheel_fr_rot[0] = pose[2*12+3];
-      wheel_fr_rot[1] = pose[2*12+4];
-      wheel_fr_rot[2] = pose[2*12+5];
-      wheel_fr_rot[3] = pose[2*12+6];
-      wheel_fr_rot[4] = pose[2*12+7];
-      wheel_fr_rot[5] = pose[2*12+8];
-      wheel_fr_rot[6] = pose[2*12+9];
-      wheel_fr_rot[7] = pose[2*12+10];
-      wheel_fr_rot[8] = pose[2*12+11];
-      wheel_bl_pos[0] = pose[3*12+0];
-      wheel_bl_pos[1] = pose[3*12+1];
-      wheel_bl_pos[2] = pose[3*12+2];
-      wheel_bl_rot[0] = pose[3*12+3];
-      wheel_bl_rot[1] = pose[3*12+4];
-      wheel_bl_rot[2] = pose[3*12+5];
-      wheel_bl_rot[3] = pose[3*12+6];
-      wheel_bl_rot[4] = pose[3*12+7];
-      wheel_bl_rot[5] = pose[3*12+8];
-      wheel_bl_rot[6] = pose[3*12+9];
-      wheel_bl_rot[7] = pose[3*12+10];
-      wheel_bl_rot[8] = pose[3*12+11];
-      wheel_br_pos[0] = pose[4*12+0];
-      wheel_br_pos[1] = pose[4*12+1];
-      wheel_br_pos[2] = pose[4*12+2];
-      wheel_br_rot[0] = pose[4*12+3];
-      wheel_br_rot[1] = pose[4*12+4];
-      wheel_br_rot[2] = pose[4*12+5];
-      wheel_br_rot[3] = pose[4*12+6];
-      wheel_br_rot[4] = pose[4*12+7];
-      wheel_br_rot[5] = pose[4*12+8];
-      wheel_br_rot[6] = pose[4*12+9];
-      wheel_br_rot[7] = pose[4*12+10];
-      wheel_br_rot[8] = pose[4*12+11];
+  }
+
+  // Check there is a second input, which should be the class instance handle
+  if (nrhs < 2)
+    mexErrMsgTxt("Second input should be a class instance handle.");
+
+  if (opcode < 0) {
+    // Delete
+    if (!strcmp("delete", cmd)) {
+      // Destroy the C++ object, and its async thread's lock with it
+      if (convertMat2Ptr<BulletWorld>(prhs[1])->IsAsyncRunning())
+        mexUnlock();
+      destroyObject<BulletWorld>(prhs[1]);
+      // Warn if other commands were ignored
+      if (nlhs != 0 || nrhs != 2)
+        mexWarnMsgTxt("Delete: Unexpected arguments ignored.");
+      return;
     }
 
-    return;
+    opcode = LookupCommand(cmd);
+    // Typed commands are registered as "Command:Type"
+    if (opcode < 0 && nrhs > 2 && mxIsChar(prhs[2])) {
+      char type[64];
+      mxGetString(prhs[2], type, sizeof(type));
+      opcode = LookupCommand(std::string(cmd) + ":" + type);
+    }
+    // Got here, so command not recognized
+    if (opcode < 0)
+      mexErrMsgTxt("Command not recognized.");
   }
 
-  /**************************/
-
-  // Got here, so command not recognized
-  mexErrMsgTxt("Command not recognized.");
+  // Get the class instance pointer from the second input
+  BulletWorld *bullet_sim_ = convertMat2Ptr<BulletWorld>(prhs[1]);
+  if (!kCommands[opcode].async_safe && bullet_sim_->IsAsyncRunning())
+    mexErrMsgTxt("The simulation is running asynchronously; call StopAsync first.");
+  kCommands[opcode].handler(bullet_sim_, nlhs, plhs, nrhs, prhs);
 }
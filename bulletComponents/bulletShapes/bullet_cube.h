@@ -30,6 +30,7 @@ public:
   }
 
   void getDrawData() {
+#ifndef BUCKSHOT_HEADLESS
     //  Front
     glColor3f(0,1,0);
     glBegin(GL_QUADS);
@@ -57,5 +58,6 @@ public:
     glTexCoord2f(1,1); glVertex3f(+1,-1,+1);
     glTexCoord2f(0,1); glVertex3f(-1,-1,+1);
     glEnd();
+#endif
   }                                                         
 };
@@ -31,12 +31,14 @@ public:
   }
 
   void getDrawData() {
+#ifndef BUCKSHOT_HEADLESS
     glColor3f( 1, 1, 1);
     GLUquadricObj *quadric;
     quadric = gluNewQuadric();
     gluQuadricDrawStyle(quadric, GLU_FILL );
     gluCylinder(quadric, _radius, _radius, _height, 36, 18);
     gluDeleteQuadric(quadric);
+#endif
   }
 
   double _radius, _height;
@@ -0,0 +1,281 @@
+#pragma once
+
+#include <bullet/btBulletDynamicsCommon.h>
+#include <bullet/BulletCollision/CollisionShapes/btHeightfieldTerrainShape.h>
+#include <bullet/LinearMath/btAlignedAllocator.h>
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <vector>
+#include "bullet_shape.h"
+
+// Constructs a btHeightfieldTerrainShape straight from a regular X/Y/Z grid
+// (a MATLAB meshgrid, either orientation). Only the heights are stored, as
+// floats or as int16s quantized over the height range around its middle,
+// instead of bullet_heightmap's vertex and index arrays and BVH.
+
+class bullet_heightfield : public bullet_shape {
+
+public:
+  // What a meshgrid field is built from once it's been laid out for
+  // Bullet. The heights are shared, not copied, by every field built from
+  // it, so a world's clones cost no height memory of their own.
+  struct Grid {
+    int width;
+    int length;
+    // One of these holds the heights.
+    std::shared_ptr<const std::vector<float> > floats;
+    std::shared_ptr<const std::vector<short> > shorts;
+    double scale;
+    double offset;
+    double min_ht;
+    double max_ht;
+    double x_step;
+    double y_step;
+    double center_x;
+    double center_y;
+  };
+
+  bullet_heightfield(int row_count, int col_count, double* X, double* Y,
+                     double* Z, bool quantize) {
+    // Work out which grid index walks along world x. Z is column-major, so
+    // element (r, c) is at r + c * row_count.
+    bool x_along_cols = col_count > 1 &&
+        std::fabs(X[row_count] - X[0]) > std::fabs(X[1] - X[0]);
+    width_ = x_along_cols ? col_count : row_count;
+    length_ = x_along_cols ? row_count : col_count;
+    double x_span = X[Index(width_ - 1, 0, x_along_cols, row_count)] - X[0];
+    double y_span = Y[Index(0, length_ - 1, x_along_cols, row_count)] - Y[0];
+    double x_step = width_ > 1 ? x_span / (width_ - 1) : 1;
+    double y_step = length_ > 1 ? y_span / (length_ - 1) : 1;
+
+    // Bullet wants data[y * width + x], increasing along both axes.
+    int count = width_ * length_;
+    min_ht_ = *std::min_element(Z, Z + count);
+    max_ht_ = *std::max_element(Z, Z + count);
+    // Quantizing around the middle of the range rather than zero keeps
+    // every int16 step in use, however high the terrain sits.
+    offset_ = quantize ? (min_ht_ + max_ht_) / 2 : 0;
+    scale_ = (max_ht_ - min_ht_) / 2 / 32767;
+    if (scale_ == 0) {
+      scale_ = 1;
+    }
+    std::shared_ptr<std::vector<float> > floats;
+    std::shared_ptr<std::vector<short> > shorts;
+    if (quantize) {
+      shorts.reset(new std::vector<short>(count));
+    } else {
+      floats.reset(new std::vector<float>(count));
+    }
+    for (int y = 0; y < length_; y++) {
+      for (int x = 0; x < width_; x++) {
+        int from = Index(x_step < 0 ? width_ - 1 - x : x,
+                         y_step < 0 ? length_ - 1 - y : y,
+                         x_along_cols, row_count);
+        if (quantize) {
+          (*shorts)[y * width_ + x] =
+              (short)std::floor((Z[from] - offset_) / scale_ + 0.5);
+        } else {
+          (*floats)[y * width_ + x] = Z[from];
+        }
+      }
+    }
+
+    grid_.width = width_;
+    grid_.length = length_;
+    grid_.floats = floats;
+    grid_.shorts = shorts;
+    grid_.scale = scale_;
+    grid_.offset = offset_;
+    grid_.min_ht = min_ht_;
+    grid_.max_ht = max_ht_;
+    grid_.x_step = std::fabs(x_step);
+    grid_.y_step = std::fabs(y_step);
+    grid_.center_x = X[0] + x_span / 2;
+    grid_.center_y = Y[0] + y_span / 2;
+    InitGrid();
+  }
+
+  // Another field over the same grid, sharing its heights
+  explicit bullet_heightfield(const Grid& grid) {
+    width_ = grid.width;
+    length_ = grid.length;
+    scale_ = grid.scale;
+    offset_ = grid.offset;
+    min_ht_ = grid.min_ht;
+    max_ht_ = grid.max_ht;
+    grid_ = grid;
+    InitGrid();
+  }
+
+  // Only set for fields built from a meshgrid
+  const Grid& grid() {
+    return grid_;
+  }
+
+  // A field over float heights that someone else owns, like a tile of a
+  // mapped terrain file. They're laid out the way Bullet reads them,
+  // heights[y * width + x] with x and y increasing along world x and y,
+  // step apart, and sample (0, 0) at (x0, y0). heights must outlive us.
+  bullet_heightfield(int width, int length, const float* heights,
+                     double step, double x0, double y0) {
+    width_ = width;
+    length_ = length;
+    int count = width_ * length_;
+    min_ht_ = *std::min_element(heights, heights + count);
+    max_ht_ = *std::max_element(heights, heights + count);
+    scale_ = 1;
+    offset_ = 0;
+    Init(heights, PHY_FLOAT, step, step,
+         x0 + (width_ - 1) * step / 2, y0 + (length_ - 1) * step / 2);
+  }
+
+  // The same over int16 heights, each scale meters a step up from offset,
+  // when the height range is already known (like a mapped terrain file's
+  // header).
+  bullet_heightfield(int width, int length, const short* heights,
+                     double scale, double offset, double min_ht,
+                     double max_ht, double step, double x0, double y0) {
+    width_ = width;
+    length_ = length;
+    min_ht_ = min_ht;
+    max_ht_ = max_ht;
+    scale_ = scale;
+    offset_ = offset;
+    Init(heights, PHY_SHORT, step, step,
+         x0 + (width_ - 1) * step / 2, y0 + (length_ - 1) * step / 2);
+  }
+
+  /// OpenGL stuff
+  void getDrawData() {
+#ifndef BUCKSHOT_HEADLESS
+    // A wireframe of at most ~100 lines each way, in the field's own frame.
+    int stride = std::max(1, std::max(width_, length_) / 100);
+    double x0 = -(width_ - 1) * x_step_ / 2;
+    double y0 = -(length_ - 1) * y_step_ / 2;
+    double z0 = (min_ht_ + max_ht_) / 2;
+    glLineWidth(1);
+    glColor3f(0.4, 0.8, 0.4);
+    for (int y = 0; y < length_; y += stride) {
+      glBegin(GL_LINE_STRIP);
+      for (int x = 0; x < width_; x += stride) {
+        glVertex3f(x0 + x * x_step_, y0 + y * y_step_, Height(x, y) - z0);
+      }
+      glEnd();
+    }
+    for (int x = 0; x < width_; x += stride) {
+      glBegin(GL_LINE_STRIP);
+      for (int y = 0; y < length_; y += stride) {
+        glVertex3f(x0 + x * x_step_, y0 + y * y_step_, Height(x, y) - z0);
+      }
+      glEnd();
+    }
+#endif
+  }
+
+  // World height of grid sample (x, y)
+  double Height(int x, int y) {
+    if (type_ == PHY_SHORT) {
+      return static_cast<const short*>(heights_)[y * width_ + x] * scale_ +
+          offset_;
+    }
+    return static_cast<const float*>(heights_)[y * width_ + x];
+  }
+
+  // The ground height and normal at world (x, y), on the same triangles
+  // Bullet collides with, without a raycast. False if (x, y) is off the
+  // field.
+  bool Sample(double x, double y, double* z, double* normal) {
+    if (width_ < 2 || length_ < 2) {
+      return false;
+    }
+    const btVector3& center = bulletBody->getWorldTransform().getOrigin();
+    double u = (x - center.x()) / x_step_ + (width_ - 1) / 2.0;
+    double v = (y - center.y()) / y_step_ + (length_ - 1) / 2.0;
+    if (u < 0 || v < 0 || u > width_ - 1 || v > length_ - 1) {
+      return false;
+    }
+    int i = std::min((int)u, width_ - 2);
+    int j = std::min((int)v, length_ - 2);
+    u -= i;
+    v -= j;
+    // Bullet splits each cell from (i + 1, j) to (i, j + 1).
+    double dz_du, dz_dv, height;
+    if (u + v <= 1) {
+      dz_du = Height(i + 1, j) - Height(i, j);
+      dz_dv = Height(i, j + 1) - Height(i, j);
+      height = Height(i, j) + u * dz_du + v * dz_dv;
+    } else {
+      dz_du = Height(i + 1, j + 1) - Height(i, j + 1);
+      dz_dv = Height(i + 1, j + 1) - Height(i + 1, j);
+      height = Height(i + 1, j + 1) - (1 - u) * dz_du - (1 - v) * dz_dv;
+    }
+    *z = height + center.z() - (min_ht_ + max_ht_) / 2;
+    if (normal) {
+      btVector3 n(-dz_du / x_step_, -dz_dv / y_step_, 1);
+      n.normalize();
+      normal[0] = n.x();
+      normal[1] = n.y();
+      normal[2] = n.z();
+    }
+    return true;
+  }
+
+private:
+  // Builds the shape and a static body centered on (center_x, center_y).
+  void Init(const void* heights, PHY_ScalarType type, double x_step,
+            double y_step, double center_x, double center_y) {
+    heights_ = heights;
+    type_ = type;
+    x_step_ = x_step;
+    y_step_ = y_step;
+    // Bullet sees the heights as stored, so its range is less the offset.
+    btHeightfieldTerrainShape* heightfield =
+        new btHeightfieldTerrainShape(width_, length_, heights, scale_,
+                                      min_ht_ - offset_, max_ht_ - offset_,
+                                      2, type, false);
+    heightfield->setLocalScaling(btVector3(x_step, y_step, 1));
+    bulletShape = heightfield;
+
+    // Bullet centers the field on its bounding box, so put that center back
+    // where the grid was. That also adds the offset back on.
+    btTransform pose;
+    pose.setIdentity();
+    pose.setOrigin(btVector3(center_x, center_y, (min_ht_ + max_ht_) / 2));
+    bulletMotionState = new btDefaultMotionState(pose);
+    btRigidBody::btRigidBodyConstructionInfo cInfo(0, bulletMotionState,
+                                                   bulletShape,
+                                                   btVector3(0, 0, 0));
+    bulletBody = new btRigidBody(cInfo);
+    _startingPose = pose;
+  }
+
+  void InitGrid() {
+    if (grid_.shorts) {
+      Init(grid_.shorts->data(), PHY_SHORT, grid_.x_step, grid_.y_step,
+           grid_.center_x, grid_.center_y);
+    } else {
+      Init(grid_.floats->data(), PHY_FLOAT, grid_.x_step, grid_.y_step,
+           grid_.center_x, grid_.center_y);
+    }
+  }
+
+  static int Index(int x, int y, bool x_along_cols, int row_count) {
+    return x_along_cols ? y + x * row_count : x + y * row_count;
+  }
+
+  // Bullet doesn't copy the heights. When they're ours (and shared with
+  // our clones), they live here.
+  Grid grid_;
+  const void* heights_;
+  PHY_ScalarType type_;
+  int width_;
+  int length_;
+  double x_step_;
+  double y_step_;
+  // Height of one int16 step when quantized, and of int16 0
+  double scale_;
+  double offset_;
+  double min_ht_;
+  double max_ht_;
+};
@@ -4,7 +4,11 @@
 #include <bullet/BulletCollision/CollisionShapes/btBvhTriangleMeshShape.h>
 #include <bullet/BulletCollision/CollisionShapes/btStaticPlaneShape.h>
 #include <bullet/LinearMath/btAlignedAllocator.h>
+#include <algorithm>
 #include <iostream>
+#include <string>
+#include "../bvhCache.h"
+#include "../fnvHash.h"
 
 //Constructs a Bullet btHeightfieldTerrainShape.
 
@@ -14,40 +18,139 @@ public:
   //constructor
   bullet_heightmap(int row_count, int col_count, double grad, double min_ht,
                    double max_ht, double* X, double* Y, double* Z,
-                   double* normal){
+                   double* normal, const std::string& bvh_cache_dir = ""){
     _max_ht = max_ht;
+    normal_ = btVector3(normal[0], normal[1], normal[2]);
     if(max_ht<=1){
       //Just make a flat plain
-      bulletShape = new btStaticPlaneShape(
-            btVector3(normal[0], normal[1], normal[2]), 0);
-      bulletMotionState = new btDefaultMotionState(btTransform::getIdentity());
-      btRigidBody::btRigidBodyConstructionInfo cInfo(0, bulletMotionState,
-                                                     bulletShape,
-                                                     btVector3(0, 0, 0));
-      bulletBody = new btRigidBody(cInfo);
+      Build(NULL, bvh_cache_dir);
+      return;
     }
-    else{
+    NUM_VERTS_X = row_count;
+    NUM_VERTS_Y = col_count;
+    int count = NUM_VERTS_X*NUM_VERTS_Y;
+    btVector3* points = new btVector3[count];
+    for (int k = 0; k < count; k++) {
+      points[k].setValue((float)X[k], (float)Y[k], (float)Z[k]);
+    }
+    Build(points, bvh_cache_dir);
+    delete[] points;
+  }
+
+  // A copy of terrain as it is now, ruts and all, with a mesh of its own
+  bullet_heightmap(const bullet_heightmap& terrain,
+                   const std::string& bvh_cache_dir = "") {
+    _max_ht = terrain._max_ht;
+    normal_ = terrain.normal_;
+    NUM_VERTS_X = terrain.NUM_VERTS_X;
+    NUM_VERTS_Y = terrain.NUM_VERTS_Y;
+    Build(_max_ht <= 1 ? NULL : terrain.m_vertices, bvh_cache_dir);
+  }
+
+  ~bullet_heightmap() {
+    // A cached BVH lives in bvh_buffer_, and the mesh points into the
+    // rest, so the mesh has to go first.
+    delete bulletShape;
+    bulletShape = NULL;
+    btAlignedFree(bvh_buffer_);
+    delete m_indexVertexArrays;
+    delete[] m_vertices;
+    delete[] vertices;
+    delete[] gIndices;
+  }
+
+  void getDrawData() {
+#ifndef BUCKSHOT_HEADLESS
+    if (_max_ht <= 10) {
+      glLineWidth(2); 
+      glColor3f(1.0, 0.0, 0.0);
+      glBegin(GL_LINES);
+      for (int i = -10; i < 10; i++) {
+        for (int j = -10; j < 10; j++) {
+          glVertex3f(i, j, 0.0);
+          glVertex3f(j, i, 0.0);
+        }
+      }
+      glEnd();
+    } else {
+      glEnableClientState( GL_VERTEX_ARRAY );
+      glVertexPointer( 3, GL_FLOAT, 0, vertices );
+      glDrawElements( GL_TRIANGLE_STRIP, totalTriangles * 3, GL_UNSIGNED_INT, gIndices );
+      glDisableClientState( GL_VERTEX_ARRAY );
+    }
+#endif
+  }
+
+  // Replaces the heights of a w x h block of the grid, starting at grid
+  // index (x0, y0), with heights (column-major, like Z). Only the part of
+  // the BVH over the block is refit, so it's cheap enough to dig ruts as
+  // we drive. Returns false if this is a plane or the block doesn't fit.
+  bool UpdateRegion(int x0, int y0, int w, int h, const double* heights) {
+    if (_max_ht <= 1 || x0 < 0 || y0 < 0 || w < 1 || h < 1 ||
+        x0 + w > NUM_VERTS_X || y0 + h > NUM_VERTS_Y) {
+      return false;
+    }
+    btVector3 touched_min(BT_LARGE_FLOAT, BT_LARGE_FLOAT, BT_LARGE_FLOAT);
+    btVector3 touched_max(-BT_LARGE_FLOAT, -BT_LARGE_FLOAT, -BT_LARGE_FLOAT);
+    for (int j = y0; j < y0 + h; j++) {
+      for (int i = x0; i < x0 + w; i++) {
+        btVector3& vertex = m_vertices[i + j * NUM_VERTS_X];
+        // The old triangles have to be covered too, or the refit would
+        // leave their nodes bounding the old surface.
+        touched_min.setMin(vertex);
+        touched_max.setMax(vertex);
+        vertex.setZ(heights[(i - x0) + (j - y0) * w]);
+        touched_min.setMin(vertex);
+        touched_max.setMax(vertex);
+        vertices[3 * (i + j * NUM_VERTS_X) + 2] = vertex.z();
+      }
+    }
+    btBvhTriangleMeshShape* mesh =
+        static_cast<btBvhTriangleMeshShape*>(bulletShape);
+    if (touched_min.z() < mesh_min_.z() || touched_max.z() > mesh_max_.z()) {
+      // Outside the range the tree was quantized over, so a partial refit
+      // can't represent it. Requantize over the new range instead.
+      mesh_min_.setMin(touched_min);
+      mesh_max_.setMax(touched_max);
+      mesh->refitTree(mesh_min_, mesh_max_);
+    } else {
+      mesh->partialRefitTree(touched_min, touched_max);
+    }
+    return true;
+  }
+
+private:
+  // Makes the plane, or the mesh through points (NUM_VERTS_X by
+  // NUM_VERTS_Y, x fastest), and the body that holds it.
+  void Build(const btVector3* points, const std::string& bvh_cache_dir) {
+    bvh_buffer_ = NULL;
+    m_indexVertexArrays = NULL;
+    m_vertices = NULL;
+    vertices = NULL;
+    gIndices = NULL;
+    if (!points) {
+      bulletShape = new btStaticPlaneShape(normal_, 0);
+    } else {
       //////////////
       //Algorithm for populating BVHTriangleMeshShape taken from VehicleDemo.cpp
       int vertStride = sizeof(btVector3);
       int indexStride = 3*sizeof(int);
-      NUM_VERTS_X = row_count;
-      NUM_VERTS_Y = col_count;
       totalVerts = NUM_VERTS_X*NUM_VERTS_Y;
       totalTriangles = 2*(NUM_VERTS_X-1)*(NUM_VERTS_Y-1);
-      btVector3* m_vertices = new btVector3[totalVerts];
+      m_vertices = new btVector3[totalVerts];
       vertices = new float[totalVerts * 3];
       gIndices = new int[totalTriangles * 3];
+      mesh_min_ = points[0];
+      mesh_max_ = points[0];
       for (int i=0;i<NUM_VERTS_X;i++){
         for (int j=0;j<NUM_VERTS_Y;j++){
-          float width = X[i+j*NUM_VERTS_X];
-          float length = Y[i+j*NUM_VERTS_X];
-          float height = Z[i+j*NUM_VERTS_X];
-          m_vertices[i+j*NUM_VERTS_X].setValue(width, length, height);
-          // TODO:  FIGURE THIS OUT 
-          vertices[3*i + j*NUM_VERTS_X + 0] = width;
-          vertices[3*i + j*NUM_VERTS_X + 1] = length;
-          vertices[3*i + j*NUM_VERTS_X + 2] = height;
+          const btVector3& point = points[i+j*NUM_VERTS_X];
+          m_vertices[i+j*NUM_VERTS_X] = point;
+          mesh_min_.setMin(point);
+          mesh_max_.setMax(point);
+          vertices[3*(i + j*NUM_VERTS_X) + 0] = point.x();
+          vertices[3*(i + j*NUM_VERTS_X) + 1] = point.y();
+          vertices[3*(i + j*NUM_VERTS_X) + 2] = point.z();
         }
       }
 
@@ -66,43 +169,30 @@ public:
         }
       }
 
-      btTriangleIndexVertexArray* m_indexVertexArrays =
-          new btTriangleIndexVertexArray(totalTriangles,
-                                         gIndices,
-                                         indexStride,
-                                         totalVerts,
-                                         (btScalar*) &m_vertices[0].x(),
-                                         vertStride);
+      m_indexVertexArrays = new btTriangleIndexVertexArray(
+          totalTriangles, gIndices, indexStride, totalVerts,
+          (btScalar*) &m_vertices[0].x(), vertStride);
       
-      bulletShape = new btBvhTriangleMeshShape(m_indexVertexArrays, true);
-      bulletMotionState = new btDefaultMotionState(btTransform::getIdentity());
-      btRigidBody::btRigidBodyConstructionInfo cInfo(0, bulletMotionState,
-                                                     bulletShape,
-                                                     btVector3(0, 0, 0));
-      bulletBody = new btRigidBody(cInfo);
-    }
-  }
-
-  void getDrawData() {
-    if (_max_ht <= 10) {
-      glLineWidth(2); 
-      glColor3f(1.0, 0.0, 0.0);
-      glBegin(GL_LINES);
-      for (int i = -10; i < 10; i++) {
-        for (int j = -10; j < 10; j++) {
-          glVertex3f(i, j, 0.0);
-          glVertex3f(j, i, 0.0);
-        }
+      if (bvh_cache_dir.empty()) {
+        bulletShape = new btBvhTriangleMeshShape(m_indexVertexArrays, true);
+      } else {
+        // The BVH is all that's slow here, and it only depends on the mesh.
+        btBvhTriangleMeshShape* mesh =
+            new btBvhTriangleMeshShape(m_indexVertexArrays, true, false);
+        uint64_t key = FnvHash(m_vertices, totalVerts * vertStride);
+        key = FnvHash(gIndices, totalTriangles * indexStride, key);
+        bvh_buffer_ = BvhCache::Attach(mesh, bvh_cache_dir, key);
+        bulletShape = mesh;
       }
-      glEnd();
-    } else {
-      glEnableClientState( GL_VERTEX_ARRAY );
-      glVertexPointer( 3, GL_FLOAT, 0, vertices );
-      glDrawElements( GL_TRIANGLE_STRIP, totalTriangles * 3, GL_UNSIGNED_INT, gIndices );
-      glDisableClientState( GL_VERTEX_ARRAY );
     }
+    bulletMotionState = new btDefaultMotionState(btTransform::getIdentity());
+    btRigidBody::btRigidBodyConstructionInfo cInfo(0, bulletMotionState,
+                                                   bulletShape,
+                                                   btVector3(0, 0, 0));
+    bulletBody = new btRigidBody(cInfo);
   }
 
+public:
   int _max_ht;
   float* vertices;
   int* gIndices;
@@ -110,5 +200,14 @@ public:
   int totalVerts;
   int NUM_VERTS_X;
   int NUM_VERTS_Y;
+  btVector3* m_vertices;
+  btTriangleIndexVertexArray* m_indexVertexArrays;
+  // What the plane faces, if we're a plane
+  btVector3 normal_;
+  // Bounds of the mesh, which its BVH is quantized over
+  btVector3 mesh_min_;
+  btVector3 mesh_max_;
+  // Where a BVH from the cache lives, if we used one
+  void* bvh_buffer_;
 
 };
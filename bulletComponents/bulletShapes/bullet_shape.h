@@ -6,12 +6,15 @@
 /// Bullet Shapes.
 /////////////////////////////////////////
 
+// Define BUCKSHOT_HEADLESS to build the physics core without any OpenGL,
+// GLUT or GLM dependency. Shapes then have nothing to draw.
+#ifndef BUCKSHOT_HEADLESS
+
 #ifdef USEGLEW
 #include <GL/glew.h>
 #endif
 #define GL_GLEXT_PROTOTYPES
 
-/// TODO: Make this optional
 #include <GL/freeglut.h>
 
 #ifdef __APPLE__
@@ -29,6 +32,8 @@
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
+#endif  // BUCKSHOT_HEADLESS
+
 #include <memory>
 #include <vector>
 #include <bullet/btBulletDynamicsCommon.h>
@@ -36,6 +41,11 @@
 
 class bullet_shape{
  public:
+  virtual ~bullet_shape() {
+    delete bulletBody;
+    delete bulletMotionState;
+    delete bulletShape;
+  }
 
   //Set the object to the pose specified through MATLAB.
   int SetPose(double* position, double* rotation){
@@ -32,12 +32,14 @@ public:
 
   /// OpenGL stuff
   void getDrawData() {
+#ifndef BUCKSHOT_HEADLESS
     glColor3f(1, 1, 1);
     GLUquadricObj *quadric;
     quadric = gluNewQuadric();
     gluQuadricDrawStyle(quadric, GLU_FILL);
     gluSphere(quadric, _radius, 36, 18);
     gluDeleteQuadric(quadric); 
+#endif
   }
 
   double _radius;
@@ -18,10 +18,14 @@ class bullet_vehicle : public bullet_shape {
 public:
 
   //constructor
+  // A vehicle in a VehicleFleet brings its own raycaster (which we then
+  // own) and isn't added as an action, since the fleet steps it.
   bullet_vehicle(double* parameters,
                  double* position,
                  double* rotation,
-                 btDynamicsWorld* m_pDynamicsWorld){
+                 btDynamicsWorld* m_pDynamicsWorld,
+                 btVehicleRaycaster* raycaster = NULL,
+                 bool add_action = true){
 
     ///////
     //Create our Collision Objects
@@ -59,14 +63,16 @@ public:
     tuning.m_suspensionDamping = parameters[ExpDamping];
     tuning.m_maxSuspensionForce = parameters[MaxSuspForce];
     tuning.m_maxSuspensionTravelCm = parameters[MaxSuspTravel]*100.0;
-    btVehicleRaycaster* VehicleRaycaster =
+    VehicleRaycaster = raycaster ? raycaster :
         new btDefaultVehicleRaycaster(m_pDynamicsWorld);
     bulletVehicle = new btRaycastVehicle(tuning, bulletBody,
                                          VehicleRaycaster);
     // Never deactivate the vehicle
     bulletBody->forceActivationState(DISABLE_DEACTIVATION);
     bulletVehicle->setCoordinateSystem(1, 2, 0);
-    m_pDynamicsWorld->addAction( bulletVehicle );
+    if (add_action) {
+      m_pDynamicsWorld->addAction( bulletVehicle );
+    }
 
     bool bIsFrontWheel=true;
     double con_length = parameters[WheelBase]/2;
@@ -124,6 +130,11 @@ public:
     SetVehiclePose(position, rotation);
   }
 
+  ~bullet_vehicle() {
+    delete bulletVehicle;
+    delete VehicleRaycaster;
+  }
+
   void getDrawData() {}
 
   ///////////////////////////
@@ -133,10 +144,16 @@ public:
     return bulletVehicle;
   }
 
+  // Length of the parameter array passed to the constructor
+  static int NumParameters() {
+    return MagicFormula_E + 1;
+  }
+
 
 private:
   //A compound shape to hold all of our collision shapes.
   btRaycastVehicle* bulletVehicle;
+  btVehicleRaycaster* VehicleRaycaster;
 
 
   enum{
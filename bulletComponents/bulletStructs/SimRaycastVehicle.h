@@ -3,15 +3,20 @@
 
 #include "Shape.h"
 #include "VehicleEnums.h"
+#include "commandRing.h"
+#include "simClock.h"
+#include <algorithm>
 #include <iostream>
-#include <list>
+#include <vector>
 
 /*****************************************************************
  * Contents:
  * 1. CarCommand: Class to hold the steering, acceleration and
  *    reaction wheel commands that are sent to the vehicle
- * 2. SimRaycastVehicle: Class holding the parameters of the RaycastVehicle,
- *    the command list to the vehicle, and the command functors.
+ * 2. CarCommandRing: Fixed-size history of CarCommands, searchable by
+ *    how long ago they were sent
+ * 3. SimRaycastVehicle: Class holding the parameters of the RaycastVehicle,
+ *    the command history of the vehicle, and the command functors.
  *****************************************************************/
 
 //////////////////////////////////
@@ -56,6 +61,52 @@ class CarCommand
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 };
 
+//////////////////////////////////
+/// CarCommandRing
+//////////////////////////////////
+// CarCommands searchable by how long ago they were sent: a CommandRing (see
+// commandRing.h) over each command's force, curvature, steering and
+// torque, held for its m_dT. A controller thread may Push while the sim
+// thread looks commands up.
+class CarCommandRing
+{
+ public:
+  void Push(const CarCommand& command){
+    double values[kValues];
+    Pack(command, values);
+    ring_.Push(values, command.m_dT);
+  }
+
+  // What was commanded delay ago, as CommandRing::Lookup. Only the
+  // commanded values change; m_dT and m_dTime are left as they were.
+  bool Lookup(double delay, double max_history, CarCommand* command){
+    double values[kValues];
+    Pack(*command, values);
+    if(!ring_.Lookup(delay, max_history, values)){
+      return false;
+    }
+    command->m_dForce = values[0];
+    command->m_dCurvature = values[1];
+    command->m_dPhi = values[2];
+    command->m_dTorque << values[3], values[4], values[5];
+    return true;
+  }
+
+ private:
+  static const int kValues = 6;
+
+  static void Pack(const CarCommand& command, double* values){
+    values[0] = command.m_dForce;
+    values[1] = command.m_dCurvature;
+    values[2] = command.m_dPhi;
+    values[3] = command.m_dTorque[0];
+    values[4] = command.m_dTorque[1];
+    values[5] = command.m_dTorque[2];
+  }
+
+  CommandRing<kValues> ring_;
+};
+
 //////////////////////////////////////////////////////////////////
 /// SimRaycastVehicle
 //////////////////////////////////////////////////////////////////
@@ -64,17 +115,20 @@ class SimRaycastVehicle : public Shape
 {
  public:
 
+  // Commands are timed by sim_clock (the world's simulated clock, which
+  // has to outlive us), so control delay doesn't depend on how fast the
+  // host steps.
   SimRaycastVehicle(std::string sName, std::vector<double> dParameters,
-                    Eigen::Vector6d dPose){
+                    Eigen::Vector6d dPose, const SimClock* sim_clock){
     m_dParameters = dParameters;
     model_pose_ = dPose;
     model_name_ = sName;
     m_sBodyMesh = "NONE";
     m_sWheelMesh = "NONE";
     delay_time = 0;
+    clock = sim_clock;
     // For the RC car
     servo_range = 500.0;
-    total_command_time = 0;
     max_control_delay = 0.3;
     wheel_angles.push_back(0);
     wheel_angles.push_back(0);
@@ -189,16 +243,7 @@ class SimRaycastVehicle : public Shape
   //////////////////////////////////
 
   void PushDelayedControl(CarCommand& delayedCommands){
-    command_list.push_front(delayedCommands);
-    //add to the total command time
-    total_command_time += delayedCommands.m_dT;
-    //if this time is over the maximum amount, pop them off at the back
-    while(total_command_time > max_control_delay &&
-          (total_command_time - command_list.back().m_dT)
-          > max_control_delay){
-      total_command_time -= command_list.back().m_dT;
-      command_list.pop_back();
-    }
+    command_ring.Push(delayedCommands);
   }
 
   //////////////////////////////////////////////////////////////////////////////
@@ -206,50 +251,13 @@ class SimRaycastVehicle : public Shape
   void GetDelayedControl(double timeDelay, CarCommand& delayedCommands){
     //clamp the time delay to be > 0
     timeDelay = std::max(timeDelay,0.0);
-    std::list<CarCommand>& previousCommands = command_list;
     //if there is control delay, get commands from a previous time
-    double currentDelay = 0;
-    std::list<CarCommand>::iterator it = previousCommands.begin();
-    CarCommand* pCurrentCommand = &(*it);
-    int count = 0;
-    if(previousCommands.size() > 1) {
-      it++; //move to the first element
-      for(; it != previousCommands.end() ; it++) {
-        count++;
-        if( currentDelay + (*it).m_dT >= timeDelay ) {
-          //interpolate between the current and next commands
-          double r2 = (timeDelay - currentDelay)/(*it).m_dT;
-          double r1 = 1-r2;
-          delayedCommands.m_dForce =
-              r1*pCurrentCommand->m_dForce + r2*(*it).m_dForce;
-          delayedCommands.m_dCurvature =
-              r1*pCurrentCommand->m_dCurvature + r2*(*it).m_dCurvature;
-          delayedCommands.m_dPhi = r1*pCurrentCommand->m_dPhi + r2*(*it).m_dPhi;
-          delayedCommands.m_dTorque =
-              r1*pCurrentCommand->m_dTorque + r2*(*it).m_dTorque;
-          it++;
-          return;
-        }
-        else {
-          pCurrentCommand = &(*it);
-          currentDelay += pCurrentCommand->m_dT;
-          if(currentDelay == timeDelay) {
-            delayedCommands = *pCurrentCommand;
-            return;
-          }
-        }
-      }
-    }
-    else if(previousCommands.size() > 0){
-      delayedCommands = previousCommands.front();
-    }
-    else{
+    if(!command_ring.Lookup(timeDelay, max_control_delay, &delayedCommands)){
       delayedCommands.m_dForce = m_dParameters[AccelOffset] * servo_range;
       delayedCommands.m_dCurvature = 0;
       delayedCommands.m_dPhi = m_dParameters[SteeringOffset] * servo_range;
       delayedCommands.m_dTorque << 0,0,0;
     }
-
   }
 
   //////////////////////////////////////////////////////////////////////////////
@@ -304,8 +312,8 @@ class SimRaycastVehicle : public Shape
     //steering needs to be flipped due to the way RayCastVehicle works
     dCorrectedPhi *= -1;
 
-    //rate-limit the steering
-    double dRate = (dCorrectedPhi - ackerman_steering)/dT;
+    //rate-limit the steering (two commands in one sim step get no time)
+    double dRate = dT > 0 ? (dCorrectedPhi - ackerman_steering)/dT : 0;
     //clamp the rate
     dRate = _sgn(dRate) * std::min(fabs(dRate),m_dParameters[MaxSteeringRate]);
     //apply the steering
@@ -338,9 +346,7 @@ class SimRaycastVehicle : public Shape
   ///////////////////
 
   double _Tic() {
-    struct timeval tv;
-    gettimeofday(&tv, 0);
-    return tv.tv_sec  + 1e-6 * (tv.tv_usec);
+    return clock->Now();
   }
 
   double _Toc(double dTic) {
@@ -362,9 +368,9 @@ class SimRaycastVehicle : public Shape
   std::vector<double> wheel_angles;
   double ackerman_steering; // Theta originally passed to car.
   double delay_time;
+  const SimClock* clock;
   double servo_range;
-  std::list<CarCommand> command_list;
-  double total_command_time;
+  CarCommandRing command_ring;
   double max_control_delay;
 
 
@@ -1,11 +1,48 @@
 #include "bulletWorld.h"
+#include "rolloutEngine.h"
+#include "raycastEngine.h"
+#include "lidarSensor.h"
+#include "vehicleFleet.h"
+#include "poseMap.h"
+#include "asyncSimulation.h"
+#include "tiledTerrain.h"
+#include "mappedFile.h"
+#include "bvhCache.h"
+#include "fnvHash.h"
+#include "traceFile.h"
 #include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
 #include <cstring>
+#include <unordered_map>
+#include <unordered_set>
+
+// Deterministic mode's internal step rate; Bullet's default is 60 Hz.
+static const double kFixedStepRate = 60;
+
+// A raycast vehicle's command history, timed in simulated seconds.
+struct BulletWorld::ControlDelay {
+  // Starts the history over as though the pending command had held for
+  // the whole delay already, a step at a time so the blend stays even.
+  void Restart(double timestep) {
+    history.reset(new CommandRing<2>);
+    int steps = std::ceil(delay / timestep) + 1;
+    for (int i = 0; i < steps; i++) {
+      history->Push(pending, timestep);
+    }
+  }
+
+  double delay;
+  // Steering and force from the last CommandRaycastVehicle
+  double pending[2];
+  std::unique_ptr<CommandRing<2> > history;
+};
 
 // See http://bulletphysics.org/mediawiki-1.5.8/index.php/Hello_World
 BulletWorld::BulletWorld() :
   timestep_(1.0/30.0), gravity_(-9.8), max_sub_steps_(10),
-  use_opengl_(false)
+  use_opengl_(false), deterministic_(false), seed_(0), terrain_edits_(0)
 {
   bt_dispatcher_ = std::unique_ptr<btCollisionDispatcher>(
       new btCollisionDispatcher(&collision_configuration_));
@@ -13,15 +50,43 @@ BulletWorld::BulletWorld() :
   bt_solver_ = std::unique_ptr<btSequentialImpulseConstraintSolver>(
       new btSequentialImpulseConstraintSolver());
   dynamics_world_ = std::shared_ptr<btDiscreteDynamicsWorld>(
-      new btDiscreteDynamicsWorld(bt_dispatcher_.get(),
-                                  bt_broadphase_.get(),
-                                  bt_solver_.get(),
-                                  &collision_configuration_));
+      new ProfiledDynamicsWorld(bt_dispatcher_.get(),
+                                bt_broadphase_.get(),
+                                bt_solver_.get(),
+                                &collision_configuration_,
+                                &profiler_));
   dynamics_world_->setGravity(btVector3(0, 0, gravity_));
+  if (const char* dir = std::getenv("BUCKSHOT_BVH_CACHE")) {
+    bvh_cache_dir_ = dir;
+  }
 }
 
 BulletWorld::~BulletWorld() {
-  glutDestroyWindow(window);
+  // The async thread has to stop stepping before we tear anything down.
+  async_.reset();
+  tiled_terrain_.reset();
+  if (fleet_) {
+    dynamics_world_->removeAction(fleet_.get());
+  }
+  // Pull everything back out of the dynamics world before it goes away.
+  for (btTypedConstraint* constraint : constraints_) {
+    dynamics_world_->removeConstraint(constraint);
+    delete constraint;
+  }
+  for (std::unique_ptr<bullet_vehicle>& vehicle : vehicles_) {
+    dynamics_world_->removeAction(vehicle->vehiclePtr());
+    dynamics_world_->removeRigidBody(vehicle->rigidBodyPtr());
+  }
+  for (std::unique_ptr<bullet_shape>& shape : shapes_) {
+    dynamics_world_->removeRigidBody(shape->rigidBodyPtr());
+  }
+#ifndef BUCKSHOT_HEADLESS
+  // Only the world the window draws owns it.
+  if (gui_world_ == this) {
+    gui_world_ = NULL;
+    glutDestroyWindow(window);
+  }
+#endif
 }
 
 void BulletWorld::Reset() {
@@ -48,11 +113,342 @@ void BulletWorld::Reset() {
     shape->rigidBodyPtr()->setWorldTransform(shape->startingPose());
     dynamics_world_->addRigidBody(shape->rigidBodyPtr());
   }
+  for (std::unique_ptr<ControlDelay>& control : control_delays_) {
+    if (control) {
+      control->Restart(timestep_);
+    }
+  }
+  clock_.Set(0);
+  if (deterministic_) {
+    Canonicalize();
+  }
+  PublishPoses();
+}
+
+std::unique_ptr<BulletWorld> BulletWorld::Clone() {
+  std::unique_ptr<BulletWorld> clone(new BulletWorld);
+  clone->timestep_ = timestep_;
+  clone->max_sub_steps_ = max_sub_steps_;
+  clone->deterministic_ = deterministic_;
+  clone->seed_ = seed_;
+  clone->bvh_cache_dir_ = bvh_cache_dir_;
+  for (std::function<void(BulletWorld*)>& add : scene_) {
+    add(clone.get());
+  }
+  std::vector<double> state;
+  GetState(&state);
+  clone->SetState(state);
+  return clone;
+}
+
+long BulletWorld::SceneVersion() {
+  return scene_.size() + terrain_edits_;
 }
 
 void BulletWorld::UseOpenGL() {
+#ifdef BUCKSHOT_HEADLESS
+  std::cerr << "[BulletWorld] Built with BUCKSHOT_HEADLESS; "
+            << "there is no OpenGL GUI." << std::endl;
+#else
   use_opengl_ = true;
+  gui_world_ = this;
   Init();
+#endif
+}
+
+/*********************************************************************
+ *SNAPSHOTS
+ **********************************************************************/
+
+int BulletWorld::SaveState() {
+  unsigned int handle = 0;
+  while (handle < saved_states_.size() && !saved_states_[handle].empty()) {
+    handle++;
+  }
+  if (handle == saved_states_.size()) {
+    saved_states_.emplace_back();
+  }
+  GetState(&saved_states_[handle]);
+  return handle;
+}
+
+bool BulletWorld::RestoreState(int handle) {
+  if (handle < 0 || handle >= (int)saved_states_.size() ||
+      saved_states_[handle].empty()) {
+    return false;
+  }
+  if (!SetState(saved_states_[handle])) {
+    return false;
+  }
+  if (pose_map_) {
+    PublishPoses();
+  }
+  return true;
+}
+
+void BulletWorld::ReleaseState(int handle) {
+  if (handle >= 0 && handle < (int)saved_states_.size()) {
+    std::vector<double>().swap(saved_states_[handle]);
+  }
+}
+
+static inline void PushVector(const btVector3& v, std::vector<double>* state) {
+  state->push_back(v[0]);
+  state->push_back(v[1]);
+  state->push_back(v[2]);
+}
+
+static inline btVector3 PopVector(const double*& in) {
+  btVector3 v(in[0], in[1], in[2]);
+  in += 3;
+  return v;
+}
+
+static inline void PushTransform(const btTransform& transform,
+                                 std::vector<double>* state) {
+  PushVector(transform.getOrigin(), state);
+  for (int i = 0; i < 3; i++) {
+    PushVector(transform.getBasis()[i], state);
+  }
+}
+
+static inline btTransform PopTransform(const double*& in) {
+  btVector3 origin = PopVector(in);
+  btMatrix3x3 basis(in[0], in[1], in[2],
+                    in[3], in[4], in[5],
+                    in[6], in[7], in[8]);
+  in += 9;
+  return btTransform(basis, origin);
+}
+
+static void PushBody(btRigidBody* body, std::vector<double>* state) {
+  PushTransform(body->getCenterOfMassTransform(), state);
+  PushVector(body->getLinearVelocity(), state);
+  PushVector(body->getAngularVelocity(), state);
+}
+
+static void PopBody(btRigidBody* body, const double*& in,
+                    btDynamicsWorld* world) {
+  btTransform transform = PopTransform(in);
+  body->setCenterOfMassTransform(transform);
+  if (body->getMotionState()) {
+    body->getMotionState()->setWorldTransform(transform);
+  }
+  body->setLinearVelocity(PopVector(in));
+  body->setAngularVelocity(PopVector(in));
+  body->setInterpolationLinearVelocity(body->getLinearVelocity());
+  body->setInterpolationAngularVelocity(body->getAngularVelocity());
+  body->clearForces();
+  body->activate();
+  // Contacts cached from wherever the body was are stale now.
+  if (body->getBroadphaseHandle()) {
+    world->updateSingleAabb(body);
+    world->getBroadphase()->getOverlappingPairCache()->cleanProxyFromPairs(
+        body->getBroadphaseHandle(), world->getDispatcher());
+  }
+}
+
+static void PushWheel(const btWheelInfo& wheel, std::vector<double>* state) {
+  const btWheelInfo::RaycastInfo& ray = wheel.m_raycastInfo;
+  PushVector(ray.m_contactNormalWS, state);
+  PushVector(ray.m_contactPointWS, state);
+  PushVector(ray.m_hardPointWS, state);
+  PushVector(ray.m_wheelDirectionWS, state);
+  PushVector(ray.m_wheelAxleWS, state);
+  state->push_back(ray.m_suspensionLength);
+  state->push_back(ray.m_isInContact);
+  PushTransform(wheel.m_worldTransform, state);
+  state->push_back(wheel.m_steering);
+  state->push_back(wheel.m_rotation);
+  state->push_back(wheel.m_deltaRotation);
+  state->push_back(wheel.m_engineForce);
+  state->push_back(wheel.m_brake);
+  state->push_back(wheel.m_clippedInvContactDotSuspension);
+  state->push_back(wheel.m_suspensionRelativeVelocity);
+  state->push_back(wheel.m_wheelsSuspensionForce);
+  state->push_back(wheel.m_skidInfo);
+}
+
+static void PopWheel(btWheelInfo& wheel, const double*& in) {
+  btWheelInfo::RaycastInfo& ray = wheel.m_raycastInfo;
+  ray.m_contactNormalWS = PopVector(in);
+  ray.m_contactPointWS = PopVector(in);
+  ray.m_hardPointWS = PopVector(in);
+  ray.m_wheelDirectionWS = PopVector(in);
+  ray.m_wheelAxleWS = PopVector(in);
+  ray.m_suspensionLength = *in++;
+  ray.m_isInContact = *in++ != 0;
+  // Only meaningful within a step; the next raycast fills it back in.
+  ray.m_groundObject = NULL;
+  wheel.m_worldTransform = PopTransform(in);
+  wheel.m_steering = *in++;
+  wheel.m_rotation = *in++;
+  wheel.m_deltaRotation = *in++;
+  wheel.m_engineForce = *in++;
+  wheel.m_brake = *in++;
+  wheel.m_clippedInvContactDotSuspension = *in++;
+  wheel.m_suspensionRelativeVelocity = *in++;
+  wheel.m_wheelsSuspensionForce = *in++;
+  wheel.m_skidInfo = *in++;
+}
+
+// Shapes, then vehicles (chassis, then wheels), then constraints.
+void BulletWorld::GetState(std::vector<double>* state) {
+  state->clear();
+  for (std::unique_ptr<bullet_shape>& shape : shapes_) {
+    PushBody(shape->rigidBodyPtr(), state);
+  }
+  for (std::unique_ptr<bullet_vehicle>& vehicle : vehicles_) {
+    PushBody(vehicle->rigidBodyPtr(), state);
+    btRaycastVehicle* raycast = vehicle->vehiclePtr();
+    for (int i = 0; i < raycast->getNumWheels(); i++) {
+      PushWheel(raycast->getWheelInfo(i), state);
+    }
+  }
+  for (btTypedConstraint* constraint : constraints_) {
+    state->push_back(constraint->isEnabled());
+    state->push_back(constraint->getAppliedImpulse());
+    // CommandVehicle steers by moving the Hinge2 limits around.
+    btHinge2Constraint* hinge2 = dynamic_cast<btHinge2Constraint*>(constraint);
+    if (hinge2) {
+      btVector3 lower, upper;
+      hinge2->getAngularLowerLimit(lower);
+      hinge2->getAngularUpperLimit(upper);
+      PushVector(lower, state);
+      PushVector(upper, state);
+    }
+  }
+  state->push_back(clock_.Now());
+}
+
+// Sizes are fixed by the scene, so a mismatch means a different scene.
+static int StateSize(std::vector<std::unique_ptr<bullet_shape> >& shapes,
+                     std::vector<std::unique_ptr<bullet_vehicle> >& vehicles,
+                     std::vector<btTypedConstraint*>& constraints) {
+  const int body_size = 12 + 3 + 3;
+  const int wheel_size = 5 * 3 + 2 + 12 + 9;
+  int size = body_size * shapes.size();
+  for (std::unique_ptr<bullet_vehicle>& vehicle : vehicles) {
+    size += body_size + wheel_size * vehicle->vehiclePtr()->getNumWheels();
+  }
+  for (btTypedConstraint* constraint : constraints) {
+    size += 2;
+    if (dynamic_cast<btHinge2Constraint*>(constraint)) {
+      size += 6;
+    }
+  }
+  // The simulated time
+  return size + 1;
+}
+
+bool BulletWorld::SetState(const std::vector<double>& state) {
+  if ((int)state.size() != StateSize(shapes_, vehicles_, constraints_)) {
+    return false;
+  }
+  const double* in = state.data();
+  for (std::unique_ptr<bullet_shape>& shape : shapes_) {
+    PopBody(shape->rigidBodyPtr(), in, dynamics_world_.get());
+  }
+  for (std::unique_ptr<bullet_vehicle>& vehicle : vehicles_) {
+    PopBody(vehicle->rigidBodyPtr(), in, dynamics_world_.get());
+    btRaycastVehicle* raycast = vehicle->vehiclePtr();
+    for (int i = 0; i < raycast->getNumWheels(); i++) {
+      PopWheel(raycast->getWheelInfo(i), in);
+    }
+  }
+  for (btTypedConstraint* constraint : constraints_) {
+    constraint->setEnabled(*in++ != 0);
+    constraint->internalSetAppliedImpulse(*in++);
+    btHinge2Constraint* hinge2 = dynamic_cast<btHinge2Constraint*>(constraint);
+    if (hinge2) {
+      hinge2->setAngularLowerLimit(PopVector(in));
+      hinge2->setAngularUpperLimit(PopVector(in));
+    }
+  }
+  clock_.Set(*in++);
+  if (deterministic_) {
+    Canonicalize();
+  }
+  return true;
+}
+
+void BulletWorld::SetDeterministic(bool deterministic, unsigned long seed) {
+  deterministic_ = deterministic;
+  seed_ = seed;
+  if (deterministic_) {
+    Canonicalize();
+  }
+}
+
+bool BulletWorld::IsDeterministic() {
+  return deterministic_;
+}
+
+uint64_t BulletWorld::StateHash() {
+  GetState(&hash_state_);
+  return FnvHash(hash_state_.data(), sizeof(double) * hash_state_.size());
+}
+
+void BulletWorld::UpdateTiles() {
+  std::vector<std::pair<double, double> > positions;
+  for (std::unique_ptr<bullet_vehicle>& vehicle : vehicles_) {
+    const btVector3& origin =
+        vehicle->rigidBodyPtr()->getWorldTransform().getOrigin();
+    positions.push_back(std::make_pair(origin.x(), origin.y()));
+  }
+  tiled_terrain_->Update(positions);
+}
+
+// Bullet solves contacts in the order the broadphase found them, which
+// depends on how its tree and pair cache grew, not just on where the
+// bodies are. Re-adding everything in a fixed order (shapes, then
+// vehicles, by id, then anything else such as terrain tiles in world
+// order) to an emptied broadphase leaves nothing of that history behind,
+// including cached contacts and their warm-start impulses.
+void BulletWorld::Canonicalize() {
+  std::vector<btRigidBody*> order;
+  for (std::unique_ptr<bullet_shape>& shape : shapes_) {
+    order.push_back(shape->rigidBodyPtr());
+  }
+  for (std::unique_ptr<bullet_vehicle>& vehicle : vehicles_) {
+    order.push_back(vehicle->rigidBodyPtr());
+  }
+  // Which tiles are loaded depends only on where the vehicles are, but
+  // the order they came in depends on how they got there.
+  if (tiled_terrain_) {
+    UpdateTiles();
+    tiled_terrain_->GetBodies(&order);
+  }
+  std::unordered_set<btRigidBody*> ours(order.begin(), order.end());
+  btCollisionObjectArray& objects = dynamics_world_->getCollisionObjectArray();
+  for (int i = 0; i < objects.size(); i++) {
+    btRigidBody* body = btRigidBody::upcast(objects[i]);
+    if (body && !ours.count(body)) {
+      order.push_back(body);
+    }
+  }
+  struct Entry {
+    btRigidBody* body;
+    short group;
+    short mask;
+  };
+  std::vector<Entry> entries;
+  for (btRigidBody* body : order) {
+    btBroadphaseProxy* proxy = body->getBroadphaseHandle();
+    if (proxy) {
+      Entry entry = {body, proxy->m_collisionFilterGroup,
+                     proxy->m_collisionFilterMask};
+      entries.push_back(entry);
+    }
+  }
+  for (Entry& entry : entries) {
+    dynamics_world_->removeRigidBody(entry.body);
+  }
+  bt_broadphase_->resetPool(bt_dispatcher_.get());
+  bt_solver_->reset();
+  for (Entry& entry : entries) {
+    dynamics_world_->addRigidBody(entry.body, entry.group, entry.mask);
+  }
 }
 
 /*********************************************************************
@@ -62,29 +458,49 @@ void BulletWorld::UseOpenGL() {
 int BulletWorld::AddCube(double x_length, double y_length, double z_length,
                          double dMass, double dRestitution,
                          double* position, double* rotation) {
+  std::vector<double> pos(position, position + 3);
+  std::vector<double> rot(rotation, rotation + 9);
+  scene_.push_back([=](BulletWorld* world) mutable {
+      world->AddCube(x_length, y_length, z_length, dMass, dRestitution,
+                     pos.data(), rot.data());
+    });
   int id = shapes_.size();
   shapes_.emplace_back(new bullet_cube(x_length, y_length, z_length, dMass,
                                        dRestitution, position, rotation));
   dynamics_world_->addRigidBody(shapes_[id]->rigidBodyPtr());
+  PublishPoses();
   return id;
 }
 
 int BulletWorld::AddSphere(double radius, double dMass, double dRestitution,
                            double* position, double* rotation) {
+  std::vector<double> pos(position, position + 3);
+  std::vector<double> rot(rotation, rotation + 9);
+  scene_.push_back([=](BulletWorld* world) mutable {
+      world->AddSphere(radius, dMass, dRestitution, pos.data(), rot.data());
+    });
   int id = shapes_.size();
   shapes_.emplace_back(
       new bullet_sphere(radius, dMass, dRestitution, position, rotation));
   dynamics_world_->addRigidBody(shapes_[id]->rigidBodyPtr());
+  PublishPoses();
   return id;
 }
 
 int BulletWorld::AddCylinder(double radius, double height, double dMass,
                              double dRestitution, double* position,
                              double* rotation) {
+  std::vector<double> pos(position, position + 3);
+  std::vector<double> rot(rotation, rotation + 9);
+  scene_.push_back([=](BulletWorld* world) mutable {
+      world->AddCylinder(radius, height, dMass, dRestitution,
+                         pos.data(), rot.data());
+    });
   int id = shapes_.size();
   shapes_.emplace_back(new bullet_cylinder(radius, height, dMass, dRestitution,
                                            position, rotation));
   dynamics_world_->addRigidBody(shapes_[id]->rigidBodyPtr());
+  PublishPoses();
   return id;
 }
 
@@ -92,43 +508,364 @@ int BulletWorld::AddTerrain(int row_count, int col_count, double grad,
                             double min_ht, double max_ht,
                             double* X, double *Y, double* Z,
                             double* normal) {
+  return AddTerrain(new bullet_heightmap(row_count, col_count, grad,
+                                         min_ht, max_ht, X, Y, Z, normal,
+                                         bvh_cache_dir_));
+}
+
+int BulletWorld::AddTerrain(bullet_heightmap* terrain) {
+  // Rather than keep a copy of the grid, clones copy our terrain as it is
+  // when they're made, UpdateTerrainRegion edits and all.
   int id = shapes_.size();
-  shapes_.emplace_back(new bullet_heightmap (row_count, col_count, grad,
-                                             min_ht, max_ht, X, Y, Z, normal));
+  scene_.push_back([this, id](BulletWorld* world) {
+      world->AddTerrain(new bullet_heightmap(
+          *static_cast<bullet_heightmap*>(shapes_[id].get()),
+          world->bvh_cache_dir_));
+    });
+  shapes_.emplace_back(terrain);
+  dynamics_world_->addRigidBody(terrain->rigidBodyPtr());
+  PublishPoses();
+  return id;
+}
+
+bool BulletWorld::UpdateTerrainRegion(double id, int x0, int y0, int w,
+                                      int h, double* heights) {
+  if (id < 0 || id >= shapes_.size()) {
+    return false;
+  }
+  bullet_heightmap* terrain =
+      dynamic_cast<bullet_heightmap*>(shapes_[int(id)].get());
+  if (!terrain || !terrain->UpdateRegion(x0, y0, w, h, heights)) {
+    return false;
+  }
+  terrain_edits_++;
+  // Static bodies' AABBs aren't refreshed on their own.
+  dynamics_world_->updateSingleAabb(terrain->rigidBodyPtr());
+  return true;
+}
+
+void BulletWorld::SetBvhCacheDir(const std::string& dir) {
+  bvh_cache_dir_ = dir;
+}
+
+int BulletWorld::AddHeightfield(int row_count, int col_count,
+                                double* X, double* Y, double* Z,
+                                bool quantize) {
+  bullet_heightfield* field =
+      new bullet_heightfield(row_count, col_count, X, Y, Z, quantize);
+  return AddHeightfield(field);
+}
+
+int BulletWorld::AddHeightfield(bullet_heightfield* field) {
+  // Clones share the laid-out heights rather than keeping the meshgrid.
+  bullet_heightfield::Grid grid = field->grid();
+  scene_.push_back([=](BulletWorld* world) {
+      world->AddHeightfield(new bullet_heightfield(grid));
+    });
+  int id = shapes_.size();
+  shapes_.emplace_back(field);
+  dynamics_world_->addRigidBody(field->rigidBodyPtr());
+  PublishPoses();
+  return id;
+}
+
+bool BulletWorld::AddTiledTerrain(const std::string& path, int radius) {
+  std::unique_ptr<TiledTerrain> terrain(
+      new TiledTerrain(dynamics_world_.get(), radius));
+  if (!terrain->Open(path)) {
+    return false;
+  }
+  scene_.push_back([=](BulletWorld* world) {
+      world->AddTiledTerrain(path, radius);
+    });
+  tiled_terrain_ = std::move(terrain);
+  return true;
+}
+
+int BulletWorld::AddTerrainFromFile(const std::string& path) {
+  const size_t header_size = sizeof(double) * 9;
+  std::unique_ptr<MappedFile> file(new MappedFile);
+  if (!file->Open(path) || file->size() < header_size) {
+    return -1;
+  }
+  const double* header = reinterpret_cast<const double*>(file->data());
+  int width = header[0];
+  int length = header[1];
+  if (width < 2 || length < 2 || header[2] <= 0 ||
+      file->size() <
+          header_size + sizeof(short) * (size_t)width * length) {
+    return -1;
+  }
+  scene_.push_back([=](BulletWorld* world) {
+      world->AddTerrainFromFile(path);
+    });
+  const short* heights =
+      reinterpret_cast<const short*>(file->data() + header_size);
+  int id = shapes_.size();
+  shapes_.emplace_back(new bullet_heightfield(width, length, heights,
+                                              header[5], header[8],
+                                              header[6], header[7],
+                                              header[2], header[3],
+                                              header[4]));
   dynamics_world_->addRigidBody(shapes_[id]->rigidBodyPtr());
+  terrain_files_.push_back(std::move(file));
+  PublishPoses();
   return id;
 }
 
 int BulletWorld::AddCompound(double* Shape_ids, double* Con_ids,
                              const char* CompoundType) {
-  if (!std::strcmp(CompoundType, "Vehicle")) {
-    int id = compounds_.size();
-    compounds_.emplace_back(new Compound(Shape_ids, Con_ids, VEHICLE));
-    return id;
+  if (std::strcmp(CompoundType, "Vehicle")) {
+    return -1;
   }
-  return -1;
+  std::vector<double> shape_ids(Shape_ids,
+                                Shape_ids + Compound::kVehicleShapes);
+  std::vector<double> con_ids(Con_ids,
+                              Con_ids + Compound::kVehicleConstraints);
+  scene_.push_back([=](BulletWorld* world) mutable {
+      world->AddCompound(shape_ids.data(), con_ids.data(), "Vehicle");
+    });
+  int id = compounds_.size();
+  compounds_.emplace_back(new Compound(Shape_ids, Compound::kVehicleShapes,
+                                       Con_ids, Compound::kVehicleConstraints,
+                                       VEHICLE));
+  return id;
 }
 
 int BulletWorld::AddRaycastVehicle(double* parameters, double* position,
                                    double* rotation) {
+  std::vector<double> params(parameters,
+                             parameters + bullet_vehicle::NumParameters());
+  std::vector<double> pos(position, position + 3);
+  std::vector<double> rot(rotation, rotation + 9);
+  scene_.push_back([=](BulletWorld* world) mutable {
+      world->AddRaycastVehicle(params.data(), pos.data(), rot.data());
+    });
   int id = vehicles_.size();
   vehicles_.emplace_back(new bullet_vehicle (parameters, position, rotation,
                                              dynamics_world_.get()));
+  PublishPoses();
   return id;
 }
 
+int BulletWorld::AddFleet(int count, double* parameters, double* positions,
+                          double* rotations) {
+  std::vector<double> params(parameters,
+                             parameters + bullet_vehicle::NumParameters());
+  std::vector<double> pos(positions, positions + 3 * count);
+  std::vector<double> rot(rotations, rotations + 9 * count);
+  scene_.push_back([=](BulletWorld* world) mutable {
+      world->AddFleet(count, params.data(), pos.data(), rot.data());
+    });
+  if (!fleet_) {
+    fleet_.reset(new VehicleFleet(Raycasts()));
+    dynamics_world_->addAction(fleet_.get());
+  }
+  int first_id = vehicles_.size();
+  for (int k = 0; k < count; k++) {
+    vehicles_.emplace_back(new bullet_vehicle(
+        parameters, positions + 3 * k, rotations + 9 * k,
+        dynamics_world_.get(), fleet_->NewRaycaster(dynamics_world_.get()),
+        false));
+    fleet_->Add(vehicles_.back()->vehiclePtr());
+  }
+  PublishPoses();
+  return first_id;
+}
+
 /*********************************************************************
  *RUNNING THE SIMULATION
  **********************************************************************/
 
 void BulletWorld::StepSimulation() {
-  dynamics_world_->stepSimulation(timestep_,  max_sub_steps_);
+  profiler_.BeginStep();
+  if (tiled_terrain_) {
+    StepProfiler::Timer timer(&profiler_, StepProfiler::TERRAIN);
+    UpdateTiles();
+  }
+  if (!control_delays_.empty()) {
+    ApplyControlDelays();
+  }
+  if (deterministic_) {
+    // Whole fixed steps, so no leftover time carries between calls.
+    int steps = std::max(1, (int)std::ceil(timestep_ * kFixedStepRate -
+                                           1e-9));
+    double step = timestep_ / steps;
+    for (int i = 0; i < steps; i++) {
+      bt_solver_->setRandSeed(seed_);
+      dynamics_world_->stepSimulation(step, 1, step);
+    }
+  } else {
+    dynamics_world_->stepSimulation(timestep_,  max_sub_steps_);
+  }
+  clock_.Advance(timestep_);
+  if (!lidars_.empty()) {
+    StepProfiler::Timer timer(&profiler_, StepProfiler::SENSORS);
+    for (std::unique_ptr<LidarSensor>& lidar : lidars_) {
+      bullet_vehicle& vehicle = *vehicles_[lidar->vehicle_id()];
+      lidar->Scan(vehicle.rigidBodyPtr(), clock_.Now(), timestep_,
+                  Raycasts());
+    }
+  }
+  if (trace_ || pose_map_) {
+    StepProfiler::Timer timer(&profiler_, StepProfiler::POSE_EXPORT);
+    if (trace_) {
+      WriteTraceStep();
+    }
+    if (pose_map_) {
+      PublishPoses();
+    }
+  }
+  profiler_.EndStep();
+}
+
+int BulletWorld::NumRecordedPoses(int record_mask) {
+  int count = 0;
+  if (record_mask & RECORD_SHAPES) {
+    count += shapes_.size();
+  }
+  if (record_mask & RECORD_VEHICLES) {
+    for (std::unique_ptr<bullet_vehicle>& vehicle : vehicles_) {
+      count += 1 + vehicle->vehiclePtr()->getNumWheels();
+    }
+  }
+  return count;
+}
+
+// Writes a transform in the same order as GetShapeTransform, spacing
+// consecutive elements stride doubles apart.
+static inline void WritePose(const btTransform& transform, double* out,
+                             int stride) {
+  const btMatrix3x3& rotation = transform.getBasis();
+  const btVector3& position = transform.getOrigin();
+  out[0 * stride] = position[0];
+  out[1 * stride] = position[1];
+  out[2 * stride] = position[2];
+  out[3 * stride] = rotation[0][0];
+  out[4 * stride] = rotation[1][0];
+  out[5 * stride] = rotation[2][0];
+  out[6 * stride] = rotation[0][1];
+  out[7 * stride] = rotation[1][1];
+  out[8 * stride] = rotation[2][1];
+  out[9 * stride] = rotation[0][2];
+  out[10 * stride] = rotation[1][2];
+  out[11 * stride] = rotation[2][2];
+}
+
+void BulletWorld::WritePoses(int record_mask, double* out, int body_stride,
+                             int stride) {
+  if (record_mask & RECORD_SHAPES) {
+    for (std::unique_ptr<bullet_shape>& shape : shapes_) {
+      WritePose(shape->rigidBodyPtr()->getCenterOfMassTransform(),
+                out, stride);
+      out += body_stride;
+    }
+  }
+  if (record_mask & RECORD_VEHICLES) {
+    for (std::unique_ptr<bullet_vehicle>& vehicle : vehicles_) {
+      btRaycastVehicle* raycast = vehicle->vehiclePtr();
+      WritePose(raycast->getChassisWorldTransform(), out, stride);
+      out += body_stride;
+      for (int i = 0; i < raycast->getNumWheels(); i++) {
+        raycast->updateWheelTransform(i, false);
+        WritePose(raycast->getWheelTransformWS(i), out, stride);
+        out += body_stride;
+      }
+    }
+  }
+}
+
+void BulletWorld::StepSimulationN(int n, int record_mask, double* poses,
+                                  uint64_t* hashes) {
+  int num_poses = poses ? NumRecordedPoses(record_mask) : 0;
+  for (int step = 0; step < n; step++) {
+    StepSimulation();
+    if (num_poses) {
+      // Element (step, body, k) lives at step + n * (body + num_poses * k).
+      WritePoses(record_mask, poses + step, n, n * num_poses);
+    }
+    if (hashes) {
+      hashes[step] = StateHash();
+    }
+  }
+}
+
+RolloutEngine* BulletWorld::Rollouts() {
+  if (!rollouts_) {
+    rollouts_.reset(new RolloutEngine(this));
+  }
+  return rollouts_.get();
+}
+
+RaycastEngine* BulletWorld::Raycasts() {
+  if (!raycasts_) {
+    raycasts_.reset(new RaycastEngine(bt_broadphase_.get()));
+  }
+  return raycasts_.get();
+}
+
+void BulletWorld::RaycastBatch(int n, const double* origins,
+                               const double* directions, double* hits,
+                               double* normals, double* fractions,
+                               double* bodies) {
+  std::unordered_map<const btCollisionObject*, int> ids;
+  if (bodies) {
+    int index = 0;
+    for (std::unique_ptr<bullet_shape>& shape : shapes_) {
+      ids[shape->rigidBodyPtr()] = index++;
+    }
+    for (std::unique_ptr<bullet_vehicle>& vehicle : vehicles_) {
+      ids[vehicle->rigidBodyPtr()] = index;
+      index += 1 + vehicle->vehiclePtr()->getNumWheels();
+    }
+  }
+  Raycasts()->Cast(n, origins, directions, ids, hits, normals, fractions,
+                   bodies);
+}
+
+AsyncSimulation* BulletWorld::Async() {
+  if (!async_) {
+    async_.reset(new AsyncSimulation(this));
+  }
+  return async_.get();
+}
+
+bool BulletWorld::IsAsyncRunning() {
+  return async_ && async_->running();
+}
+
+bool BulletWorld::MapPoses(const std::string& path) {
+  std::unique_ptr<PoseMap> pose_map(new PoseMap);
+  if (!pose_map->Open(path, NumRecordedPoses(RECORD_ALL))) {
+    return false;
+  }
+  pose_map_ = std::move(pose_map);
+  PublishPoses();
+  return true;
+}
+
+void BulletWorld::UnmapPoses() {
+  pose_map_.reset();
+}
+
+void BulletWorld::PublishPoses() {
+  if (!pose_map_) {
+    return;
+  }
+  int num_poses = NumRecordedPoses(RECORD_ALL);
+  double* poses = pose_map_->BeginWrite(num_poses);
+  if (poses) {
+    GetAllTransforms(poses);
+    pose_map_->EndWrite();
+  }
 }
 
 void BulletWorld::StepGUI() {
+#ifndef BUCKSHOT_HEADLESS
   if (use_opengl_) {
     glutMainLoopEvent();
   }
+#endif
 }
 
 void BulletWorld::RunSimulation() {
@@ -152,9 +889,13 @@ void BulletWorld::RunSimulation() {
 
 void BulletWorld::CommandVehicle(double id, double steering_angle,
                                  double force) {
+  if (trace_) {
+    trace_->AddCommand(TraceCommand::COMPOUND_VEHICLE, id, steering_angle,
+                       force);
+  }
   std::unique_ptr<Compound>& Vehicle = compounds_[id];
-  double* Shape_ids = Vehicle->shapeid_;
-  double* Con_ids = Vehicle->constraintid_;
+  double* Shape_ids = Vehicle->shapeid_.data();
+  double* Con_ids = Vehicle->constraintid_.data();
   btHinge2Constraint* wheel_fl = static_cast<btHinge2Constraint*>(
       constraints_.at(int(Con_ids[0])));
   btHinge2Constraint* wheel_fr = static_cast<btHinge2Constraint*>(
@@ -175,22 +916,133 @@ void BulletWorld::CommandVehicle(double id, double steering_angle,
   wheel_br->rigidBodyPtr()->applyTorque(torque);
 }
 
+// Whether all n ids are whole numbers below count.
+static bool ValidIds(int n, const double* ids, size_t count) {
+  for (int i = 0; i < n; i++) {
+    if (!(ids[i] >= 0 && ids[i] < count) || ids[i] != std::floor(ids[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool BulletWorld::CommandVehicles(int n, const double* ids,
+                                  const double* steering,
+                                  const double* force) {
+  if (!ValidIds(n, ids, compounds_.size())) {
+    return false;
+  }
+  for (int i = 0; i < n; i++) {
+    CommandVehicle(ids[i], steering[i], force[i]);
+  }
+  return true;
+}
+
 /*********************************************************************
  *RAYCAST VEHICLE METHODS
  **********************************************************************/
 
+// Steers the front wheels and drives the back ones.
+static void ApplyCommand(btRaycastVehicle* vehicle, double steering_angle,
+                         double force) {
+  vehicle->setSteeringValue(steering_angle, 0);
+  vehicle->setSteeringValue(steering_angle, 1);
+  vehicle->applyEngineForce(force, 2);
+  vehicle->applyEngineForce(force, 3);
+}
+
 void BulletWorld::CommandRaycastVehicle(double id, double steering_angle,
                                         double force) {
-  btRaycastVehicle* Vehicle = vehicles_[id]->vehiclePtr();
-  Vehicle->setSteeringValue(steering_angle, 0);
-  Vehicle->setSteeringValue(steering_angle, 1);
-  Vehicle->applyEngineForce(force, 2);
-  Vehicle->applyEngineForce(force, 3);
+  if (trace_) {
+    trace_->AddCommand(TraceCommand::RAYCAST_VEHICLE, id, steering_angle,
+                       force);
+  }
+  if (id < control_delays_.size() && control_delays_[id]) {
+    // StepSimulation applies it once it's delay old.
+    control_delays_[id]->pending[0] = steering_angle;
+    control_delays_[id]->pending[1] = force;
+    return;
+  }
+  ApplyCommand(vehicles_[id]->vehiclePtr(), steering_angle, force);
+}
+
+bool BulletWorld::CommandRaycastVehicles(int n, const double* ids,
+                                         const double* steering,
+                                         const double* force) {
+  if (!ValidIds(n, ids, vehicles_.size())) {
+    return false;
+  }
+  for (int i = 0; i < n; i++) {
+    CommandRaycastVehicle(ids[i], steering[i], force[i]);
+  }
+  return true;
+}
+
+bool BulletWorld::SetControlDelay(double id, double delay) {
+  if (id < 0 || id >= vehicles_.size() || id != std::floor(id) ||
+      !(delay >= 0 && delay < (CommandRing<2>::kCapacity - 1) * timestep_)) {
+    return false;
+  }
+  scene_.push_back([=](BulletWorld* world) {
+      world->SetControlDelay(id, delay);
+    });
+  control_delays_.resize(vehicles_.size());
+  std::unique_ptr<ControlDelay>& control = control_delays_[id];
+  btRaycastVehicle* vehicle = vehicles_[id]->vehiclePtr();
+  if (delay == 0) {
+    if (control) {
+      ApplyCommand(vehicle, control->pending[0], control->pending[1]);
+      control.reset();
+    }
+    return true;
+  }
+  if (!control) {
+    control.reset(new ControlDelay);
+    control->pending[0] = vehicle->getSteeringValue(0);
+    control->pending[1] = vehicle->getWheelInfo(2).m_engineForce;
+  }
+  control->delay = delay;
+  control->Restart(timestep_);
+  return true;
+}
+
+void BulletWorld::ApplyControlDelays() {
+  for (size_t id = 0; id < control_delays_.size(); id++) {
+    ControlDelay* control = control_delays_[id].get();
+    if (!control) {
+      continue;
+    }
+    // The pending command holds until the clock next advances, and the
+    // vehicle gets whatever was pending delay before it.
+    control->history->Push(control->pending, timestep_);
+    btRaycastVehicle* vehicle = vehicles_[id]->vehiclePtr();
+    double command[2] = {vehicle->getSteeringValue(0),
+                         vehicle->getWheelInfo(2).m_engineForce};
+    control->history->Lookup(control->delay, control->delay + timestep_,
+                             command);
+    ApplyCommand(vehicle, command[0], command[1]);
+  }
+}
+
+void BulletWorld::CommandFleet(const double* steering, const double* force) {
+  if (!fleet_) {
+    return;
+  }
+  if (trace_) {
+    for (int i = 0; i < fleet_->size(); i++) {
+      trace_->AddCommand(TraceCommand::FLEET_VEHICLE, i, steering[i],
+                         force[i]);
+    }
+  }
+  fleet_->Command(steering, force);
+}
+
+int BulletWorld::FleetSize() {
+  return fleet_ ? fleet_->size() : 0;
 }
 
 // Holds the steering, engine force, and current velocity
-double* BulletWorld::GetRaycastMotionState(double id) {
-  double* pose = new double[9];
+void BulletWorld::GetRaycastMotionState(double id, double* pose) {
   btRaycastVehicle* Vehicle = vehicles_[id]->vehiclePtr();
   btRigidBody* VehicleBody = vehicles_[id]->rigidBodyPtr();
   pose[0] = Vehicle->getSteeringValue(0);
@@ -203,11 +1055,52 @@ double* BulletWorld::GetRaycastMotionState(double id) {
   pose[6] = VehicleBody->getAngularVelocity()[1];
   pose[7] = VehicleBody->getAngularVelocity()[2];
   pose[8] = OnTheGround(id);
-  return pose;
 }
 
-double* BulletWorld::RaycastToGround(double id, double x, double y) {
-  double* pose = new double[3];
+void BulletWorld::QueryGroundHeights(int n, const double* xy, double* z,
+                                     double* normals) {
+  std::vector<bullet_heightfield*> fields;
+  for (std::unique_ptr<bullet_shape>& shape : shapes_) {
+    if (bullet_heightfield* field =
+            dynamic_cast<bullet_heightfield*>(shape.get())) {
+      fields.push_back(field);
+    }
+  }
+  for (int i = 0; i < n; i++) {
+    double x = xy[2 * i], y = xy[2 * i + 1];
+    double* normal = normals ? normals + 3 * i : NULL;
+    bool found = tiled_terrain_ &&
+        tiled_terrain_->Sample(x, y, z + i, normal);
+    for (size_t f = 0; !found && f < fields.size(); f++) {
+      found = fields[f]->Sample(x, y, z + i, normal);
+    }
+    if (found) {
+      continue;
+    }
+    // Off every heightfield, so cast a ray. Only static bodies count as
+    // ground, so vehicles and loose shapes never get in the way.
+    btVector3 ray_start(x, y, 1e4);
+    btVector3 ray_end(x, y, -1e4);
+    btCollisionWorld::ClosestRayResultCallback ray_callback(ray_start,
+                                                            ray_end);
+    ray_callback.m_collisionFilterMask = btBroadphaseProxy::StaticFilter;
+    dynamics_world_->rayTest(ray_start, ray_end, ray_callback);
+    if (ray_callback.hasHit()) {
+      z[i] = ray_callback.m_hitPointWorld.z();
+      if (normal) {
+        normal[0] = ray_callback.m_hitNormalWorld.x();
+        normal[1] = ray_callback.m_hitNormalWorld.y();
+        normal[2] = ray_callback.m_hitNormalWorld.z();
+      }
+    } else {
+      z[i] = NAN;
+      if (normal) normal[0] = normal[1] = normal[2] = NAN;
+    }
+  }
+}
+
+void BulletWorld::RaycastToGround(double id, double x, double y,
+                                  double* pose) {
   btRaycastVehicle* Vehicle = vehicles_[id]->vehiclePtr();
   //  Move our vehicle out of the way...
   btVector3 point(x+50, y+50, -100);
@@ -265,7 +1158,6 @@ double* BulletWorld::RaycastToGround(double id, double x, double y) {
   pose[0] = VehiclePose[0];
   pose[1] = VehiclePose[1];
   pose[2] = VehiclePose[2];
-  return pose;
 }
 
 //  This just drops us off on the surface...
@@ -301,6 +1193,101 @@ void BulletWorld::ResetVehicle(double id, double* start_pose, double* start_rot)
   btTransform bullet_trans(rot, pose);
   //  Reset our car to its initial state.
   vehicles_[id]->rigidBodyPtr()->setCenterOfMassTransform(bullet_trans);
+  PublishPoses();
+}
+
+/*********************************************************************
+ *SENSORS
+ **********************************************************************/
+
+int BulletWorld::AddLidar(double id, double* position, double* rotation,
+                          double* parameters) {
+  if (id < 0 || id >= vehicles_.size()) {
+    return -1;
+  }
+  std::vector<double> pos(position, position + 3);
+  std::vector<double> rot(rotation, rotation + 9);
+  std::vector<double> params(parameters,
+                             parameters + LidarSensor::kNumParameters);
+  scene_.push_back([=](BulletWorld* world) mutable {
+      world->AddLidar(id, pos.data(), rot.data(), params.data());
+    });
+  int lidar_id = lidars_.size();
+  lidars_.emplace_back(new LidarSensor(id, position, rotation, parameters));
+  return lidar_id;
+}
+
+long BulletWorld::ReadLidar(double id, long since, std::vector<double>* out) {
+  if (id < 0 || id >= lidars_.size()) {
+    return -1;
+  }
+  return lidars_[id]->Read(since, out);
+}
+
+/*********************************************************************
+ *TRACES
+ **********************************************************************/
+
+bool BulletWorld::StartTrace(const std::string& path,
+                             int keyframe_interval) {
+  std::unique_ptr<TraceWriter> trace(new TraceWriter);
+  if (!trace->Open(path, timestep_, keyframe_interval)) {
+    return false;
+  }
+  trace_ = std::move(trace);
+  WriteTraceStep();
+  return true;
+}
+
+void BulletWorld::StopTrace() {
+  trace_.reset();
+}
+
+void BulletWorld::WriteTraceStep() {
+  int num_poses = NumRecordedPoses(RECORD_ALL);
+  trace_poses_.resize(12 * num_poses);
+  GetAllTransforms(trace_poses_.data());
+  trace_->WriteStep(clock_.Now(), num_poses, trace_poses_.data());
+}
+
+int BulletWorld::OpenTrace(const std::string& path) {
+  std::unique_ptr<TraceReader> reader(new TraceReader);
+  if (!reader->Open(path)) {
+    return -1;
+  }
+  unsigned int handle = 0;
+  while (handle < trace_readers_.size() && trace_readers_[handle]) {
+    handle++;
+  }
+  if (handle == trace_readers_.size()) {
+    trace_readers_.emplace_back();
+  }
+  trace_readers_[handle] = std::move(reader);
+  return handle;
+}
+
+int BulletWorld::TraceLength(int handle) {
+  if (handle < 0 || handle >= (int)trace_readers_.size() ||
+      !trace_readers_[handle]) {
+    return 0;
+  }
+  return trace_readers_[handle]->NumSteps();
+}
+
+bool BulletWorld::ReadTrace(int handle, int step, double* time,
+                            std::vector<double>* poses,
+                            std::vector<TraceCommand>* commands) {
+  if (handle < 0 || handle >= (int)trace_readers_.size() ||
+      !trace_readers_[handle]) {
+    return false;
+  }
+  return trace_readers_[handle]->ReadStep(step, time, poses, commands);
+}
+
+void BulletWorld::CloseTrace(int handle) {
+  if (handle >= 0 && handle < (int)trace_readers_.size()) {
+    trace_readers_[handle].reset();
+  }
 }
 
 /*********************************************************************
@@ -318,6 +1305,10 @@ inline int BulletWorld::AddConstraintToWorld(btTypedConstraint* constraint) {
 ///////
 // Point-to-Point
 int BulletWorld::PointToPoint_one(double id_A, double* pivot_in_A) {
+  std::vector<double> pivot(pivot_in_A, pivot_in_A + 3);
+  scene_.push_back([=](BulletWorld* world) mutable {
+      world->PointToPoint_one(id_A, pivot.data());
+    });
   std::unique_ptr<bullet_shape>& Shape_A = shapes_.at(id_A);
   btVector3 pivot_A(pivot_in_A[0], pivot_in_A[1], pivot_in_A[2]);
   btPoint2PointConstraint* constraint =
@@ -327,6 +1318,11 @@ int BulletWorld::PointToPoint_one(double id_A, double* pivot_in_A) {
 
 int BulletWorld::PointToPoint_two(double id_A, double id_B,
                                   double* pivot_in_A, double* pivot_in_B) {
+  std::vector<double> pivot_a(pivot_in_A, pivot_in_A + 3);
+  std::vector<double> pivot_b(pivot_in_B, pivot_in_B + 3);
+  scene_.push_back([=](BulletWorld* world) mutable {
+      world->PointToPoint_two(id_A, id_B, pivot_a.data(), pivot_b.data());
+    });
   std::unique_ptr<bullet_shape>& Shape_A = shapes_.at(id_A);
   std::unique_ptr<bullet_shape>& Shape_B = shapes_.at(id_B);
   btVector3 pivot_A(pivot_in_A[0], pivot_in_A[1], pivot_in_A[2]);
@@ -357,6 +1353,12 @@ int BulletWorld::Hinge_two_transform(double id_A, double id_B,
 
 int BulletWorld::Hinge_one_pivot(double id_A, double* pivot_in_A,
                                  double* axis_in_A, double* limits) {
+  std::vector<double> pivot(pivot_in_A, pivot_in_A + 3);
+  std::vector<double> axis(axis_in_A, axis_in_A + 3);
+  std::vector<double> lim(limits, limits + 5);
+  scene_.push_back([=](BulletWorld* world) mutable {
+      world->Hinge_one_pivot(id_A, pivot.data(), axis.data(), lim.data());
+    });
   std::unique_ptr<bullet_shape>& Shape_A = shapes_.at(id_A);
   btVector3 pivot_A(pivot_in_A[0], pivot_in_A[1], pivot_in_A[2]);
   btVector3 axis_A(axis_in_A[0], axis_in_A[1], axis_in_A[2]);
@@ -371,6 +1373,15 @@ int BulletWorld::Hinge_two_pivot(double id_A, double id_B,
                                  double* pivot_in_A, double* pivot_in_B,
                                  double* axis_in_A, double* axis_in_B,
                                  double* limits) {
+  std::vector<double> pivot_a(pivot_in_A, pivot_in_A + 3);
+  std::vector<double> pivot_b(pivot_in_B, pivot_in_B + 3);
+  std::vector<double> axis_a(axis_in_A, axis_in_A + 3);
+  std::vector<double> axis_b(axis_in_B, axis_in_B + 3);
+  std::vector<double> lim(limits, limits + 5);
+  scene_.push_back([=](BulletWorld* world) mutable {
+      world->Hinge_two_pivot(id_A, id_B, pivot_a.data(), pivot_b.data(),
+                             axis_a.data(), axis_b.data(), lim.data());
+    });
   std::unique_ptr<bullet_shape>& Shape_A = shapes_.at(id_A);
   std::unique_ptr<bullet_shape>& Shape_B = shapes_.at(id_B);
   btVector3 pivot_A(pivot_in_A[0], pivot_in_A[1], pivot_in_A[2]);
@@ -391,6 +1402,13 @@ int BulletWorld::Hinge_two_pivot(double id_A, double id_B,
 int BulletWorld::Hinge2(double id_A, double id_B, double* Anchor, double* Axis_1,
                         double* Axis_2, double damping, double stiffness,
                         double steering_angle) {
+  std::vector<double> anchor(Anchor, Anchor + 3);
+  std::vector<double> axis_1(Axis_1, Axis_1 + 3);
+  std::vector<double> axis_2(Axis_2, Axis_2 + 3);
+  scene_.push_back([=](BulletWorld* world) mutable {
+      world->Hinge2(id_A, id_B, anchor.data(), axis_1.data(), axis_2.data(),
+                    damping, stiffness, steering_angle);
+    });
   std::unique_ptr<bullet_shape>& Shape_A = shapes_.at(id_A);
   std::unique_ptr<bullet_shape>& Shape_B = shapes_.at(id_B);
   btVector3 btAnchor(Anchor[0], Anchor[1], Anchor[2]);
@@ -415,6 +1433,11 @@ int BulletWorld::Hinge2(double id_A, double id_B, double* Anchor, double* Axis_1
 //// TODO: DEBUG CONSTRAINT
 /////////
 int BulletWorld::SixDOF_one(double id_A, double* transform_A, double* limits) {
+  std::vector<double> transform(transform_A, transform_A + 7);
+  std::vector<double> lim(limits, limits + 12);
+  scene_.push_back([=](BulletWorld* world) mutable {
+      world->SixDOF_one(id_A, transform.data(), lim.data());
+    });
   std::unique_ptr<bullet_shape>& Shape_A = shapes_.at(id_A);
   btQuaternion quat_A(transform_A[3], transform_A[4],
                       transform_A[5], transform_A[6]);
@@ -439,34 +1462,23 @@ int BulletWorld::SixDOF_one(double id_A, double* transform_A, double* limits) {
  *GETTERS FOR OBJECT POSES
  **********************************************************************/
 
-std::vector<double> BulletWorld::GetShapeTransform(double id) {
-  // Returns:
+void BulletWorld::GetShapeTransform(double id, double* pose) {
+  // Writes:
   // 1. The positon of the object in the world
   // 2. The rotation matrix that's used in motion.
   int n_id = (int)id;
   std::unique_ptr<bullet_shape>& entity = shapes_.at(n_id);
-  btTransform world_transform =
-      entity->rigidBodyPtr()->getCenterOfMassTransform();
-  btMatrix3x3 rotation = world_transform.getBasis();
-  btVector3 position = world_transform.getOrigin();
-  double pose[] = {
-    position[0], position[1], position[2],
-    rotation[0][0], rotation[1][0], rotation[2][0],
-    rotation[0][1], rotation[1][1], rotation[2][1],
-    rotation[0][2], rotation[1][2], rotation[2][2]
-  };
-  std::vector<double> vecpose (pose, pose + sizeof(pose) / sizeof(double));
-  return vecpose;
+  WritePose(entity->rigidBodyPtr()->getCenterOfMassTransform(), pose, 1);
 }
 
-std::vector<double> BulletWorld::GetConstraintTransform(double id) {
+void BulletWorld::GetConstraintTransform(double id, double* pose) {
   int n_id = (int)id;
   btHinge2Constraint* constraint =
       static_cast<btHinge2Constraint*>(constraints_.at(n_id));
   btVector3 position = constraint->getAnchor();
-  double pose[] = { position[0], position[1], position[2] };
-  std::vector<double> vecpose (pose, pose + sizeof(pose) / sizeof(double));
-  return vecpose;
+  pose[0] = position[0];
+  pose[1] = position[1];
+  pose[2] = position[2];
 }
 
 //////////
@@ -492,26 +1504,16 @@ std::vector< btTransform > BulletWorld::GetVehiclePoses(bullet_vehicle& Vehicle)
   return VehiclePoses;
 }
 
-double* BulletWorld::GetVehicleTransform(double id) {
+void BulletWorld::GetVehicleTransform(double id, double* pose) {
   int n_id = (int)id;
-  std::unique_ptr<bullet_vehicle>& Vehicle = vehicles_.at(n_id);
-  std::vector<btTransform> Transforms = GetVehiclePoses(*Vehicle);
-  double* pose = new double[12*5];
-  for (unsigned int i = 0; i<5; i++) {
-    btMatrix3x3 rotation = Transforms.at(i).getBasis();
-    btVector3 position = Transforms.at(i).getOrigin();
-    pose[i*12+0] = position[0];
-    pose[i*12+1] = position[1];
-    pose[i*12+2] = position[2];
-    pose[i*12+3] =  rotation[0][0];
-    pose[i*12+4] =  rotation[1][0];
-    pose[i*12+5] =  rotation[2][0];
-    pose[i*12+6] =  rotation[0][1];
-    pose[i*12+7] =  rotation[1][1];
-    pose[i*12+8] =  rotation[2][1];
-    pose[i*12+9] =  rotation[0][2];
-    pose[i*12+10] = rotation[1][2];
-    pose[i*12+11] = rotation[2][2];
-  }
-  return pose;
+  btRaycastVehicle* raycast = vehicles_.at(n_id)->vehiclePtr();
+  WritePose(raycast->getChassisWorldTransform(), pose, 1);
+  for (int i = 0; i < raycast->getNumWheels(); i++) {
+    raycast->updateWheelTransform(i, false);
+    WritePose(raycast->getWheelTransformWS(i), pose + 12 * (i + 1), 1);
+  }
+}
+
+void BulletWorld::GetAllTransforms(double* out) {
+  WritePoses(RECORD_ALL, out, 12, 1);
 }
@@ -18,7 +18,14 @@
 #define TWOPI 6.28318530718
 
 #include "Compound.h"
+#include "commandRing.h"
+#include "simClock.h"
+#include "stepProfiler.h"
+#ifndef BUCKSHOT_HEADLESS
 #include "../Graphics/graphicsWorld.h"
+#endif
+#include <cstdint>
+#include <functional>
 #include <map>
 #include <vector>
 #include <memory>
@@ -31,13 +38,26 @@
 /// The Simulator class holds all of the methods that can be called from
 /// bullet_interface_mex.cpp. Any method called from there MUST be in this
 /// class.
-
-static std::vector<std::unique_ptr<Compound> > compounds_;
-static std::vector<std::unique_ptr<bullet_shape> > shapes_;
-static std::vector<std::unique_ptr<bullet_vehicle> > vehicles_;
-static std::vector<btTypedConstraint*> constraints_;
-
+/// Every BulletWorld owns its own objects, so any number of worlds can live
+/// side by side in one process. Only the OpenGL window is shared: it draws
+/// whichever world last called UseOpenGL().
+
+class BulletWorld;
+class RolloutEngine;
+class PoseMap;
+class AsyncSimulation;
+class TiledTerrain;
+class MappedFile;
+class RaycastEngine;
+class LidarSensor;
+class VehicleFleet;
+class TraceWriter;
+class TraceReader;
+struct TraceCommand;
+
+#ifndef BUCKSHOT_HEADLESS
 /// OPENGL STUFF
+static BulletWorld* gui_world_ = NULL;
 static int window;
 static float view_angle_ = 0;
 static float view_elevation_ = 3;
@@ -52,6 +72,7 @@ static int shader_program_[MODE] = {0, 0};
 static int mode = 0;
 const float CrystalDensity=5.0;
 const float CrystalSize=.15;
+#endif  // BUCKSHOT_HEADLESS
 
 /// Key accessors to BulletWorld
 static bool is_running_ = false;
@@ -70,6 +91,41 @@ class BulletWorld {
   void Reset();
   void UseOpenGL();
 
+  // Builds a new headless world holding the same scene as this one, with
+  // every body and vehicle in its current state.
+  std::unique_ptr<BulletWorld> Clone();
+  // Counts the objects added and terrain edits made so far; lets clones
+  // notice the scene changed.
+  long SceneVersion();
+
+  /*********************************************************************
+   *SNAPSHOTS
+   *A snapshot holds every body's transform and velocities, each raycast
+   *vehicle's wheel state, each constraint's state and the simulated time,
+   *packed into one flat buffer. Restoring one rewinds the world to exactly
+   *that point.
+   **********************************************************************/
+
+  // Stores the current state and returns a handle to it.
+  int SaveState();
+  // Rewinds to a saved state; the handle stays valid for reuse.
+  bool RestoreState(int handle);
+  void ReleaseState(int handle);
+  // The same, for callers that manage the buffers themselves. A state can
+  // be applied to any world holding the same scene, e.g. a Clone().
+  void GetState(std::vector<double>* state);
+  bool SetState(const std::vector<double>& state);
+
+  // Deterministic mode, for replaying runs bit for bit. Every
+  // StepSimulation takes the same whole fixed steps with the solver
+  // reseeded before each, and SetState, RestoreState and Reset rebuild the
+  // broadphase with the bodies in id order, so the same state and commands
+  // give identical results here, in clones and in rollouts.
+  void SetDeterministic(bool deterministic, unsigned long seed);
+  bool IsDeterministic();
+  // A hash of GetState(); worlds in the same state hash the same.
+  uint64_t StateHash();
+
   /*********************************************************************
    *ADDING OBJECTS
    **********************************************************************/
@@ -84,12 +140,49 @@ class BulletWorld {
                  double min_ht, double max_ht,
                  double* X, double *Y, double* Z,
                  double* normal);
-
+  // Replaces a w x h block of an AddTerrain mesh's heights, starting at
+  // grid index (x0, y0), refitting only that part of its BVH. heights is
+  // column-major like Z. Returns false if id isn't a mesh terrain or the
+  // block doesn't fit.
+  bool UpdateTerrainRegion(double id, int x0, int y0, int w, int h,
+                           double* heights);
+  // Caches the BVHs of AddTerrain meshes in dir (see bvhCache.h), so
+  // loading the same map again skips building them. Empty turns it off.
+  // Defaults to $BUCKSHOT_BVH_CACHE.
+  void SetBvhCacheDir(const std::string& dir);
+  // The same grid as a btHeightfieldTerrainShape, which keeps only the
+  // heights: as floats, or quantized to int16 if quantize is set.
+  int AddHeightfield(int row_count, int col_count,
+                     double* X, double* Y, double* Z, bool quantize);
+  // A map paged in from a tile file (see tiledTerrain.h): each step keeps
+  // the tiles within radius tiles of every raycast vehicle in the world.
+  // Tiles aren't shapes, so they get no ids and aren't in poses or
+  // snapshots. Returns false if the file can't be mapped.
+  bool AddTiledTerrain(const std::string& path, int radius);
+  // A heightfield mapped from a terrain file, which Bullet reads in place.
+  // The file is 9 doubles:
+  //   width, length, spacing, origin_x, origin_y, scale, min_ht, max_ht,
+  //   offset
+  // then width * length int16 heights, sample (x, y) at y * width + x, of
+  // height offset + scale * value at origin + (x, y) * spacing. Returns -1
+  // if the file can't be mapped. See WriteTerrainFile.m.
+  int AddTerrainFromFile(const std::string& path);
+
+  // Only "Vehicle" compounds exist: Compound::kVehicleShapes shape ids
+  // (body, then wheels) and kVehicleConstraints constraint ids, both
+  // copied. Returns -1 for any other type.
   int AddCompound(double* Shape_ids, double* Con_ids,
                   const char* CompoundType);
 
   int AddRaycastVehicle(double* parameters, double* position,
                         double* rotation);
+  // count raycast vehicles that share parameters and are stepped together
+  // by one VehicleFleet (see vehicleFleet.h), their suspension rays cast
+  // as one parallel batch. positions holds 3 and rotations 9 doubles per
+  // vehicle. They're ordinary raycast vehicles otherwise, with consecutive
+  // ids starting at the one returned.
+  int AddFleet(int count, double* parameters, double* positions,
+               double* rotations);
 
   /*********************************************************************
    *RUNNING THE SIMULATION
@@ -97,27 +190,149 @@ class BulletWorld {
 
   void StepSimulation();
   void StepGUI();
+  // Simulated time, advanced a timestep by every StepSimulation. Delay
+  // models and sensors read this rather than the wall clock.
+  const SimClock& clock() {
+    return clock_;
+  }
+  double SimTime() {
+    return clock_.Now();
+  }
+  // How long each phase of StepSimulation has taken; see stepProfiler.h.
+  StepProfiler& profiler() {
+    return profiler_;
+  }
   void RunSimulation();
 
+  // Which bodies StepSimulationN records. Poses are ordered shapes first (by
+  // id), then each raycast vehicle as its chassis followed by its wheels.
+  enum RecordMask {
+    RECORD_NONE = 0,
+    RECORD_SHAPES = 1,
+    RECORD_VEHICLES = 2,
+    RECORD_ALL = RECORD_SHAPES | RECORD_VEHICLES
+  };
+  int NumRecordedPoses(int record_mask);
+  // Steps n times without returning to the caller. If poses is non-null it
+  // must hold n * NumRecordedPoses(record_mask) * 12 doubles, and is filled
+  // as a column-major N x bodies x 12 array (the layout MATLAB expects).
+  // If hashes is non-null it gets the StateHash after each step.
+  void StepSimulationN(int n, int record_mask, double* poses,
+                       uint64_t* hashes = NULL);
+  // Writes every pose selected by record_mask. Consecutive bodies start
+  // body_stride doubles apart and consecutive pose elements stride apart.
+  void WritePoses(int record_mask, double* out, int body_stride, int stride);
+
+  // The parallel rollout engine for this world; see rolloutEngine.h.
+  RolloutEngine* Rollouts();
+
+  // The parallel raycaster for this world; see raycastEngine.h.
+  RaycastEngine* Raycasts();
+  // Casts n rays in parallel; see RaycastEngine::Cast for the layout.
+  // Bodies are identified by their index in GetAllTransforms order, so a
+  // vehicle's chassis is the pose before its wheels.
+  void RaycastBatch(int n, const double* origins, const double* directions,
+                    double* hits, double* normals, double* fractions,
+                    double* bodies);
+
+  // Shares every pose through a memory-mapped file at path (see poseMap.h),
+  // republished after each StepSimulation, RestoreState, Reset and
+  // ResetVehicle and after adding bodies, so readers never have to call
+  // back in. Returns false if the file can't be mapped.
+  bool MapPoses(const std::string& path);
+  void UnmapPoses();
+  void PublishPoses();
+
+  // The background stepping thread for this world; see asyncSimulation.h.
+  AsyncSimulation* Async();
+  bool IsAsyncRunning();
+
   /*********************************************************************
    *COMPOUND METHODS
    **********************************************************************/
 
   void CommandVehicle(double id, double steering_angle, double force);
+  // n CommandVehicle calls in one, command i going to compound ids[i].
+  // Returns false, applying none of them, if any id isn't a compound.
+  bool CommandVehicles(int n, const double* ids, const double* steering,
+                       const double* force);
 
   /*********************************************************************
    *RAYCAST VEHICLE METHODS
    **********************************************************************/
+  int NumRaycastVehicles() {
+    return vehicles_.size();
+  }
   void CommandRaycastVehicle(double id, double steering_angle, double force);
-  // Holds the steering, engine force, and current velocity
-  double* GetRaycastMotionState(double id);
-
-  double* RaycastToGround(double id, double x, double y);
+  // n CommandRaycastVehicle calls in one, command i going to ids[i].
+  // Returns false, applying none of them, if any id isn't a vehicle.
+  bool CommandRaycastVehicles(int n, const double* ids,
+                              const double* steering, const double* force);
+  // Holds CommandRaycastVehicle's commands to vehicle id (though not
+  // CommandFleet's) back by delay simulated seconds: each step applies
+  // what was commanded delay ago, blended between the steps around it.
+  // Setting the delay and Reset start the history over, as though the
+  // last command had always held, and the history isn't part of
+  // SaveState. 0 applies commands straight away again. The delay must be
+  // under CommandRing::kCapacity - 1 timesteps. False for a bad id or
+  // delay.
+  bool SetControlDelay(double id, double delay);
+  // One steering angle and force per fleet vehicle, in the order AddFleet
+  // added them.
+  void CommandFleet(const double* steering, const double* force);
+  int FleetSize();
+  // Writes 9 doubles: steering, engine force, linear velocity, angular
+  // velocity and whether we're on the ground.
+  void GetRaycastMotionState(double id, double* state);
+  // Drops the vehicle onto the ground below (x, y) and writes its new
+  // position (3 doubles).
+  void RaycastToGround(double id, double x, double y, double* position);
+  // The ground under each of n points without moving or stepping anything:
+  // xy holds (x, y) pairs, z gets n heights and normals (if non-null) 3n
+  // doubles. Heightfields are sampled directly; anything else static is
+  // raycast. Points with no ground under them get NaN.
+  void QueryGroundHeights(int n, const double* xy, double* z,
+                          double* normals);
   //  This just drops us off on the surface...
   int OnTheGround(double id);
   void SetVehicleVels(double id, double* lin_vel, double* ang_vel);
   void ResetVehicle(double id, double* start_pose, double* start_rot);
 
+  /*********************************************************************
+   *SENSORS
+   **********************************************************************/
+  // Mounts a spinning lidar on raycast vehicle id, placed by position and
+  // rotation in the chassis frame, that scans after every StepSimulation.
+  // See lidarSensor.h for the parameters and point layout.
+  int AddLidar(double id, double* position, double* rotation,
+               double* parameters);
+  // Fills out with the lidar's points written since cursor since
+  // (LidarSensor::kPointSize doubles each) and returns the next cursor,
+  // or -1 if there's no such lidar.
+  long ReadLidar(double id, long since, std::vector<double>* out);
+
+  /*********************************************************************
+   *TRACES
+   *A trace logs every step's commands and poses to an append-only file
+   *as the world runs, and can be read back at any step without
+   *re-simulating. See traceFile.h for the format.
+   **********************************************************************/
+  // Starts a trace at path, its first record being the world as it is
+  // now. Every keyframe_interval-th step is stored whole. Returns false if
+  // the file can't be written.
+  bool StartTrace(const std::string& path, int keyframe_interval);
+  void StopTrace();
+  // Opens a trace for reading and returns a handle to it, or -1.
+  int OpenTrace(const std::string& path);
+  // How many steps the trace held when it was opened
+  int TraceLength(int handle);
+  // Reads step (0 being where the trace started): its simulated time, its
+  // poses in GetAllTransforms order and the commands sent just before it.
+  bool ReadTrace(int handle, int step, double* time,
+                 std::vector<double>* poses,
+                 std::vector<TraceCommand>* commands);
+  void CloseTrace(int handle);
+
   /*********************************************************************
    *CONSTRAINT METHODS
    *All of the constructors for our constraints.
@@ -145,10 +360,31 @@ class BulletWorld {
    *GETTERS FOR OBJECT POSES
    **********************************************************************/
 
-  std::vector<double> GetShapeTransform(double id);
-  std::vector<double> GetConstraintTransform(double id);
+  // All of these write into a caller-owned buffer. A pose is 12 doubles:
+  // the position followed by the rotation matrix, column-major.
+  void GetShapeTransform(double id, double* pose);
+  // The hinge2 anchor (3 doubles)
+  void GetConstraintTransform(double id, double* position);
   std::vector< btTransform > GetVehiclePoses(bullet_vehicle& Vehicle);
-  double* GetVehicleTransform(double id);
+  // The chassis pose followed by one per wheel (12 * 5 doubles for our
+  // four-wheeled vehicles).
+  void GetVehicleTransform(double id, double* pose);
+  // Every body in one pass, in StepSimulationN's order: pose i occupies
+  // out[12 * i] to out[12 * i + 11]. out must hold
+  // 12 * NumRecordedPoses(RECORD_ALL) doubles.
+  void GetAllTransforms(double* out);
+
+  /*********************************************************************
+   *ACCESSORS FOR THE GUI
+   **********************************************************************/
+
+  std::vector<std::unique_ptr<bullet_shape> >& shapes() {
+    return shapes_;
+  }
+
+  std::vector<btTypedConstraint*>& constraints() {
+    return constraints_;
+  }
 
  private:
 
@@ -157,6 +393,12 @@ class BulletWorld {
   double gravity_;
   int max_sub_steps_;
   bool use_opengl_;
+  std::string bvh_cache_dir_;
+  SimClock clock_;
+  // Before dynamics_world_, which reports to it
+  StepProfiler profiler_;
+  bool deterministic_;
+  unsigned long seed_;
   btDefaultCollisionConfiguration  collision_configuration_;
   std::unique_ptr<btCollisionDispatcher> bt_dispatcher_;
   std::unique_ptr<btDbvtBroadphase> bt_broadphase_;
@@ -164,8 +406,60 @@ class BulletWorld {
 
   // Physics and Graphics worlds
   std::shared_ptr<btDiscreteDynamicsWorld> dynamics_world_;
+
+  // Everything we've added to this world, indexed by the ids we hand out.
+  // Terrain files that shapes read from, so they have to outlive shapes_.
+  std::vector<std::unique_ptr<MappedFile> > terrain_files_;
+  std::vector<std::unique_ptr<Compound> > compounds_;
+  std::vector<std::unique_ptr<bullet_shape> > shapes_;
+  std::vector<std::unique_ptr<bullet_vehicle> > vehicles_;
+  std::vector<btTypedConstraint*> constraints_;
+  std::vector<std::unique_ptr<LidarSensor> > lidars_;
+  // SetControlDelay's command histories, indexed by vehicle id. Vehicles
+  // without a delay are empty.
+  struct ControlDelay;
+  std::vector<std::unique_ptr<ControlDelay> > control_delays_;
+
+  // Each Add call records how to repeat itself here, so Clone() can rebuild
+  // the scene in another world.
+  std::vector<std::function<void(BulletWorld*)> > scene_;
+  // UpdateTerrainRegion calls, which clones pick up by copying the mesh
+  long terrain_edits_;
+  std::unique_ptr<RolloutEngine> rollouts_;
+  std::unique_ptr<RaycastEngine> raycasts_;
+  std::unique_ptr<VehicleFleet> fleet_;
+  std::unique_ptr<PoseMap> pose_map_;
+  std::unique_ptr<AsyncSimulation> async_;
+  std::unique_ptr<TiledTerrain> tiled_terrain_;
+  std::unique_ptr<TraceWriter> trace_;
+  // The trace's GetAllTransforms buffer, kept to avoid reallocating
+  std::vector<double> trace_poses_;
+  // OpenTrace() readers, indexed by handle. Closed slots are empty.
+  std::vector<std::unique_ptr<TraceReader> > trace_readers_;
+
+  // SaveState() buffers, indexed by handle. Released slots are empty.
+  std::vector<std::vector<double> > saved_states_;
+  // StateHash's GetState buffer, kept to avoid reallocating every step
+  std::vector<double> hash_state_;
+
+  // Add a shape we've built, and record how a clone builds its own.
+  int AddTerrain(bullet_heightmap* terrain);
+  int AddHeightfield(bullet_heightfield* field);
+
+  // Pages terrain tiles in and out around the raycast vehicles.
+  void UpdateTiles();
+  // Applies each delayed vehicle's command from delay ago.
+  void ApplyControlDelays();
+  // Takes every body out of the broadphase and puts it back in id order,
+  // terrain tiles by tile number after the vehicles.
+  void Canonicalize();
+  // Appends the current poses, and the commands since the last step, to
+  // the trace.
+  void WriteTraceStep();
 };
 
+#ifndef BUCKSHOT_HEADLESS
+
 /////////////////////////
 // OPENGL STUFF
 /////////////////////////
@@ -229,7 +523,7 @@ inline void gwDisplay(){
 
   /////////
   // DRAWING OUR SHAPES
-  for (std::unique_ptr<bullet_shape>& currentShape: shapes_) {
+  for (std::unique_ptr<bullet_shape>& currentShape: gui_world_->shapes()) {
     btTransform world_transform =
         currentShape->rigidBodyPtr()->getCenterOfMassTransform();
     btMatrix3x3 rotation = world_transform.getBasis();
@@ -248,7 +542,7 @@ inline void gwDisplay(){
   }
 
   if (is_drawing_constraints_) {
-    for (btTypedConstraint* cons: constraints_) {
+    for (btTypedConstraint* cons: gui_world_->constraints()) {
       // TODO(bminortx): investigate this. Have to cast down for now...
       btHinge2Constraint* constraint =
         static_cast<btHinge2Constraint*>(cons);
@@ -372,3 +666,5 @@ inline void Init() {
   shader_program_[1] = CreateShaderProg("bulletComponents/Graphics/crystal.vert",
                                         "bulletComponents/Graphics/crystal.frag");
 }
+
+#endif  // BUCKSHOT_HEADLESS
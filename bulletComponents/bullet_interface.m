@@ -8,6 +8,8 @@ classdef bullet_interface < handle
     
     properties (SetAccess = public)
         buckshotAccessor; % Handle to the underlying C++ class instance
+        ops; % buckshot opcodes, so hot calls skip the name lookup
+        PoseMap; % memmapfile over the shared pose file, if MapPoses was called
         %These are arrays that hold the different objects we have created.
         Terrain;
         Shapes;
@@ -24,6 +26,7 @@ classdef bullet_interface < handle
         
         function this = bullet_interface(varargin)
             this.buckshotAccessor = buckshot('new', varargin{:});
+            this.ops = buckshot('opcodes');
             
             this.Terrain = [];
             this.gui.opengl = false;         % bool to use OpenGL
@@ -55,6 +58,39 @@ classdef bullet_interface < handle
             this.UpdatePoses();
         end
         
+        %%%% Snapshots every body, vehicle wheel and constraint. Pass
+        %%%% the handle to RestoreState to rewind to this point, as
+        %%%% many times as needed, and to ReleaseState when done.
+        function handle = SaveState(this)
+            handle = buckshot('SaveState', this.buckshotAccessor);
+        end
+        
+        function RestoreState(this, handle)
+            buckshot('RestoreState', this.buckshotAccessor, handle);
+            this.UpdatePoses();
+        end
+        
+        function ReleaseState(this, handle)
+            buckshot('ReleaseState', this.buckshotAccessor, handle);
+        end
+        
+        %%%% Deterministic mode: fixed internal steps, a seeded solver
+        %%%% and a canonical body order after every restore, so the
+        %%%% same state and commands replay bit for bit, in rollouts
+        %%%% too. Compare runs with StateHash.
+        function SetDeterministic(this, on, seed)
+            if nargin < 3,
+                seed = 0;
+            end
+            buckshot(this.ops.SetDeterministic, this.buckshotAccessor, ...
+                     on, seed);
+        end
+        
+        %%%% A uint64 hash of the whole world's state.
+        function hash = StateHash(this)
+            hash = buckshot(this.ops.StateHash, this.buckshotAccessor);
+        end
+        
         %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
         %%%% ADDING OBJECTS
         
@@ -111,8 +147,56 @@ classdef bullet_interface < handle
         
         %%%%%%%%%%%%%
         
-        function AddTerrain(this, Terrain)
-        %Adds a randomly-generated terrain to the bullet environment
+        function UpdateTerrainRegion(this, row, col, heights)
+        %Replaces the terrain heights from Z(row, col) on with the block
+        %heights, e.g. to dig ruts. Only works on 'mesh' terrains.
+            buckshot(this.ops.UpdateTerrainRegion, this.buckshotAccessor, ...
+                     this.Terrain.GetID(), row, col, heights);
+        end
+
+        %%%%%%%%%%%%%
+
+        function [z, normals] = QueryGroundHeights(this, xy)
+        %Ground heights (and normals, 3 x N) under the points in the
+        %2 x N matrix xy. Nothing moves and the world isn't stepped, so
+        %this is safe to call as often as a planner likes.
+            if nargout > 1,
+                [z, normals] = buckshot(this.ops.QueryGroundHeights, ...
+                                        this.buckshotAccessor, xy);
+            else
+                z = buckshot(this.ops.QueryGroundHeights, ...
+                             this.buckshotAccessor, xy);
+            end
+        end
+
+        %%%%%%%%%%%%%
+
+        function [hits, normals, fractions, bodies] = RaycastBatch(this, origins, directions)
+        %Casts the rays from each column of origins (3 x N) to
+        %origins + directions in parallel. bodies holds the index of the
+        %body each ray hit in GetAllTransforms order, or -1.
+            [hits, normals, fractions, bodies] = ...
+                buckshot(this.ops.RaycastBatch, this.buckshotAccessor, ...
+                         origins, directions);
+        end
+
+        %%%%%%%%%%%%%
+
+        function SetBvhCache(this, dir)
+        %Caches the BVH of mesh terrains in dir, so adding the same
+        %terrain again (even in a later session) skips building it.
+            buckshot('SetBvhCache', this.buckshotAccessor, dir);
+        end
+
+        %%%%%%%%%%%%%
+
+        function AddTerrain(this, Terrain, format)
+        %Adds a randomly-generated terrain to the bullet environment.
+        %format is 'mesh' (the default) for a triangle mesh, or 'float'
+        %or 'int16' for a much lighter heightfield of just the heights.
+            if nargin < 3,
+                format = 'mesh';
+            end
             if numel(this.Terrain) > 0,
                 disp('We already have a terrain. Delete the class to create a new one.');
                 return;
@@ -125,12 +209,38 @@ classdef bullet_interface < handle
             max_ht = extrema(3, 2);
             sze = size(heightmap{1});
             normal = Terrain.GetNormal();
-            id = buckshot('AddTerrain', ...
-                          this.buckshotAccessor, sze(1), sze(2), grad, min_ht, max_ht, heightmap{1}, ...
-                          heightmap{2}, heightmap{3}, normal);
+            if strcmp(format, 'mesh'),
+                id = buckshot('AddTerrain', ...
+                              this.buckshotAccessor, sze(1), sze(2), grad, min_ht, max_ht, heightmap{1}, ...
+                              heightmap{2}, heightmap{3}, normal);
+            else
+                id = buckshot('AddHeightfield', this.buckshotAccessor, ...
+                              sze(1), sze(2), heightmap{1}, heightmap{2}, ...
+                              heightmap{3}, strcmp(format, 'int16'));
+            end
             this.Terrain.SetID(id);
         end
 
+        %%%%%%%%%%%%%
+
+        function AddTiledTerrain(this, path, radius)
+        %Streams a map written by WriteTerrainTiles. Only the tiles within
+        %radius tiles of a raycast vehicle are kept in the world (default 1,
+        %a 3x3 block around each vehicle).
+            if nargin < 3,
+                radius = 1;
+            end
+            buckshot('AddTiledTerrain', this.buckshotAccessor, path, radius);
+        end
+
+        %%%%%%%%%%%%%
+
+        function id = AddTerrainFromFile(this, path)
+        %Loads a terrain written by WriteTerrainFile. The heights are mapped
+        %straight from the file, so nothing is sent through MEX.
+            id = buckshot('AddTerrainFromFile', this.buckshotAccessor, path);
+        end
+
         %%%%%%%%%%%%%
         
         function AddRaycastVehicles( this, RayVehicles  )
@@ -146,6 +256,82 @@ classdef bullet_interface < handle
                 RayVehicles{i}.SetID(id);
             end
         end
+
+        %%%%%%%%%%%%%
+
+        function ids = AddFleet(this, RayVehicle, positions, rotations)
+        %Adds a vehicle like RayVehicle at each column of positions (3 x N)
+        %and rotations (9 x N), all stepped together as one fleet and
+        %driven with CommandFleet.
+            first = buckshot('AddFleet', this.buckshotAccessor, ...
+                             RayVehicle.GetParameters(), positions, rotations);
+            ids = first + (0:size(positions, 2) - 1);
+        end
+
+        function CommandFleet(this, steering, force)
+        %One steering angle and force per fleet vehicle, in AddFleet order.
+            buckshot(this.ops.CommandFleet, this.buckshotAccessor, ...
+                     steering, force);
+        end
+
+        %%%%%%%%%%%%%
+
+        function id = AddLidar(this, RayVehicle, position, rotation, parameters)
+        %Mounts a spinning lidar on RayVehicle at position/rotation in its
+        %chassis frame. parameters are [channels, min_elevation,
+        %max_elevation, columns_per_revolution, spin_rate, max_range,
+        %capacity]; see lidarSensor.h. It scans after every step.
+            id = buckshot('AddLidar', this.buckshotAccessor, ...
+                          RayVehicle.GetID(), position, rotation, parameters);
+        end
+
+        function [points, cursor] = ReadLidar(this, id, cursor)
+        %The 5 x N points (x, y, z, range, time) the lidar has seen since
+        %the cursor from the last call (0, or leave it out, the first time).
+            if nargin < 3,
+                cursor = 0;
+            end
+            [points, cursor] = buckshot(this.ops.ReadLidar, ...
+                                        this.buckshotAccessor, id, cursor);
+        end
+        
+        %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
+        %%%% TRACES
+        %%%% A trace logs every step's commands and poses to a file as
+        %%%% the simulation runs. OpenTrace and ReadTrace read any step
+        %%%% of one back without re-simulating or keeping the run in
+        %%%% MATLAB.
+        
+        function StartTrace(this, path, keyframe_interval)
+            if nargin < 3,
+                keyframe_interval = 100;
+            end
+            buckshot(this.ops.StartTrace, this.buckshotAccessor, path, ...
+                     keyframe_interval);
+        end
+        
+        function StopTrace(this)
+            buckshot(this.ops.StopTrace, this.buckshotAccessor);
+        end
+        
+        function [handle, steps] = OpenTrace(this, path)
+            [handle, steps] = buckshot(this.ops.OpenTrace, ...
+                                       this.buckshotAccessor, path);
+        end
+        
+        function [poses, commands, time] = ReadTrace(this, handle, step)
+        %Step 0 is where the trace started. poses is 12 x bodies in
+        %GetAllTransforms order; commands is 4 x N [kind; id; steering;
+        %force], kind being 0 for compounds, 1 for raycast vehicles and
+        %2 for fleet vehicles.
+            [poses, commands, time] = buckshot(this.ops.ReadTrace, ...
+                                               this.buckshotAccessor, ...
+                                               handle, step);
+        end
+        
+        function CloseTrace(this, handle)
+            buckshot(this.ops.CloseTrace, this.buckshotAccessor, handle);
+        end
         
         %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
         %%%% ADDING CONSTRAINTS
@@ -263,6 +449,13 @@ classdef bullet_interface < handle
             end
         end
         
+        function CommandCompounds(this, ids, steering, force)
+        %Commands many compound vehicles at once: compound ids(i) gets
+        %steering(i) and force(i).
+            buckshot(this.ops.CommandCompounds_Vehicle, this.buckshotAccessor, ...
+                     ids, steering, force);
+        end
+        
         %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
         %%%% RAYCAST VEHICLE METHODS
         
@@ -270,16 +463,30 @@ classdef bullet_interface < handle
             if this.gui.run,
                 command = Vehicle.PushCommand();
                 id = Vehicle.GetID();
-                buckshot('CommandRaycastVehicle', this.buckshotAccessor, ...
+                buckshot(this.ops.CommandRaycastVehicle, this.buckshotAccessor, ...
                          id, command.steering, command.force);
             end
         end
         
+        function CommandRaycastVehicles(this, ids, steering, force)
+        %Commands many raycast vehicles at once: vehicle ids(i) gets
+        %steering(i) and force(i).
+            buckshot(this.ops.CommandRaycastVehicles, this.buckshotAccessor, ...
+                     ids, steering, force);
+        end
+        
+        function SetControlDelay(this, RayVehicle, delay)
+        %Makes RayVehicle's commands take effect delay simulated seconds
+        %after they're given, blended between steps. 0 removes the delay.
+            buckshot(this.ops.SetControlDelay, this.buckshotAccessor, ...
+                     RayVehicle.GetID(), delay);
+        end
+        
         % Used in StepSimulation
         function [steering, force, lin_vel, ang_vel] = GetMotionState(this, Vehicle)
             id = Vehicle.GetID();
             [steering, force, lin_vel, ang_vel] = ...
-                buckshot('GetMotionState', this.buckshotAccessor, id);
+                buckshot(this.ops.GetMotionState, this.buckshotAccessor, id);
         end
         
         function SetToGround(this, Vehicle, x_coord, y_coord)
@@ -301,6 +508,21 @@ classdef bullet_interface < handle
                                  wheel_br_pos, wheel_br_rot);
         end
 
+        %%%% Simulates every column of steering/force as a separate
+        %%%% rollout of Vehicle from the current state, in parallel.
+        %%%% poses is rollouts x 12 ([position, rotation(:)']) and costs
+        %%%% holds each rollout's squared distance to goal.
+        function [poses, costs] = RunRollouts(this, Vehicle, steering, force, goal)
+            id = Vehicle.GetID();
+            if nargin < 5,
+                [poses, costs] = buckshot('RunRollouts', this.buckshotAccessor, ...
+                                          id, steering, force);
+            else
+                [poses, costs] = buckshot('RunRollouts', this.buckshotAccessor, ...
+                                          id, steering, force, goal);
+            end
+        end
+
         function ResetVehicle(this, Vehicle, start_pose, start_rot)
             id = Vehicle.GetID();
             buckshot('ResetVehicle', this.buckshotAccessor, id, start_pose, start_rot);
@@ -360,13 +582,13 @@ classdef bullet_interface < handle
         
         function UpdatePoses(this)
             for i = 1:numel(this.Shapes),
-                [position, rotation] = buckshot('GetTransform', ...
+                [position, rotation] = buckshot(this.ops.GetTransform_Shape, ...
                                                 this.buckshotAccessor, 'Shape', this.Shapes{i}.GetID());
                 this.Shapes{i}.SetTransform(position, rotation);
             end
             for i = 1:numel(this.Constraints),
                 if strcmp(this.Constraints{i}.GetType(), 'Hinge2')==true,
-                    [position] = buckshot('GetTransform', ...
+                    [position] = buckshot(this.ops.GetTransform_Constraint, ...
                                           this.buckshotAccessor, 'Constraint', this.Constraints{i}.GetID());
                     this.Constraints{i}.SetPosition(position);
                 end
@@ -384,7 +606,7 @@ classdef bullet_interface < handle
                      wheel_fl_pos, wheel_fl_rot,...
                      wheel_fr_pos, wheel_fr_rot,...
                      wheel_bl_pos, wheel_bl_rot,...
-                     wheel_br_pos, wheel_br_rot] = buckshot('GetTransform', ...
+                     wheel_br_pos, wheel_br_rot] = buckshot(this.ops.GetTransform_RaycastVehicle, ...
                                                             this.buckshotAccessor, ...
                                                             'RaycastVehicle', ...
                                                             this.RayVehicles{i}.GetID());
@@ -403,13 +625,24 @@ classdef bullet_interface < handle
         end
         
         function StepSimulation(this)
-            for i = 1:numel(this.RayVehicles),
-                if this.RayVehicles{i}.NoMoreCommands(false) == false,
-                    BuckshotSim ...
-                        .CommandRaycastVehicle(RayVehicles{i});
+            % Every vehicle's next command goes over in one call.
+            if this.gui.run,
+                ids = [];
+                steering = [];
+                force = [];
+                for i = 1:numel(this.RayVehicles),
+                    if this.RayVehicles{i}.NoMoreCommands(false) == false,
+                        command = this.RayVehicles{i}.PushCommand();
+                        ids(end+1) = this.RayVehicles{i}.GetID();
+                        steering(end+1) = command.steering;
+                        force(end+1) = command.force;
+                    end
+                end
+                if ~isempty(ids),
+                    this.CommandRaycastVehicles(ids, steering, force);
                 end
             end
-            buckshot('StepSimulation', this.buckshotAccessor);
+            buckshot(this.ops.StepSimulation, this.buckshotAccessor);
             this.UpdatePoses();
             if ~this.gui.opengl,
                 this.gui.c2 = clock;
@@ -424,6 +657,141 @@ classdef bullet_interface < handle
             end
         end
         
+        %%%% Steps the simulation n times in a single MEX call.
+        %%%% record_mask picks the bodies to record (1: shapes, 2:
+        %%%% raycast vehicles, 3: both). poses is N x bodies x 12, each
+        %%%% row holding [position, rotation(:)'] in the GetTransform
+        %%%% order: shapes by id, then each vehicle's body and wheels.
+        %%%% hashes, if asked for, holds the StateHash after each step.
+        function [poses, hashes] = StepSimulationN(this, n, record_mask)
+            if nargin < 3,
+                record_mask = 3;
+            end
+            if nargout > 1,
+                [poses, hashes] = buckshot(this.ops.StepSimulationN, ...
+                                           this.buckshotAccessor, n, ...
+                                           record_mask);
+            else
+                poses = buckshot(this.ops.StepSimulationN, ...
+                                 this.buckshotAccessor, n, record_mask);
+            end
+        end
+        
+        %%%% The simulated seconds stepped so far. Control delays and
+        %%%% sensor timestamps run on this, not the wall clock.
+        function t = SimTime(this)
+            t = buckshot(this.ops.GetSimTime, this.buckshotAccessor);
+        end
+        
+        %%%% Per-phase step timings: a struct per phase (terrain,
+        %%%% broadphase, narrowphase, solver, actions, sensors,
+        %%%% pose_export and the whole step) with count, total, mean
+        %%%% and max seconds per step, and a histogram whose element i
+        %%%% counts steps taking [2^(i-1), 2^i) nanoseconds.
+        function profile = GetProfile(this)
+            profile = buckshot(this.ops.GetProfile, this.buckshotAccessor);
+        end
+        
+        function ResetProfile(this)
+            buckshot(this.ops.ResetProfile, this.buckshotAccessor);
+        end
+        
+        %%%% Reads every pose in one call. Column i is [position;
+        %%%% rotation(:)] for body i, in StepSimulationN's order.
+        function poses = GetAllTransforms(this)
+            poses = buckshot(this.ops.GetAllTransforms, this.buckshotAccessor);
+        end
+        
+        %%%% Has Bullet publish every pose to the file at path after
+        %%%% each step, and whenever bodies are added or reset. ReadPoses
+        %%%% then reads them from shared memory without calling into
+        %%%% buckshot at all.
+        function MapPoses(this, path)
+            buckshot(this.ops.MapPoses, this.buckshotAccessor, path);
+            this.PoseMap = [];
+            this.PoseMap.path = path;
+            this.PoseMap.capacity = -1;
+        end
+        
+        function UnmapPoses(this)
+            buckshot(this.ops.UnmapPoses, this.buckshotAccessor);
+            this.PoseMap = [];
+        end
+        
+        %%%% The same 12 x bodies array as GetAllTransforms, read from
+        %%%% the file set up by MapPoses. frame counts the publishes.
+        function [poses, frame] = ReadPoses(this)
+            % Writes take microseconds, so if we keep losing the race
+            % the writer has died mid-write.
+            for attempt = 1:10000,
+                % The file grows when bodies are added; map it again.
+                header = this.PoseMapHeader();
+                if header(4) ~= this.PoseMap.capacity,
+                    this.PoseMap.capacity = header(4);
+                    this.PoseMap.file = memmapfile(this.PoseMap.path, ...
+                        'Format', {'double', [1 4], 'header'; ...
+                                   'double', [12 header(4)], 'poses'}, ...
+                        'Repeat', 1);
+                end
+                % Odd or changed sequence numbers mean a write raced us.
+                sequence = this.PoseMap.file.Data.header(1);
+                if mod(sequence, 2) == 0,
+                    header = this.PoseMap.file.Data.header;
+                    poses = this.PoseMap.file.Data.poses(:, 1:header(3));
+                    if this.PoseMap.file.Data.header(1) == sequence,
+                        frame = header(2);
+                        return;
+                    end
+                end
+            end
+            error('ReadPoses: The pose file never settled; is its writer stuck mid-write?');
+        end
+        
+        %%%% Steps in the background at rate_hz (or flat out without
+        %%%% one) so a controller can run alongside the physics. Until
+        %%%% StopAsync, talk to the world only through PushCommand and
+        %%%% ReadAsyncPoses.
+        function StartAsync(this, rate_hz)
+            if nargin < 2,
+                rate_hz = 0;
+            end
+            buckshot(this.ops.StartAsync, this.buckshotAccessor, rate_hz);
+        end
+        
+        function StopAsync(this)
+            buckshot(this.ops.StopAsync, this.buckshotAccessor);
+        end
+        
+        %%%% Queues a command that's applied right before the next
+        %%%% background step.
+        function PushCommand(this, Vehicle, steering, force)
+            buckshot(this.ops.PushCommand, this.buckshotAccessor, ...
+                     Vehicle.GetID(), steering, force);
+        end
+        
+        %%%% PushCommand for vectors of vehicle ids, steering and force.
+        function PushCommands(this, ids, steering, force)
+            buckshot(this.ops.PushCommands, this.buckshotAccessor, ...
+                     ids, steering, force);
+        end
+        
+        %%%% The latest 12 x bodies poses (as in GetAllTransforms) and
+        %%%% the background step they were taken after.
+        function [poses, frame] = ReadAsyncPoses(this)
+            [poses, frame] = buckshot(this.ops.ReadAsyncPoses, ...
+                                      this.buckshotAccessor);
+        end
+        
+        function header = PoseMapHeader(this)
+            if this.PoseMap.capacity < 0,
+                m = memmapfile(this.PoseMap.path, 'Format', ...
+                               {'double', [1 4], 'header'}, 'Repeat', 1);
+                header = m.Data.header;
+            else
+                header = this.PoseMap.file.Data.header;
+            end
+        end
+        
         %%%% Draws all of our objects.
         function DrawSimulation(this)            
             if ~this.gui.opengl, 
@@ -457,7 +825,7 @@ classdef bullet_interface < handle
                     delete(h_rayvehicles);
                 end
             else
-                buckshot('StepGUI', this.buckshotAccessor);                
+                buckshot(this.ops.StepGUI, this.buckshotAccessor);                
             end
         end
 
@@ -469,7 +837,7 @@ classdef bullet_interface < handle
                 this.gui.opengl = true;
                 buckshot('useOpenGL', this.buckshotAccessor);
                 while(1)
-                    buckshot('RunSimulation', this.buckshotAccessor);
+                    buckshot(this.ops.RunSimulation, this.buckshotAccessor);
                 end
             end
             this.InitSimulation();
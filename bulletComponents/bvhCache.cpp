@@ -0,0 +1,69 @@
+#include "bvhCache.h"
+#include "fnvHash.h"
+#include <bullet/btBulletDynamicsCommon.h>
+#include <bullet/BulletCollision/CollisionShapes/btBvhTriangleMeshShape.h>
+#include <bullet/BulletCollision/CollisionShapes/btOptimizedBvh.h>
+#include <bullet/LinearMath/btAlignedAllocator.h>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+
+void* BvhCache::Attach(btBvhTriangleMeshShape* mesh, const std::string& dir,
+                       uint64_t key) {
+  // The layout depends on btScalar, so float and double builds never share.
+  size_t scalar_size = sizeof(btScalar);
+  char name[64];
+  uint64_t hash = FnvHash(&scalar_size, sizeof(scalar_size), key);
+  std::snprintf(name, sizeof(name), "/%016llx.bvh", (unsigned long long)hash);
+  std::string path = dir + name;
+
+  if (FILE* file = std::fopen(path.c_str(), "rb")) {
+    std::fseek(file, 0, SEEK_END);
+    long size = std::ftell(file);
+    std::fseek(file, 0, SEEK_SET);
+    // deSerializeInPlace points the tree into the buffer, so it has to be
+    // 16-byte aligned and stay alive as long as the mesh does.
+    void* buffer = size > 0 ? btAlignedAlloc(size, 16) : NULL;
+    bool read = buffer && std::fread(buffer, 1, size, file) == (size_t)size;
+    std::fclose(file);
+    btOptimizedBvh* bvh = read ?
+        btOptimizedBvh::deSerializeInPlace(buffer, size, false) : NULL;
+    if (bvh) {
+      mesh->setOptimizedBvh(bvh);
+      return buffer;
+    }
+    // Truncated or from another Bullet; build and overwrite it below.
+    btAlignedFree(buffer);
+  }
+
+  mesh->buildOptimizedBvh();
+  btOptimizedBvh* bvh = mesh->getOptimizedBvh();
+  unsigned size = bvh->calculateSerializeBufferSize();
+  void* buffer = btAlignedAlloc(size, 16);
+  if (bvh->serializeInPlace(buffer, size, false)) {
+    // Write then rename, so a concurrent run never reads half a file. The
+    // temp file is unique, since clones in one process may write too.
+    std::vector<char> temp(path.begin(), path.end());
+    const char suffix[] = ".XXXXXX";
+    temp.insert(temp.end(), suffix, suffix + sizeof(suffix));
+    int fd = mkstemp(temp.data());
+    FILE* file = fd < 0 ? NULL : fdopen(fd, "wb");
+    if (file) {
+      // mkstemp makes it private; the cache is for everyone.
+      fchmod(fd, 0644);
+      bool written = std::fwrite(buffer, 1, size, file) == size;
+      if (std::fclose(file) == 0 && written) {
+        std::rename(temp.data(), path.c_str());
+      } else {
+        std::remove(temp.data());
+      }
+    } else if (fd >= 0) {
+      close(fd);
+      std::remove(temp.data());
+    }
+  }
+  btAlignedFree(buffer);
+  return NULL;
+}
@@ -0,0 +1,23 @@
+/**
+ * BvhCache: an on-disk cache of triangle mesh BVHs. Building the quantized
+ * BVH dominates loading a big mesh terrain, and it only depends on the
+ * mesh, so we serialize it once into a directory, named by a hash of the
+ * vertices and indices, and map it back in on later runs.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+class btBvhTriangleMeshShape;
+
+class BvhCache {
+ public:
+  // Gives mesh (built with buildBvh = false) its BVH: read from dir if a
+  // mesh with this key was seen before, otherwise built and saved there.
+  // Returns the buffer a cached BVH lives in, which has to outlive mesh
+  // and be freed with btAlignedFree, or NULL if the BVH was built.
+  static void* Attach(btBvhTriangleMeshShape* mesh, const std::string& dir,
+                      uint64_t key);
+};
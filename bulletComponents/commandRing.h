@@ -0,0 +1,184 @@
+/**
+ * CommandRing: the last kCapacity commands pushed, each N doubles held for
+ * some duration, searchable by how long ago they were in effect. Each
+ * command is stamped with its start time (the total duration of everything
+ * pushed before it). Those stamps only grow, so the command in effect some
+ * delay ago is a binary search away, and nothing is allocated after
+ * construction.
+ *
+ * Exactly one thread may Push while one other calls Lookup. Every slot is
+ * a seqlock: Push makes its sequence odd, rewrites it and makes it even
+ * again, and Lookup starts over if any slot it read changed under it.
+ * Neither side ever waits on the other, and since everything in a slot is
+ * atomic, a torn read is retried rather than being a data race.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+template <int N>
+class CommandRing {
+ public:
+  static const long kCapacity = 1024;
+
+  CommandRing() : slots_(new Slot[kCapacity]), pushed_(0), end_time_(0) {
+  }
+
+  // Producer side: values are held for duration from the end of the last
+  // command pushed.
+  void Push(const double* values, double duration) {
+    long n = pushed_.load(std::memory_order_relaxed);
+    Slot& slot = slots_[n % kCapacity];
+    unsigned long sequence = slot.sequence.load(std::memory_order_relaxed);
+    slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.index.store(n, std::memory_order_relaxed);
+    for (int i = 0; i < N; i++) {
+      slot.values[i].store(values[i], std::memory_order_relaxed);
+    }
+    slot.start_time.store(end_time_, std::memory_order_relaxed);
+    end_time_ += duration;
+    slot.end_time.store(end_time_, std::memory_order_relaxed);
+    slot.sequence.store(sequence + 2, std::memory_order_release);
+    pushed_.store(n + 1, std::memory_order_release);
+  }
+
+  // Consumer side: what was commanded delay ago, interpolated between the
+  // two commands around it, looking back only over the recent commands
+  // that the last max_history seconds fall in. Leaves values alone if the
+  // history doesn't reach back that far, and returns false if it's empty.
+  bool Lookup(double delay, double max_history, double* values) {
+    while (true) {
+      long pushed = pushed_.load(std::memory_order_acquire);
+      if (pushed == 0) {
+        return false;
+      }
+      if (TryLookup(pushed, delay, max_history, values)) {
+        return true;
+      }
+    }
+  }
+
+ private:
+  struct Slot {
+    Slot() : sequence(0), index(-1), start_time(0), end_time(0) {
+      for (int i = 0; i < N; i++) {
+        values[i].store(0, std::memory_order_relaxed);
+      }
+    }
+
+    // Odd while Push is rewriting the slot
+    std::atomic<unsigned long> sequence;
+    // Which command the slot holds
+    std::atomic<long> index;
+    std::atomic<double> values[N];
+    std::atomic<double> start_time;
+    std::atomic<double> end_time;
+  };
+
+  // A consistent copy of one command
+  struct Entry {
+    double values[N];
+    double start_time;
+    double end_time;
+  };
+
+  // Absorbs rounding in the start times, so a delay landing exactly on a
+  // command boundary picks that command.
+  static constexpr double kTimeEpsilon = 1e-12;
+
+  // Copies command index into *entry. False if Push has since reused its
+  // slot.
+  bool Read(long index, Entry* entry) {
+    const Slot& slot = slots_[index % kCapacity];
+    while (true) {
+      unsigned long before = slot.sequence.load(std::memory_order_acquire);
+      long held = slot.index.load(std::memory_order_relaxed);
+      for (int i = 0; i < N; i++) {
+        entry->values[i] = slot.values[i].load(std::memory_order_relaxed);
+      }
+      entry->start_time = slot.start_time.load(std::memory_order_relaxed);
+      entry->end_time = slot.end_time.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (before % 2 == 0 &&
+          slot.sequence.load(std::memory_order_relaxed) == before) {
+        return held == index;
+      }
+    }
+  }
+
+  // Sets *result to the last index in [lo, hi] whose command started at or
+  // before time, or lo - 1 if there's none. False if a slot was reused.
+  bool LastStartingBefore(long lo, long hi, double time, long* result) {
+    *result = lo - 1;
+    while (lo <= hi) {
+      long mid = lo + (hi - lo) / 2;
+      Entry entry;
+      if (!Read(mid, &entry)) {
+        return false;
+      }
+      if (entry.start_time <= time) {
+        *result = mid;
+        lo = mid + 1;
+      } else {
+        hi = mid - 1;
+      }
+    }
+    return true;
+  }
+
+  // Lookup over the first pushed commands. False if Push lapped us.
+  bool TryLookup(long pushed, double delay, double max_history,
+                 double* values) {
+    long oldest = std::max(0L, pushed - kCapacity);
+    long newest = pushed - 1;
+    Entry last;
+    if (!Read(newest, &last)) {
+      return false;
+    }
+    // The history starts at the last command already going max_history
+    // before the newest one ends, so the window covers all of it...
+    long first;
+    if (!LastStartingBefore(oldest, newest,
+                            last.end_time - max_history - kTimeEpsilon,
+                            &first)) {
+      return false;
+    }
+    first = std::max(first, oldest);
+    if (first == newest) {
+      std::copy(last.values, last.values + N, values);
+      return true;
+    }
+    // ...then find the last command that started at least delay before
+    // the newest one, and blend it with the one after it.
+    long k;
+    if (!LastStartingBefore(first, newest - 1,
+                            last.start_time - delay + kTimeEpsilon, &k)) {
+      return false;
+    }
+    if (k < first) {
+      return true;
+    }
+    Entry older, newer;
+    if (!Read(k, &older) || !Read(k + 1, &newer)) {
+      return false;
+    }
+    // A command held for no time contributes nothing to the blend.
+    double span = older.end_time - older.start_time;
+    double r2 = span > 0 ?
+        (delay - (last.start_time - newer.start_time)) / span : 0;
+    double r1 = 1 - r2;
+    for (int i = 0; i < N; i++) {
+      values[i] = r1 * newer.values[i] + r2 * older.values[i];
+    }
+    return true;
+  }
+
+  std::unique_ptr<Slot[]> slots_;
+  std::atomic<long> pushed_;
+  // When the last command pushed ends; only Push touches it.
+  double end_time_;
+};
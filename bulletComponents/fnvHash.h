@@ -0,0 +1,19 @@
+/**
+ * FnvHash: 64-bit FNV-1a, a cheap byte hash for cache keys and state
+ * comparisons (not for anything adversarial). Hashing a second buffer
+ * with the first one's result as the seed hashes them as one.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+inline uint64_t FnvHash(const void* data, size_t bytes,
+                        uint64_t hash = 14695981039346656037ULL) {
+  const unsigned char* p = static_cast<const unsigned char*>(data);
+  for (size_t i = 0; i < bytes; i++) {
+    hash = (hash ^ p[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
@@ -0,0 +1,98 @@
+#include "lidarSensor.h"
+#include "raycastEngine.h"
+#include <algorithm>
+#include <cmath>
+
+LidarSensor::LidarSensor(int vehicle_id, double* position, double* rotation,
+                         double* parameters) :
+  vehicle_id_(vehicle_id), column_(0), written_(0)
+{
+  btMatrix3x3 rot(rotation[0], rotation[3], rotation[6],
+                  rotation[1], rotation[4], rotation[7],
+                  rotation[2], rotation[5], rotation[8]);
+  mount_ = btTransform(rot, btVector3(position[0], position[1], position[2]));
+  channels_ = std::max(1, int(parameters[0]));
+  double min_elevation = parameters[1];
+  double max_elevation = parameters[2];
+  columns_per_revolution_ = std::max(1, int(parameters[3]));
+  spin_rate_ = parameters[4];
+  max_range_ = parameters[5];
+  capacity_ = std::max(1, int(parameters[6]));
+  for (int c = 0; c < channels_; c++) {
+    double elevation = channels_ > 1 ?
+        min_elevation + (max_elevation - min_elevation) * c / (channels_ - 1)
+        : min_elevation;
+    cos_elevation_.push_back(std::cos(elevation));
+    sin_elevation_.push_back(std::sin(elevation));
+  }
+  points_.resize(kPointSize * capacity_);
+}
+
+void LidarSensor::Scan(const btCollisionObject* chassis, double now,
+                       double dt, RaycastEngine* engine) {
+  double end = column_ + columns_per_revolution_ * spin_rate_ * dt;
+  int first = std::ceil(column_);
+  int columns = std::ceil(end) - first;
+  column_ = std::fmod(end, columns_per_revolution_);
+  if (columns <= 0) {
+    return;
+  }
+  // A very slow step can't sweep more than a whole turn.
+  columns = std::min(columns, columns_per_revolution_);
+
+  btTransform sensor = chassis->getWorldTransform() * mount_;
+  const btVector3& origin = sensor.getOrigin();
+  const btMatrix3x3& basis = sensor.getBasis();
+  int n = columns * channels_;
+  origins_.resize(3 * n);
+  directions_.resize(3 * n);
+  hits_.resize(3 * n);
+  fractions_.resize(n);
+  int ray = 0;
+  for (int k = 0; k < columns; k++) {
+    double azimuth = 2 * M_PI * (first + k) / columns_per_revolution_;
+    double cos_azimuth = std::cos(azimuth), sin_azimuth = std::sin(azimuth);
+    for (int c = 0; c < channels_; c++, ray++) {
+      btVector3 direction = basis * btVector3(
+          cos_elevation_[c] * cos_azimuth, cos_elevation_[c] * sin_azimuth,
+          sin_elevation_[c]);
+      origins_[3 * ray] = origin.x();
+      origins_[3 * ray + 1] = origin.y();
+      origins_[3 * ray + 2] = origin.z();
+      directions_[3 * ray] = max_range_ * direction.x();
+      directions_[3 * ray + 1] = max_range_ * direction.y();
+      directions_[3 * ray + 2] = max_range_ * direction.z();
+    }
+  }
+  engine->Cast(n, origins_.data(), directions_.data(), no_ids_, hits_.data(),
+               NULL, fractions_.data(), NULL, NULL, chassis);
+
+  for (int i = 0; i < n; i++) {
+    if (fractions_[i] >= 1) {
+      continue;
+    }
+    double* point = &points_[kPointSize * (written_ % capacity_)];
+    point[0] = hits_[3 * i];
+    point[1] = hits_[3 * i + 1];
+    point[2] = hits_[3 * i + 2];
+    point[3] = fractions_[i] * max_range_;
+    point[4] = now;
+    written_++;
+  }
+}
+
+long LidarSensor::Read(long since, std::vector<double>* out) {
+  long start = std::max(since, std::max(0L, written_ - capacity_));
+  out->resize(kPointSize * std::max(0L, written_ - start));
+  // The points wrap around the end of the ring at most once.
+  long first = start % capacity_;
+  long count = out->size() / kPointSize;
+  long before_wrap = std::min(count, capacity_ - first);
+  std::copy(points_.begin() + kPointSize * first,
+            points_.begin() + kPointSize * (first + before_wrap),
+            out->begin());
+  std::copy(points_.begin(),
+            points_.begin() + kPointSize * (count - before_wrap),
+            out->begin() + kPointSize * before_wrap);
+  return written_;
+}
@@ -0,0 +1,76 @@
+/**
+ * LidarSensor: a spinning range sensor mounted on a raycast vehicle's
+ * chassis. Every step it sweeps the slice of its revolution that the step
+ * covers, casts one ray per channel per column of that slice as a single
+ * RaycastEngine batch, and appends the hits to a preallocated ring buffer.
+ *
+ * Parameters, in order:
+ *   channels               rows of the scan pattern
+ *   min_elevation          lowest channel's angle above horizontal (rad)
+ *   max_elevation          highest channel's angle (rad)
+ *   columns_per_revolution azimuth samples per turn
+ *   spin_rate              turns per second
+ *   max_range              meters
+ *   capacity               points the ring buffer holds
+ *
+ * Points are kPointSize doubles: the world position of the hit, its range
+ * and the simulated time of the scan that saw it. Misses aren't stored.
+ */
+
+#pragma once
+
+#include <bullet/btBulletDynamicsCommon.h>
+#include <unordered_map>
+#include <vector>
+
+class RaycastEngine;
+
+class LidarSensor {
+ public:
+  static const int kNumParameters = 7;
+  static const int kPointSize = 5;
+
+  // position and rotation (3x3, column-major) place the sensor in the
+  // chassis frame. The sensor looks along its x axis at azimuth 0.
+  LidarSensor(int vehicle_id, double* position, double* rotation,
+              double* parameters);
+
+  int vehicle_id() {
+    return vehicle_id_;
+  }
+
+  // Sweeps the part of a revolution covering the dt seconds just simulated,
+  // from where chassis is now, stamping the points with the simulated time
+  // now. The rays pass through chassis, so a sensor mounted inside it
+  // still sees out.
+  void Scan(const btCollisionObject* chassis, double now, double dt,
+            RaycastEngine* engine);
+
+  // Replaces out with the points written since cursor since (oldest first,
+  // and no older than the buffer still holds) and returns the cursor to
+  // pass next time. The first call can pass 0.
+  long Read(long since, std::vector<double>* out);
+
+ private:
+  int vehicle_id_;
+  btTransform mount_;
+  int channels_;
+  int columns_per_revolution_;
+  double spin_rate_;
+  double max_range_;
+  int capacity_;
+  // cos and sin of each channel's elevation
+  std::vector<double> cos_elevation_;
+  std::vector<double> sin_elevation_;
+  // Where the sweep is, in columns (fractional, carried between steps)
+  double column_;
+  // The ring buffer, and how many points have ever been written to it
+  std::vector<double> points_;
+  long written_;
+  // Per-scan ray and result scratch, kept to avoid reallocating
+  std::vector<double> origins_;
+  std::vector<double> directions_;
+  std::vector<double> hits_;
+  std::vector<double> fractions_;
+  std::unordered_map<const btCollisionObject*, int> no_ids_;
+};
@@ -68,8 +68,10 @@ int main(int argc, char* argv[]) {
 
   while (1) {
     world.RunSimulation();
-    std::vector<double> pose = world.GetShapeTransform(0);
-    std::vector<double> pose2 = world.GetShapeTransform(1);
+    double pose[12];
+    double pose2[12];
+    world.GetShapeTransform(0, pose);
+    world.GetShapeTransform(1, pose2);
     double position[3];
     //Position
     memcpy( position, &pose2[0], sizeof( double ) * 3 );
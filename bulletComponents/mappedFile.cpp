@@ -0,0 +1,52 @@
+#include "mappedFile.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile() : data_(NULL), size_(0) {
+}
+
+MappedFile::~MappedFile() {
+  Close();
+}
+
+bool MappedFile::Open(const std::string& path) {
+  Close();
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size == 0) {
+    close(fd);
+    return false;
+  }
+  void* data = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  // The mapping keeps the file alive on its own.
+  close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  data_ = static_cast<char*>(data);
+  size_ = info.st_size;
+  return true;
+}
+
+void MappedFile::Close() {
+  if (data_) {
+    munmap(data_, size_);
+    data_ = NULL;
+    size_ = 0;
+  }
+}
+
+void MappedFile::Release(size_t offset, size_t length) {
+  // madvise works on whole pages, so only drop the ones inside the range.
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t first = (offset + page - 1) / page * page;
+  size_t last = (offset + length) / page * page;
+  if (last > first && last <= size_) {
+    madvise(data_ + first, last - first, MADV_DONTNEED);
+  }
+}
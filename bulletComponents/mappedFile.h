@@ -0,0 +1,35 @@
+/**
+ * MappedFile: a whole file mapped read-only, for data we hand to Bullet
+ * in place (terrain heights) instead of copying it in. The mapping lives
+ * as long as the MappedFile does.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+class MappedFile {
+ public:
+  MappedFile();
+  ~MappedFile();
+
+  bool Open(const std::string& path);
+  void Close();
+
+  // Tells the OS we're done with [offset, offset + length) for now. The
+  // pages come back from the file if they're touched again.
+  void Release(size_t offset, size_t length);
+
+  const char* data() {
+    return data_;
+  }
+
+  size_t size() {
+    return size_;
+  }
+
+ private:
+  char* data_;
+  size_t size_;
+};
@@ -0,0 +1,87 @@
+#include "poseMap.h"
+#include <atomic>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+PoseMap::PoseMap() : fd_(-1), data_(NULL), size_(0) {
+}
+
+PoseMap::~PoseMap() {
+  Close();
+}
+
+bool PoseMap::Open(const std::string& path, int capacity) {
+  Close();
+  fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd_ < 0) {
+    return false;
+  }
+  path_ = path;
+  if (!Map(capacity < 1 ? 1 : capacity)) {
+    Close();
+    return false;
+  }
+  return true;
+}
+
+void PoseMap::Close() {
+  if (data_) {
+    munmap(data_, size_);
+    data_ = NULL;
+    size_ = 0;
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+  path_.clear();
+}
+
+// (Re)sizes the file for capacity poses and maps it, keeping the header.
+bool PoseMap::Map(int capacity) {
+  double header[kHeaderSize] = {0, 0, 0, 0};
+  if (data_) {
+    for (int i = 0; i < kHeaderSize; i++) {
+      header[i] = data_[i];
+    }
+    munmap(data_, size_);
+    data_ = NULL;
+  }
+  size_ = sizeof(double) * (kHeaderSize + 12 * (size_t)capacity);
+  if (ftruncate(fd_, size_) != 0) {
+    return false;
+  }
+  void* data = mmap(NULL, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  data_ = static_cast<double*>(data);
+  for (int i = 0; i < kHeaderSize; i++) {
+    data_[i] = header[i];
+  }
+  data_[3] = capacity;
+  return true;
+}
+
+double* PoseMap::BeginWrite(int num_poses) {
+  if (!data_) {
+    return NULL;
+  }
+  // Grow by doubling so a scene that keeps adding bodies doesn't remap
+  // every step.
+  if (num_poses > data_[3] && !Map(num_poses > 2 * data_[3] ?
+                                   num_poses : 2 * (int)data_[3])) {
+    return NULL;
+  }
+  data_[0] += 1;
+  std::atomic_thread_fence(std::memory_order_release);
+  data_[2] = num_poses;
+  return data_ + kHeaderSize;
+}
+
+void PoseMap::EndWrite() {
+  data_[1] += 1;
+  std::atomic_thread_fence(std::memory_order_release);
+  data_[0] += 1;
+}
@@ -0,0 +1,51 @@
+/**
+ * PoseMap: a file-backed, memory-mapped pose buffer that a BulletWorld
+ * rewrites after every step. Anything that can map the file, like MATLAB's
+ * memmapfile, reads the poses straight out of shared memory, with no MEX
+ * call and no copy.
+ *
+ * The file is all doubles:
+ *   header[0]  sequence: odd while a write is in progress
+ *   header[1]  frame: how many times the poses have been published
+ *   header[2]  num_poses: how many poses are valid
+ *   header[3]  capacity: how many poses the file has room for
+ *   then capacity poses of 12 doubles each, in GetAllTransforms order.
+ *
+ * Readers use the sequence as a seqlock: read it, copy the poses, and
+ * retry if it was odd or has changed since. If capacity changes, the file
+ * has grown and readers need to map it again.
+ */
+
+#pragma once
+
+#include <string>
+
+class PoseMap {
+ public:
+  static const int kHeaderSize = 4;
+
+  PoseMap();
+  ~PoseMap();
+
+  // Creates (or truncates) path with room for capacity poses and maps it.
+  bool Open(const std::string& path, int capacity);
+  void Close();
+
+  // Starts a publish of num_poses poses, growing the file if it needs to.
+  // Returns where to write them, or NULL if the file couldn't grow, in
+  // which case there's nothing to end.
+  double* BeginWrite(int num_poses);
+  void EndWrite();
+
+  const std::string& path() {
+    return path_;
+  }
+
+ private:
+  bool Map(int capacity);
+
+  std::string path_;
+  int fd_;
+  double* data_;
+  size_t size_;
+};
@@ -0,0 +1,105 @@
+#include "raycastEngine.h"
+#include <bullet/btBulletDynamicsCommon.h>
+#include <bullet/BulletCollision/BroadphaseCollision/btDbvt.h>
+#include <bullet/BulletCollision/BroadphaseCollision/btDbvtBroadphase.h>
+#include <algorithm>
+
+// Rays go to the pool in blocks this big, so each hand-off is worth it.
+static const int kRaysPerBlock = 256;
+
+namespace {
+
+// Tests one ray against every body whose broadphase leaf it reaches,
+// other than ignore.
+struct RayCollector : public btDbvt::ICollide {
+  RayCollector(const btTransform& from, const btTransform& to,
+               btCollisionWorld::RayResultCallback* callback,
+               const btCollisionObject* ignore) :
+    from_(from), to_(to), callback_(callback), ignore_(ignore) {
+  }
+
+  void Process(const btDbvtNode* leaf) {
+    btBroadphaseProxy* proxy = static_cast<btBroadphaseProxy*>(leaf->data);
+    btCollisionObject* object =
+        static_cast<btCollisionObject*>(proxy->m_clientObject);
+    if (object == ignore_ || !callback_->needsCollision(proxy)) {
+      return;
+    }
+    btCollisionWorld::rayTestSingle(from_, to_, object,
+                                    object->getCollisionShape(),
+                                    object->getWorldTransform(), *callback_);
+  }
+
+  btTransform from_;
+  btTransform to_;
+  btCollisionWorld::RayResultCallback* callback_;
+  const btCollisionObject* ignore_;
+};
+
+}  // namespace
+
+RaycastEngine::RaycastEngine(btDbvtBroadphase* broadphase) :
+  broadphase_(broadphase)
+{
+}
+
+ThreadPool& RaycastEngine::Pool() {
+  static ThreadPool pool;
+  return pool;
+}
+
+void RaycastEngine::Cast(
+    int n, const double* origins, const double* directions,
+    const std::unordered_map<const btCollisionObject*, int>& ids,
+    double* hits, double* normals, double* fractions, double* bodies,
+    const btCollisionObject** objects, const btCollisionObject* ignore) {
+  int blocks = (n + kRaysPerBlock - 1) / kRaysPerBlock;
+  Pool().ParallelFor(blocks, [&](int block, int) {
+      int end = std::min(n, (block + 1) * kRaysPerBlock);
+      for (int i = block * kRaysPerBlock; i < end; i++) {
+        const double* origin = origins + 3 * i;
+        const double* direction = directions + 3 * i;
+        btVector3 ray_from(origin[0], origin[1], origin[2]);
+        btVector3 ray_to = ray_from +
+            btVector3(direction[0], direction[1], direction[2]);
+        btCollisionWorld::ClosestRayResultCallback callback(ray_from, ray_to);
+        btTransform from, to;
+        from.setIdentity();
+        from.setOrigin(ray_from);
+        to.setIdentity();
+        to.setOrigin(ray_to);
+        RayCollector collector(from, to, &callback, ignore);
+        // m_sets[0] holds the moving bodies and m_sets[1] the static ones.
+        btDbvt::rayTest(broadphase_->m_sets[0].m_root, ray_from, ray_to,
+                        collector);
+        btDbvt::rayTest(broadphase_->m_sets[1].m_root, ray_from, ray_to,
+                        collector);
+
+        bool hit = callback.hasHit();
+        btVector3 point = hit ? callback.m_hitPointWorld : ray_to;
+        btVector3 normal = hit ? callback.m_hitNormalWorld
+                               : btVector3(0, 0, 0);
+        if (hits) {
+          hits[3 * i] = point.x();
+          hits[3 * i + 1] = point.y();
+          hits[3 * i + 2] = point.z();
+        }
+        if (normals) {
+          normals[3 * i] = normal.x();
+          normals[3 * i + 1] = normal.y();
+          normals[3 * i + 2] = normal.z();
+        }
+        if (fractions) {
+          fractions[i] = hit ? callback.m_closestHitFraction : 1;
+        }
+        if (bodies) {
+          std::unordered_map<const btCollisionObject*, int>::const_iterator
+              id = hit ? ids.find(callback.m_collisionObject) : ids.end();
+          bodies[i] = id == ids.end() ? -1 : id->second;
+        }
+        if (objects) {
+          objects[i] = hit ? callback.m_collisionObject : NULL;
+        }
+      }
+    });
+}
@@ -0,0 +1,43 @@
+/**
+ * RaycastEngine: casts big batches of rays (simulated lidar, traversability
+ * checks) across a thread pool. btCollisionWorld::rayTest shares scratch
+ * state inside the broadphase, so instead each ray walks the broadphase
+ * trees with btDbvt's re-entrant rayTest and tests the bodies it reaches
+ * itself. Nothing is written to the world, so the rays can run in
+ * parallel as long as nobody steps or edits it meanwhile.
+ *
+ * Every engine (one per world, and so one per clone) casts on the same
+ * process-wide pool, so rollouts over many clones don't multiply threads.
+ */
+
+#pragma once
+
+#include "threadPool.h"
+#include <unordered_map>
+
+class btCollisionObject;
+class btDbvtBroadphase;
+
+class RaycastEngine {
+ public:
+  explicit RaycastEngine(btDbvtBroadphase* broadphase);
+
+  // Casts ray i from origins[3i] to origins[3i] + directions[3i]. For each
+  // ray, hits (3n) gets the closest hit point, normals (3n) its normal,
+  // fractions (n) how far along the ray it is and bodies (n) the id of the
+  // object hit, looked up in ids (-1 if it isn't there). A miss gets the
+  // ray's end point, a zero normal, fraction 1 and body -1. objects, if
+  // given, gets the object each ray hit itself (NULL on a miss). Any of
+  // the outputs may be null. The rays pass through ignore, if given.
+  void Cast(int n, const double* origins, const double* directions,
+            const std::unordered_map<const btCollisionObject*, int>& ids,
+            double* hits, double* normals, double* fractions,
+            double* bodies, const btCollisionObject** objects = NULL,
+            const btCollisionObject* ignore = NULL);
+
+ private:
+  // One worker per hardware thread, shared by every engine
+  static ThreadPool& Pool();
+
+  btDbvtBroadphase* broadphase_;
+};
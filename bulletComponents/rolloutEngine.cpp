@@ -0,0 +1,80 @@
+#include "rolloutEngine.h"
+#include <exception>
+#include <mutex>
+
+RolloutEngine::RolloutEngine(BulletWorld* world, int num_threads) :
+  world_(world), scene_version_(-1), pool_(num_threads)
+{
+}
+
+void RolloutEngine::Run(int vehicle_id, int num_rollouts, int num_steps,
+                        const double* steering, const double* force,
+                        const double* goal, double* final_poses,
+                        double* costs) {
+  // Anything added to the source or any terrain edited since our clones
+  // were built makes them stale, so start over.
+  if (scene_version_ != world_->SceneVersion()) {
+    clones_.clear();
+    clones_.resize(pool_.size());
+    scene_version_ = world_->SceneVersion();
+  }
+  std::vector<double> start;
+  world_->GetState(&start);
+  // An exception can't leave a worker thread, so the first one waits here.
+  std::mutex error_mutex;
+  std::exception_ptr error;
+  pool_.ParallelFor(num_rollouts, [&](int k, int worker) {
+      {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (error) {
+          return;
+        }
+      }
+      try {
+        Rollout(vehicle_id, k, num_rollouts, num_steps, start,
+                steering + k * num_steps, force + k * num_steps, goal,
+                worker, final_poses, costs);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error) {
+          error = std::current_exception();
+        }
+      }
+    });
+  if (error) {
+    // A clone that threw partway through may be in any state.
+    clones_.clear();
+    clones_.resize(pool_.size());
+    std::rethrow_exception(error);
+  }
+}
+
+void RolloutEngine::Rollout(int vehicle_id, int k, int num_rollouts,
+                            int num_steps, const std::vector<double>& start,
+                            const double* rollout_steering,
+                            const double* rollout_force, const double* goal,
+                            int worker, double* final_poses, double* costs) {
+  std::unique_ptr<BulletWorld>& clone = clones_[worker];
+  if (!clone) {
+    clone = world_->Clone();
+  }
+  clone->SetState(start);
+  for (int step = 0; step < num_steps; step++) {
+    clone->CommandRaycastVehicle(vehicle_id, rollout_steering[step],
+                                 rollout_force[step]);
+    clone->StepSimulation();
+  }
+  double pose[12 * 5];
+  clone->GetVehicleTransform(vehicle_id, pose);
+  for (int i = 0; i < 12; i++) {
+    final_poses[k + num_rollouts * i] = pose[i];
+  }
+  if (costs) {
+    costs[k] = 0;
+    if (goal) {
+      for (int i = 0; i < 3; i++) {
+        costs[k] += (pose[i] - goal[i]) * (pose[i] - goal[i]);
+      }
+    }
+  }
+}
@@ -0,0 +1,44 @@
+/**
+ * RolloutEngine: simulates many candidate command sequences for a raycast
+ * vehicle at once. Each worker thread keeps its own clone of the source
+ * BulletWorld, restores it to a snapshot of the source's current state
+ * before every rollout, and plays one command sequence through it.
+ */
+
+#pragma once
+
+#include "bulletWorld.h"
+#include "threadPool.h"
+
+class RolloutEngine {
+ public:
+  // num_threads <= 0 uses every hardware thread.
+  explicit RolloutEngine(BulletWorld* world, int num_threads = 0);
+
+  // Plays num_rollouts command sequences of num_steps each on raycast
+  // vehicle vehicle_id. steering and force are num_steps x num_rollouts,
+  // column-major, so each rollout's commands are contiguous. final_poses
+  // receives a num_rollouts x 12 column-major array of chassis poses (in
+  // GetShapeTransform order). If costs is non-null, costs[k] is the squared
+  // distance from rollout k's final position to goal, or 0 without a goal.
+  // If a rollout throws, the rest are skipped and Run rethrows it once the
+  // workers are done.
+  void Run(int vehicle_id, int num_rollouts, int num_steps,
+           const double* steering, const double* force, const double* goal,
+           double* final_poses, double* costs);
+
+ private:
+  // Plays rollout k on worker's clone, starting from state start.
+  void Rollout(int vehicle_id, int k, int num_rollouts, int num_steps,
+               const std::vector<double>& start,
+               const double* rollout_steering, const double* rollout_force,
+               const double* goal, int worker, double* final_poses,
+               double* costs);
+
+  BulletWorld* world_;
+  // Source SceneVersion our clones were built from
+  long scene_version_;
+  ThreadPool pool_;
+  // One clone per worker, built on first use
+  std::vector<std::unique_ptr<BulletWorld> > clones_;
+};
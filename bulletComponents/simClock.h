@@ -0,0 +1,33 @@
+/**
+ * SimClock: simulated seconds, which only move when a world steps. Anything
+ * timed against it (control delays, sensor timestamps) behaves the same
+ * whether the host runs the simulation at real time, 50x, or under a
+ * debugger.
+ *
+ * The world's stepping thread advances it; other threads may read Now().
+ */
+
+#pragma once
+
+#include <atomic>
+
+class SimClock {
+ public:
+  SimClock() : now_(0) {
+  }
+
+  double Now() const {
+    return now_.load(std::memory_order_acquire);
+  }
+
+  void Advance(double dt) {
+    now_.store(Now() + dt, std::memory_order_release);
+  }
+
+  void Set(double now) {
+    now_.store(now, std::memory_order_release);
+  }
+
+ private:
+  std::atomic<double> now_;
+};
@@ -0,0 +1,60 @@
+/**
+ * SpscQueue: a bounded, lock-free queue for exactly one producer thread and
+ * one consumer thread. Push and Pop never block; they fail instead when the
+ * queue is full or empty.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+template <typename T>
+class SpscQueue {
+ public:
+  explicit SpscQueue(int capacity)
+      : buffer_(capacity + 1), head_(0), tail_(0) {
+  }
+
+  // Producer side. Returns false if the queue is full.
+  bool Push(const T& item) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    size_t next = Next(tail);
+    if (next == head_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    buffer_[tail] = item;
+    tail_.store(next, std::memory_order_release);
+    return true;
+  }
+
+  // Producer side. How many more items Push will take; Pop only ever
+  // frees more.
+  size_t Free() {
+    size_t head = head_.load(std::memory_order_acquire);
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    return (head + buffer_.size() - tail - 1) % buffer_.size();
+  }
+
+  // Consumer side. Returns false if the queue is empty.
+  bool Pop(T* item) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    *item = buffer_[head];
+    head_.store(Next(head), std::memory_order_release);
+    return true;
+  }
+
+ private:
+  size_t Next(size_t index) {
+    return index + 1 == buffer_.size() ? 0 : index + 1;
+  }
+
+  // One slot always stays empty, so head_ == tail_ means empty.
+  std::vector<T> buffer_;
+  std::atomic<size_t> head_;
+  std::atomic<size_t> tail_;
+};
@@ -0,0 +1,74 @@
+#include "stepProfiler.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+static const char* kPhaseNames[StepProfiler::NUM_PHASES] = {
+  "terrain", "broadphase", "narrowphase", "solver", "actions", "sensors",
+  "pose_export", "step"
+};
+
+StepProfiler::StepProfiler() {
+  Reset();
+}
+
+const char* StepProfiler::PhaseName(int phase) {
+  return kPhaseNames[phase];
+}
+
+void StepProfiler::BeginStep() {
+  std::fill(step_seconds_, step_seconds_ + NUM_PHASES, 0.0);
+  step_phases_ = 0;
+  step_start_ = std::chrono::steady_clock::now();
+}
+
+void StepProfiler::EndStep() {
+  Add(STEP, std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - step_start_).count());
+  for (int phase = 0; phase < NUM_PHASES; phase++) {
+    if (!(step_phases_ & (1u << phase))) {
+      continue;
+    }
+    double seconds = step_seconds_[phase];
+    Histogram& histogram = histograms_[phase];
+    histogram.count++;
+    histogram.total_seconds += seconds;
+    histogram.max_seconds = std::max(histogram.max_seconds, seconds);
+    double ns = 1e9 * seconds;
+    int bucket = ns < 1 ? 0 : std::min(kNumBuckets - 1, (int)std::log2(ns));
+    histogram.buckets[bucket]++;
+  }
+}
+
+void StepProfiler::Reset() {
+  std::memset(histograms_, 0, sizeof(histograms_));
+  std::fill(step_seconds_, step_seconds_ + NUM_PHASES, 0.0);
+  step_phases_ = 0;
+}
+
+// btCollisionWorld's version, split so the broadphase and narrowphase
+// can be timed apart.
+void ProfiledDynamicsWorld::performDiscreteCollisionDetection() {
+  {
+    StepProfiler::Timer timer(profiler_, StepProfiler::BROADPHASE);
+    updateAabbs();
+    getBroadphase()->calculateOverlappingPairs(getDispatcher());
+  }
+  StepProfiler::Timer timer(profiler_, StepProfiler::NARROWPHASE);
+  if (getDispatcher()) {
+    getDispatcher()->dispatchAllCollisionPairs(
+        getBroadphase()->getOverlappingPairCache(), getDispatchInfo(),
+        getDispatcher());
+  }
+}
+
+void ProfiledDynamicsWorld::solveConstraints(
+    btContactSolverInfo& solver_info) {
+  StepProfiler::Timer timer(profiler_, StepProfiler::SOLVER);
+  btDiscreteDynamicsWorld::solveConstraints(solver_info);
+}
+
+void ProfiledDynamicsWorld::updateActions(btScalar time_step) {
+  StepProfiler::Timer timer(profiler_, StepProfiler::ACTIONS);
+  btDiscreteDynamicsWorld::updateActions(time_step);
+}
@@ -0,0 +1,114 @@
+/**
+ * StepProfiler: how long each phase of StepSimulation takes, as a
+ * histogram per phase over every step so far. Bullet's own profiler is
+ * compiled out (BT_NO_PROFILE), so this is ours, and it is always on: a
+ * step costs a couple of dozen clock reads.
+ *
+ * A phase's time for a step is the sum over that step's internal steps,
+ * and a step only counts toward the phases it actually timed (a step with
+ * no lidars doesn't add a zero to SENSORS). Histogram bucket i counts
+ * steps whose phase took [2^i, 2^(i + 1)) nanoseconds (bucket 0 also
+ * takes anything shorter).
+ *
+ * ProfiledDynamicsWorld is the dynamics world that reports the phases
+ * inside Bullet's step to a StepProfiler.
+ */
+
+#pragma once
+
+#include <bullet/btBulletDynamicsCommon.h>
+#include <chrono>
+
+class StepProfiler {
+ public:
+  enum Phase {
+    // Paging terrain tiles in and out
+    TERRAIN,
+    // Bounding boxes and overlapping pairs
+    BROADPHASE,
+    // Contact points for those pairs
+    NARROWPHASE,
+    // The constraint solver
+    SOLVER,
+    // Raycast vehicles and fleets
+    ACTIONS,
+    // Lidar scans
+    SENSORS,
+    // Trace records and the shared pose map
+    POSE_EXPORT,
+    // The whole StepSimulation
+    STEP,
+    NUM_PHASES
+  };
+  static const int kNumBuckets = 32;
+
+  struct Histogram {
+    long count;
+    double total_seconds;
+    double max_seconds;
+    long buckets[kNumBuckets];
+  };
+
+  // Times one phase from construction to destruction.
+  class Timer {
+   public:
+    Timer(StepProfiler* profiler, Phase phase) :
+      profiler_(profiler), phase_(phase),
+      start_(std::chrono::steady_clock::now()) {
+    }
+    ~Timer() {
+      profiler_->Add(phase_, std::chrono::duration<double>(
+          std::chrono::steady_clock::now() - start_).count());
+    }
+
+   private:
+    StepProfiler* profiler_;
+    Phase phase_;
+    std::chrono::steady_clock::time_point start_;
+  };
+
+  StepProfiler();
+
+  static const char* PhaseName(int phase);
+
+  void BeginStep();
+  void Add(Phase phase, double seconds) {
+    step_seconds_[phase] += seconds;
+    step_phases_ |= 1u << phase;
+  }
+  // Times STEP and puts each phase timed this step in its histogram.
+  void EndStep();
+
+  const Histogram& histogram(int phase) {
+    return histograms_[phase];
+  }
+  void Reset();
+
+ private:
+  std::chrono::steady_clock::time_point step_start_;
+  double step_seconds_[NUM_PHASES];
+  // Bit p is set once phase p has been timed this step
+  unsigned int step_phases_;
+  Histogram histograms_[NUM_PHASES];
+};
+
+class ProfiledDynamicsWorld : public btDiscreteDynamicsWorld {
+ public:
+  ProfiledDynamicsWorld(btDispatcher* dispatcher,
+                        btBroadphaseInterface* broadphase,
+                        btConstraintSolver* solver,
+                        btCollisionConfiguration* configuration,
+                        StepProfiler* profiler) :
+    btDiscreteDynamicsWorld(dispatcher, broadphase, solver, configuration),
+    profiler_(profiler) {
+  }
+
+  void performDiscreteCollisionDetection();
+
+ protected:
+  void solveConstraints(btContactSolverInfo& solver_info);
+  void updateActions(btScalar time_step);
+
+ private:
+  StepProfiler* profiler_;
+};
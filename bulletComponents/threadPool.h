@@ -0,0 +1,119 @@
+/**
+ * ThreadPool: a fixed set of worker threads that split a range of indices
+ * between them. Used anywhere we want to fan work out over the cores, like
+ * the rollout engine.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+ public:
+  // num_threads <= 0 means one worker per hardware thread.
+  explicit ThreadPool(int num_threads = 0)
+      : job_(NULL), job_size_(0), next_index_(0), active_workers_(0),
+        generation_(0), quit_(false) {
+    if (num_threads <= 0) {
+      num_threads = std::thread::hardware_concurrency();
+    }
+    if (num_threads <= 0) {
+      num_threads = 1;
+    }
+    for (int i = 0; i < num_threads; i++) {
+      threads_.emplace_back(&ThreadPool::WorkerLoop, this, i);
+    }
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      quit_ = true;
+    }
+    work_cv_.notify_all();
+    for (std::thread& thread : threads_) {
+      thread.join();
+    }
+  }
+
+  int size() {
+    return threads_.size();
+  }
+
+  // Calls fn(index, worker) for every index in [0, n) and returns once they
+  // have all finished. worker is in [0, size()), so callers can keep
+  // per-worker scratch state. A single index, or a call from inside any
+  // pool's worker, just runs on the calling thread as worker 0: handing
+  // one index off isn't worth it, and a nested loop could otherwise wait
+  // on workers that are busy waiting on it. Calls from different threads
+  // take turns.
+  void ParallelFor(int n, const std::function<void(int, int)>& fn) {
+    if (n <= 0) {
+      return;
+    }
+    if (n == 1 || InWorker()) {
+      for (int i = 0; i < n; i++) {
+        fn(i, 0);
+      }
+      return;
+    }
+    std::lock_guard<std::mutex> run_lock(run_mutex_);
+    std::unique_lock<std::mutex> lock(mutex_);
+    job_ = &fn;
+    job_size_ = n;
+    next_index_ = 0;
+    active_workers_ = threads_.size();
+    generation_++;
+    work_cv_.notify_all();
+    done_cv_.wait(lock, [this] { return active_workers_ == 0; });
+    job_ = NULL;
+  }
+
+ private:
+  // Whether this thread is a worker of some pool
+  static bool& InWorker() {
+    static thread_local bool in_worker = false;
+    return in_worker;
+  }
+
+  void WorkerLoop(int worker) {
+    InWorker() = true;
+    unsigned int seen = 0;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      work_cv_.wait(lock, [&] { return quit_ || generation_ != seen; });
+      if (quit_) {
+        return;
+      }
+      seen = generation_;
+      const std::function<void(int, int)>* job = job_;
+      int size = job_size_;
+      lock.unlock();
+      for (int i = next_index_++; i < size; i = next_index_++) {
+        (*job)(i, worker);
+      }
+      lock.lock();
+      if (--active_workers_ == 0) {
+        done_cv_.notify_all();
+      }
+    }
+  }
+
+  std::vector<std::thread> threads_;
+  // Held for a whole ParallelFor
+  std::mutex run_mutex_;
+  std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+  const std::function<void(int, int)>* job_;
+  int job_size_;
+  std::atomic<int> next_index_;
+  int active_workers_;
+  unsigned int generation_;
+  bool quit_;
+};
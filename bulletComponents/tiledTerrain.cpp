@@ -0,0 +1,160 @@
+#include "tiledTerrain.h"
+#include "bulletShapes/bullet_heightfield.h"
+#include <algorithm>
+#include <cmath>
+#include <set>
+
+TiledTerrain::TiledTerrain(btDiscreteDynamicsWorld* world, int radius) :
+  world_(world), radius_(radius), tiles_x_(0), tiles_y_(0), tile_size_(0),
+  spacing_(0), origin_x_(0), origin_y_(0)
+{
+}
+
+TiledTerrain::~TiledTerrain() {
+  while (!tiles_.empty()) {
+    UnloadTile(tiles_.begin()->first);
+  }
+}
+
+bool TiledTerrain::Open(const std::string& path) {
+  if (!file_.Open(path) || file_.size() < sizeof(double) * kHeaderSize) {
+    return false;
+  }
+  const double* header = reinterpret_cast<const double*>(file_.data());
+  tiles_x_ = header[0];
+  tiles_y_ = header[1];
+  tile_size_ = header[2];
+  spacing_ = header[3];
+  origin_x_ = header[4];
+  origin_y_ = header[5];
+  size_t expected = sizeof(double) * kHeaderSize + sizeof(float) *
+      (size_t)tiles_x_ * tiles_y_ * tile_size_ * tile_size_;
+  if (tiles_x_ < 1 || tiles_y_ < 1 || tile_size_ < 2 || spacing_ <= 0 ||
+      file_.size() < expected) {
+    file_.Close();
+    return false;
+  }
+  return true;
+}
+
+void TiledTerrain::Update(
+    const std::vector<std::pair<double, double> >& positions) {
+  double tile_span = (tile_size_ - 1) * spacing_;
+  std::vector<std::pair<int, int> > centers;
+  for (const std::pair<double, double>& position : positions) {
+    centers.push_back(std::make_pair(
+        (int)std::floor((position.first - origin_x_) / tile_span),
+        (int)std::floor((position.second - origin_y_) / tile_span)));
+  }
+  if (centers == centers_) {
+    return;
+  }
+  centers_ = centers;
+
+  // Everything within radius of someone stays or comes in; the rest goes.
+  std::set<int> wanted;
+  for (const std::pair<int, int>& center : centers_) {
+    for (int ty = center.second - radius_; ty <= center.second + radius_;
+         ty++) {
+      for (int tx = center.first - radius_; tx <= center.first + radius_;
+           tx++) {
+        if (tx >= 0 && tx < tiles_x_ && ty >= 0 && ty < tiles_y_) {
+          wanted.insert(ty * tiles_x_ + tx);
+        }
+      }
+    }
+  }
+  std::vector<int> unwanted;
+  for (std::pair<const int, std::unique_ptr<bullet_heightfield> >& tile :
+           tiles_) {
+    if (!wanted.count(tile.first)) {
+      unwanted.push_back(tile.first);
+    }
+  }
+  for (int key : unwanted) {
+    UnloadTile(key);
+  }
+  for (int key : wanted) {
+    if (!tiles_.count(key)) {
+      LoadTile(key % tiles_x_, key / tiles_x_);
+    }
+  }
+}
+
+bool TiledTerrain::Sample(double x, double y, double* z, double* normal) {
+  if (!file_.data()) {
+    return false;
+  }
+  // (u, v) is in samples across the whole map, and cells per tile is one
+  // less than samples, since neighbours share their edges.
+  int cells = tile_size_ - 1;
+  double u = (x - origin_x_) / spacing_;
+  double v = (y - origin_y_) / spacing_;
+  if (u < 0 || v < 0 || u > tiles_x_ * cells || v > tiles_y_ * cells) {
+    return false;
+  }
+  int cell_x = std::min((int)u, tiles_x_ * cells - 1);
+  int cell_y = std::min((int)v, tiles_y_ * cells - 1);
+  u -= cell_x;
+  v -= cell_y;
+  int i = cell_x % cells;
+  int j = cell_y % cells;
+  const float* heights = TileHeights(cell_x / cells, cell_y / cells);
+  auto height = [&](int x, int y) {
+    return (double)heights[y * tile_size_ + x];
+  };
+  // Bullet splits each cell from (i + 1, j) to (i, j + 1).
+  double dz_du, dz_dv;
+  if (u + v <= 1) {
+    dz_du = height(i + 1, j) - height(i, j);
+    dz_dv = height(i, j + 1) - height(i, j);
+    *z = height(i, j) + u * dz_du + v * dz_dv;
+  } else {
+    dz_du = height(i + 1, j + 1) - height(i, j + 1);
+    dz_dv = height(i + 1, j + 1) - height(i + 1, j);
+    *z = height(i + 1, j + 1) - (1 - u) * dz_du - (1 - v) * dz_dv;
+  }
+  if (normal) {
+    double n[3] = {-dz_du / spacing_, -dz_dv / spacing_, 1};
+    double norm = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+    for (int k = 0; k < 3; k++) {
+      normal[k] = n[k] / norm;
+    }
+  }
+  return true;
+}
+
+void TiledTerrain::GetBodies(std::vector<btRigidBody*>* bodies) {
+  for (std::pair<const int, std::unique_ptr<bullet_heightfield> >& tile :
+           tiles_) {
+    bodies->push_back(tile.second->rigidBodyPtr());
+  }
+}
+
+const float* TiledTerrain::TileHeights(int tx, int ty) {
+  size_t samples = (size_t)tile_size_ * tile_size_;
+  return reinterpret_cast<const float*>(
+      file_.data() + sizeof(double) * kHeaderSize) +
+      samples * (ty * tiles_x_ + tx);
+}
+
+void TiledTerrain::LoadTile(int tx, int ty) {
+  const float* heights = TileHeights(tx, ty);
+  double tile_span = (tile_size_ - 1) * spacing_;
+  std::unique_ptr<bullet_heightfield> tile(
+      new bullet_heightfield(tile_size_, tile_size_, heights, spacing_,
+                             origin_x_ + tx * tile_span,
+                             origin_y_ + ty * tile_span));
+  world_->addRigidBody(tile->rigidBodyPtr());
+  tiles_[ty * tiles_x_ + tx] = std::move(tile);
+}
+
+void TiledTerrain::UnloadTile(int key) {
+  std::map<int, std::unique_ptr<bullet_heightfield> >::iterator tile =
+      tiles_.find(key);
+  world_->removeRigidBody(tile->second->rigidBodyPtr());
+  tiles_.erase(tile);
+  // Let the OS drop the pages too; they come back from the file if needed.
+  size_t bytes = sizeof(float) * tile_size_ * tile_size_;
+  file_.Release(sizeof(double) * kHeaderSize + bytes * key, bytes);
+}
@@ -0,0 +1,76 @@
+/**
+ * TiledTerrain: a heightfield map too big to hold in memory at once. The
+ * map lives in a memory-mapped tile file, and only the tiles around each
+ * raycast vehicle are in the dynamics world at any time. That bounds memory
+ * and broadphase size no matter how big the map is.
+ *
+ * The tile file (see WriteTerrainTiles.m) starts with 8 doubles:
+ *   tiles_x, tiles_y, tile_size, spacing, origin_x, origin_y, 0, 0
+ * followed by tiles_x * tiles_y tiles of tile_size x tile_size float32
+ * heights. Tile (tx, ty) is number ty * tiles_x + tx, and its height
+ * (x, y) is at index y * tile_size + x, with x along world x. Neighbouring
+ * tiles share their edge samples, so a tile spans (tile_size - 1) *
+ * spacing meters and its sample (0, 0) is at
+ *   origin + (tx, ty) * (tile_size - 1) * spacing.
+ * Tiles are handed to Bullet straight from the mapping, without a copy.
+ */
+
+#pragma once
+
+#include "mappedFile.h"
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+class btDiscreteDynamicsWorld;
+class btRigidBody;
+class bullet_heightfield;
+
+class TiledTerrain {
+ public:
+  static const int kHeaderSize = 8;
+
+  // Tiles within radius tiles (in x and y) of a vehicle's tile get loaded.
+  TiledTerrain(btDiscreteDynamicsWorld* world, int radius);
+  ~TiledTerrain();
+
+  bool Open(const std::string& path);
+
+  // Pages tiles in and out around the given (x, y) positions. Only does
+  // any work when one of them has crossed into a different tile.
+  void Update(const std::vector<std::pair<double, double> >& positions);
+
+  // The ground height and normal at (x, y), on the triangles Bullet would
+  // collide with (see bullet_heightfield::Sample), read straight from the
+  // file so the tile needn't be loaded. False if (x, y) is off the map.
+  bool Sample(double x, double y, double* z, double* normal);
+
+  // Appends the loaded tiles' bodies, by tile number.
+  void GetBodies(std::vector<btRigidBody*>* bodies);
+
+  int NumLoadedTiles() {
+    return tiles_.size();
+  }
+
+ private:
+  // Heights of tile (tx, ty), as laid out in the file
+  const float* TileHeights(int tx, int ty);
+  void LoadTile(int tx, int ty);
+  void UnloadTile(int key);
+
+  btDiscreteDynamicsWorld* world_;
+  int radius_;
+  MappedFile file_;
+  int tiles_x_;
+  int tiles_y_;
+  int tile_size_;
+  double spacing_;
+  double origin_x_;
+  double origin_y_;
+  // Which tile each position was in at the last Update
+  std::vector<std::pair<int, int> > centers_;
+  // Loaded tiles, keyed by ty * tiles_x + tx
+  std::map<int, std::unique_ptr<bullet_heightfield> > tiles_;
+};
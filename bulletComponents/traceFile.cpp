@@ -0,0 +1,219 @@
+#include "traceFile.h"
+#include <algorithm>
+#include <cstring>
+
+static const char kMagic[8] = {'B', 'S', 'T', 'R', 'A', 'C', 'E', '1'};
+static const size_t kHeaderSize = sizeof(kMagic) + sizeof(double) +
+    sizeof(int32_t);
+// uint8 keyframe, uint32 num_commands, uint32 num_poses, double time
+static const size_t kRecordHeaderSize = 1 + 4 + 4 + 8;
+static const size_t kCommandSize = 1 + 4 + 8 + 8;
+
+template <typename T>
+static void Put(const T& value, std::vector<char>* out) {
+  const char* bytes = reinterpret_cast<const char*>(&value);
+  out->insert(out->end(), bytes, bytes + sizeof(T));
+}
+
+template <typename T>
+static T Get(const char*& in) {
+  T value;
+  std::memcpy(&value, in, sizeof(T));
+  in += sizeof(T);
+  return value;
+}
+
+static uint64_t Bits(double value) {
+  uint64_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+/*********************************************************************
+ *WRITING
+ **********************************************************************/
+
+TraceWriter::TraceWriter() : file_(NULL), keyframe_interval_(1),
+                             records_(0) {
+}
+
+TraceWriter::~TraceWriter() {
+  Close();
+}
+
+bool TraceWriter::Open(const std::string& path, double timestep,
+                       int keyframe_interval) {
+  Close();
+  file_ = std::fopen(path.c_str(), "wb");
+  if (!file_) {
+    return false;
+  }
+  keyframe_interval_ = std::max(1, keyframe_interval);
+  records_ = 0;
+  commands_.clear();
+  previous_.clear();
+  std::vector<char> header(kMagic, kMagic + sizeof(kMagic));
+  Put(timestep, &header);
+  Put((int32_t)keyframe_interval_, &header);
+  if (std::fwrite(header.data(), 1, header.size(), file_) != header.size()) {
+    Close();
+    return false;
+  }
+  return true;
+}
+
+void TraceWriter::Close() {
+  if (file_) {
+    std::fclose(file_);
+    file_ = NULL;
+  }
+}
+
+void TraceWriter::AddCommand(int kind, int id, double steering,
+                             double force) {
+  TraceCommand command = {kind, id, steering, force};
+  commands_.push_back(command);
+}
+
+void TraceWriter::WriteStep(double time, int num_poses, const double* poses) {
+  if (!file_) {
+    return;
+  }
+  size_t count = 12 * (size_t)num_poses;
+  bool keyframe = records_ % keyframe_interval_ == 0 ||
+      previous_.size() != count;
+  record_.clear();
+  Put((uint32_t)0, &record_);
+  Put((uint8_t)keyframe, &record_);
+  Put((uint32_t)commands_.size(), &record_);
+  Put((uint32_t)num_poses, &record_);
+  Put(time, &record_);
+  for (const TraceCommand& command : commands_) {
+    Put((uint8_t)command.kind, &record_);
+    Put((int32_t)command.id, &record_);
+    Put(command.steering, &record_);
+    Put(command.force, &record_);
+  }
+  if (keyframe) {
+    const char* bytes = reinterpret_cast<const char*>(poses);
+    record_.insert(record_.end(), bytes, bytes + sizeof(double) * count);
+  } else {
+    for (size_t i = 0; i < count; i++) {
+      uint64_t delta = Bits(poses[i]) ^ Bits(previous_[i]);
+      uint8_t n = 0;
+      while (n < 8 && (delta >> (8 * n)) != 0) {
+        n++;
+      }
+      record_.push_back(n);
+      for (uint8_t b = 0; b < n; b++) {
+        record_.push_back((char)(delta >> (8 * b)));
+      }
+    }
+  }
+  uint32_t size = record_.size() - sizeof(uint32_t);
+  std::memcpy(record_.data(), &size, sizeof(size));
+  std::fwrite(record_.data(), 1, record_.size(), file_);
+  if (keyframe) {
+    std::fflush(file_);
+  }
+  previous_.assign(poses, poses + count);
+  commands_.clear();
+  records_++;
+}
+
+/*********************************************************************
+ *READING
+ **********************************************************************/
+
+TraceReader::TraceReader() : timestep_(0), decoded_(-1) {
+}
+
+bool TraceReader::Open(const std::string& path) {
+  offsets_.clear();
+  keyframes_.clear();
+  decoded_ = -1;
+  if (!file_.Open(path) || file_.size() < kHeaderSize ||
+      std::memcmp(file_.data(), kMagic, sizeof(kMagic)) != 0) {
+    file_.Close();
+    return false;
+  }
+  const char* in = file_.data() + sizeof(kMagic);
+  timestep_ = Get<double>(in);
+  // Just hop from size to size; nothing is decoded until it's read.
+  size_t offset = kHeaderSize;
+  while (offset + sizeof(uint32_t) + kRecordHeaderSize <= file_.size()) {
+    in = file_.data() + offset;
+    uint32_t size = Get<uint32_t>(in);
+    if (size < kRecordHeaderSize ||
+        offset + sizeof(uint32_t) + size > file_.size()) {
+      break;
+    }
+    if (Get<uint8_t>(in)) {
+      keyframes_.push_back(offsets_.size());
+    }
+    offsets_.push_back(offset);
+    offset += sizeof(uint32_t) + size;
+  }
+  // A trace has to start with a keyframe to be decodable at all.
+  if (keyframes_.empty() || keyframes_[0] != 0) {
+    offsets_.clear();
+    keyframes_.clear();
+  }
+  return true;
+}
+
+bool TraceReader::ReadStep(int step, double* time,
+                           std::vector<double>* poses,
+                           std::vector<TraceCommand>* commands) {
+  if (step < 0 || step >= NumSteps()) {
+    return false;
+  }
+  Decode(step);
+  const char* in = file_.data() + offsets_[step] + sizeof(uint32_t) + 1;
+  uint32_t num_commands = Get<uint32_t>(in);
+  Get<uint32_t>(in);
+  *time = Get<double>(in);
+  commands->clear();
+  for (uint32_t i = 0; i < num_commands; i++) {
+    TraceCommand command;
+    command.kind = Get<uint8_t>(in);
+    command.id = Get<int32_t>(in);
+    command.steering = Get<double>(in);
+    command.force = Get<double>(in);
+    commands->push_back(command);
+  }
+  *poses = poses_;
+  return true;
+}
+
+void TraceReader::Decode(int step) {
+  // Start from the last keyframe at or before step, unless we're already
+  // between it and step.
+  int keyframe = *(std::upper_bound(keyframes_.begin(), keyframes_.end(),
+                                    step) - 1);
+  int from = decoded_ >= keyframe && decoded_ <= step ? decoded_ + 1 :
+      keyframe;
+  for (int record = from; record <= step; record++) {
+    const char* in = file_.data() + offsets_[record] + sizeof(uint32_t);
+    bool is_keyframe = Get<uint8_t>(in);
+    uint32_t num_commands = Get<uint32_t>(in);
+    size_t count = 12 * (size_t)Get<uint32_t>(in);
+    in += sizeof(double) + kCommandSize * num_commands;
+    if (is_keyframe) {
+      poses_.resize(count);
+      std::memcpy(poses_.data(), in, sizeof(double) * count);
+    } else {
+      for (size_t i = 0; i < count; i++) {
+        uint8_t n = Get<uint8_t>(in);
+        uint64_t delta = 0;
+        for (uint8_t b = 0; b < n; b++) {
+          delta |= (uint64_t)(uint8_t)in[b] << (8 * b);
+        }
+        in += n;
+        uint64_t bits = Bits(poses_[i]) ^ delta;
+        std::memcpy(&poses_[i], &bits, sizeof(bits));
+      }
+    }
+  }
+  decoded_ = step;
+}
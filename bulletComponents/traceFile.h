@@ -0,0 +1,106 @@
+/**
+ * Trace files: an append-only record of a run, one record per step, that
+ * can be read back at any step without re-simulating.
+ *
+ * A trace starts with a header:
+ *   char[8] "BSTRACE1", double timestep, int32 keyframe_interval
+ * and then holds one record per step, the first being the world as the
+ * trace started. A record is
+ *   uint32 size (bytes after this field), uint8 keyframe,
+ *   uint32 num_commands, uint32 num_poses, double time,
+ *   num_commands x {uint8 kind, int32 id, double steering, double force},
+ *   poses
+ * where the commands are those applied since the previous record and the
+ * poses are 12 doubles per body, in GetAllTransforms order. A keyframe
+ * holds them as they are. Any other record holds each double as its bits
+ * XORed with the previous record's: a byte count n, then the n low bytes
+ * of that XOR. Bodies that didn't move cost a byte per double. Every
+ * keyframe_interval-th record (and any record where the body count
+ * changes) is a keyframe, so reaching a step decodes at most that many
+ * records. Everything is in the host's byte order.
+ *
+ * The writer flushes at each keyframe. A trace cut off by a crash is
+ * still readable up to its last whole record.
+ */
+
+#pragma once
+
+#include "mappedFile.h"
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+struct TraceCommand {
+  enum Kind {
+    COMPOUND_VEHICLE = 0,
+    RAYCAST_VEHICLE = 1,
+    // id is the vehicle's place in the fleet
+    FLEET_VEHICLE = 2
+  };
+  int kind;
+  int id;
+  double steering;
+  double force;
+};
+
+class TraceWriter {
+ public:
+  TraceWriter();
+  ~TraceWriter();
+
+  bool Open(const std::string& path, double timestep, int keyframe_interval);
+  void Close();
+
+  // Queues a command for the next record.
+  void AddCommand(int kind, int id, double steering, double force);
+  // Appends a record of the queued commands and num_poses poses.
+  void WriteStep(double time, int num_poses, const double* poses);
+
+ private:
+  FILE* file_;
+  int keyframe_interval_;
+  long records_;
+  std::vector<TraceCommand> commands_;
+  // The last record's poses, which the next one is XORed against
+  std::vector<double> previous_;
+  // The record being put together, so it goes out in one fwrite
+  std::vector<char> record_;
+};
+
+class TraceReader {
+ public:
+  TraceReader();
+
+  // Maps the trace and finds its records. Records appended after this
+  // aren't seen; open it again for those.
+  bool Open(const std::string& path);
+
+  int NumSteps() {
+    return offsets_.size();
+  }
+
+  double timestep() {
+    return timestep_;
+  }
+
+  // Reads record step (0 being the world as the trace started): its time,
+  // poses and the commands applied just before it. Stepping forward one
+  // record at a time decodes one record per call.
+  bool ReadStep(int step, double* time, std::vector<double>* poses,
+                std::vector<TraceCommand>* commands);
+
+ private:
+  // Brings poses_ to record step, starting from decoded_ if it's on the
+  // way there.
+  void Decode(int step);
+
+  MappedFile file_;
+  double timestep_;
+  // Where each record starts, and which of them are keyframes
+  std::vector<size_t> offsets_;
+  std::vector<int> keyframes_;
+  // The record poses_ holds, or -1
+  int decoded_;
+  std::vector<double> poses_;
+};
@@ -0,0 +1,101 @@
+#include "vehicleFleet.h"
+#include "raycastEngine.h"
+
+FleetRaycaster::FleetRaycaster(btDynamicsWorld* world, VehicleFleet* fleet) :
+  world_(world), fleet_(fleet), next_(-1)
+{
+}
+
+void* FleetRaycaster::castRay(const btVector3& from, const btVector3& to,
+                              btVehicleRaycasterResult& result) {
+  const btCollisionObject* object;
+  btVector3 point, normal;
+  double fraction;
+  if (next_ < 0) {
+    btCollisionWorld::ClosestRayResultCallback callback(from, to);
+    world_->rayTest(from, to, callback);
+    object = callback.hasHit() ? callback.m_collisionObject : NULL;
+    point = callback.m_hitPointWorld;
+    normal = callback.m_hitNormalWorld;
+    fraction = callback.m_closestHitFraction;
+  } else {
+    int row = next_++;
+    object = fleet_->objects_[row];
+    const double* hit = &fleet_->hits_[3 * row];
+    const double* hit_normal = &fleet_->normals_[3 * row];
+    point = btVector3(hit[0], hit[1], hit[2]);
+    normal = btVector3(hit_normal[0], hit_normal[1], hit_normal[2]);
+    fraction = fleet_->fractions_[row];
+  }
+  // Only what we could drive on counts, as in btDefaultVehicleRaycaster.
+  const btRigidBody* body = object ? btRigidBody::upcast(object) : NULL;
+  if (!body || !body->hasContactResponse()) {
+    return NULL;
+  }
+  result.m_hitPointInWorld = point;
+  result.m_hitNormalInWorld = normal;
+  result.m_hitNormalInWorld.normalize();
+  result.m_distFraction = fraction;
+  return (void*)body;
+}
+
+VehicleFleet::VehicleFleet(RaycastEngine* raycasts) : raycasts_(raycasts) {
+}
+
+FleetRaycaster* VehicleFleet::NewRaycaster(btDynamicsWorld* world) {
+  FleetRaycaster* raycaster = new FleetRaycaster(world, this);
+  raycasters_.push_back(raycaster);
+  return raycaster;
+}
+
+void VehicleFleet::Add(btRaycastVehicle* vehicle) {
+  first_wheel_.push_back(first_wheel_.empty() ? 0 :
+                         first_wheel_.back() +
+                         vehicles_.back()->getNumWheels());
+  vehicles_.push_back(vehicle);
+  int wheels = first_wheel_.back() + vehicle->getNumWheels();
+  origins_.resize(3 * wheels);
+  directions_.resize(3 * wheels);
+  hits_.resize(3 * wheels);
+  normals_.resize(3 * wheels);
+  fractions_.resize(wheels);
+  objects_.resize(wheels);
+}
+
+void VehicleFleet::Command(const double* steering, const double* force) {
+  for (size_t v = 0; v < vehicles_.size(); v++) {
+    vehicles_[v]->setSteeringValue(steering[v], 0);
+    vehicles_[v]->setSteeringValue(steering[v], 1);
+    vehicles_[v]->applyEngineForce(force[v], 2);
+    vehicles_[v]->applyEngineForce(force[v], 3);
+  }
+}
+
+void VehicleFleet::updateAction(btCollisionWorld*, btScalar dt) {
+  // The same rays btRaycastVehicle::rayCast would cast, all at once.
+  int row = 0;
+  for (btRaycastVehicle* vehicle : vehicles_) {
+    for (int i = 0; i < vehicle->getNumWheels(); i++, row++) {
+      vehicle->updateWheelTransform(i, false);
+      const btWheelInfo& wheel = vehicle->getWheelInfo(i);
+      btScalar length = wheel.getSuspensionRestLength() + wheel.m_wheelsRadius;
+      const btVector3& origin = wheel.m_raycastInfo.m_hardPointWS;
+      btVector3 direction = wheel.m_raycastInfo.m_wheelDirectionWS * length;
+      for (int k = 0; k < 3; k++) {
+        origins_[3 * row + k] = origin[k];
+        directions_[3 * row + k] = direction[k];
+      }
+    }
+  }
+  raycasts_->Cast(row, origins_.data(), directions_.data(), no_ids_,
+                  hits_.data(), normals_.data(), fractions_.data(), NULL,
+                  objects_.data());
+
+  // Only positions feed the rays, and updateVehicle only changes
+  // velocities, so every vehicle sees what it would have cast itself.
+  for (size_t v = 0; v < vehicles_.size(); v++) {
+    raycasters_[v]->next_ = first_wheel_[v];
+    vehicles_[v]->updateVehicle(dt);
+    raycasters_[v]->next_ = -1;
+  }
+}
@@ -0,0 +1,74 @@
+/**
+ * VehicleFleet: steps many raycast vehicles as one action. Stepped one at a
+ * time, each btRaycastVehicle casts its own suspension rays through
+ * btCollisionWorld::rayTest, which dominates big fleets. The fleet instead
+ * gathers every wheel's ray into flat arrays, casts them all as a single
+ * parallel RaycastEngine batch, and then lets each vehicle compute its
+ * suspension and tire forces from the batch's results through its
+ * FleetRaycaster.
+ */
+
+#pragma once
+
+#include <bullet/btBulletDynamicsCommon.h>
+#include <bullet/BulletDynamics/Vehicle/btRaycastVehicle.h>
+#include <unordered_map>
+#include <vector>
+
+class RaycastEngine;
+class VehicleFleet;
+
+// Hands a fleet vehicle its wheel's row of the fleet's batch. Outside the
+// fleet's update (like OnTheGround's probes) it casts into the world the
+// way btDefaultVehicleRaycaster does.
+class FleetRaycaster : public btVehicleRaycaster {
+ public:
+  FleetRaycaster(btDynamicsWorld* world, VehicleFleet* fleet);
+
+  void* castRay(const btVector3& from, const btVector3& to,
+                btVehicleRaycasterResult& result);
+
+ private:
+  friend class VehicleFleet;
+  btDynamicsWorld* world_;
+  VehicleFleet* fleet_;
+  // The batch row for the next ray, or -1 outside the fleet's update
+  int next_;
+};
+
+class VehicleFleet : public btActionInterface {
+ public:
+  explicit VehicleFleet(RaycastEngine* raycasts);
+
+  // A raycaster for a vehicle about to join the fleet. The vehicle owns it.
+  FleetRaycaster* NewRaycaster(btDynamicsWorld* world);
+  // vehicle must have been built with the last NewRaycaster.
+  void Add(btRaycastVehicle* vehicle);
+
+  int size() {
+    return vehicles_.size();
+  }
+
+  // One steering angle and engine force per fleet vehicle, applied the way
+  // CommandRaycastVehicle does.
+  void Command(const double* steering, const double* force);
+
+  void updateAction(btCollisionWorld* world, btScalar dt);
+  void debugDraw(btIDebugDraw*) {}
+
+ private:
+  friend class FleetRaycaster;
+  RaycastEngine* raycasts_;
+  std::vector<btRaycastVehicle*> vehicles_;
+  std::vector<FleetRaycaster*> raycasters_;
+  // Every wheel's ray and its result, wheel after wheel, vehicle after
+  // vehicle. first_wheel_[v] is vehicle v's first row.
+  std::vector<int> first_wheel_;
+  std::vector<double> origins_;
+  std::vector<double> directions_;
+  std::vector<double> hits_;
+  std::vector<double> normals_;
+  std::vector<double> fractions_;
+  std::vector<const btCollisionObject*> objects_;
+  std::unordered_map<const btCollisionObject*, int> no_ids_;
+};
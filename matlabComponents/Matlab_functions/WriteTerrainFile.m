@@ -0,0 +1,29 @@
+function WriteTerrainFile( path, Z, spacing, origin )
+%WRITETERRAINFILE Writes a height grid as a file for AddTerrainFromFile
+%   Z(i, j) is the height at x = origin(1) + (j-1)*spacing,
+%   y = origin(2) + (i-1)*spacing, i.e. a meshgrid layout. Heights are
+%   quantized to int16 over the height range, around its middle. See
+%   BulletWorld::AddTerrainFromFile for the layout.
+if nargin < 4,
+  origin = [0, 0];
+end
+
+min_ht = min(Z(:));
+max_ht = max(Z(:));
+offset = (min_ht + max_ht) / 2;
+scale = (max_ht - min_ht) / 2 / 32767;
+if scale == 0,
+  scale = 1;
+end
+
+fid = fopen(path, 'w');
+if fid < 0,
+  error('WriteTerrainFile: Could not open %s', path);
+end
+fwrite(fid, [size(Z, 2), size(Z, 1), spacing, origin(1), origin(2), ...
+             scale, min_ht, max_ht, offset], 'double');
+% Column-major writes of the transpose give Z(y, x) at y*width + x.
+fwrite(fid, round((Z.' - offset) / scale), 'int16');
+fclose(fid);
+
+end
@@ -0,0 +1,35 @@
+function WriteTerrainTiles( path, Z, spacing, tile_size, origin )
+%WRITETERRAINTILES Writes a height grid as a tile file for AddTiledTerrain
+%   Z(i, j) is the height at x = origin(1) + (j-1)*spacing,
+%   y = origin(2) + (i-1)*spacing, i.e. a meshgrid layout. The grid is cut
+%   into tile_size x tile_size tiles that share their edge samples; the
+%   far edges are padded with the last row/column so every tile is full.
+%   See tiledTerrain.h for the layout.
+if nargin < 5,
+  origin = [0, 0];
+end
+
+step = tile_size - 1;
+tiles_y = max(1, ceil((size(Z, 1) - 1) / step));
+tiles_x = max(1, ceil((size(Z, 2) - 1) / step));
+rows = tiles_y * step + 1;
+cols = tiles_x * step + 1;
+Z = Z([1:size(Z, 1), repmat(size(Z, 1), 1, rows - size(Z, 1))], ...
+      [1:size(Z, 2), repmat(size(Z, 2), 1, cols - size(Z, 2))]);
+
+fid = fopen(path, 'w');
+if fid < 0,
+  error('WriteTerrainTiles: Could not open %s', path);
+end
+fwrite(fid, [tiles_x, tiles_y, tile_size, spacing, origin(1), origin(2), ...
+             0, 0], 'double');
+for ty = 0:tiles_y-1,
+  for tx = 0:tiles_x-1,
+    tile = Z(ty*step + (1:tile_size), tx*step + (1:tile_size));
+    % Column-major writes of the transpose give tile(y, x) at y*size + x.
+    fwrite(fid, tile.', 'single');
+  end
+end
+fclose(fid);
+
+end